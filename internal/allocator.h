@@ -33,17 +33,29 @@
 // 4. Call Decommit() once.
 // 5. The allocator is now reverted to its original state, except that
 //    it retained its allocated storage, so the next Commit() will be faster.
-//    The allocated storage is only freed when the Allocator object is
-//    destroyed.
+//    By default, the allocated storage is only freed when the Allocator
+//    object is destroyed. Trim() frees it on demand, set_max_retained_bytes
+//    bounds what each commit/decommit cycle retains, and set_decay_commits
+//    frees it once it has been oversized for a number of cycles.
+//
+// Commits can be nested: while committed, more blocks can be reserved and
+// committed as an inner scope, which the next Decommit() releases, leaving
+// the outer scopes' blocks in place. This lets code that already holds
+// blocks, e.g. a caller of a GEMM, get more of them from the same allocator.
+// There is no limit on the number of blocks.
 
 #ifndef GEMMLOWP_INTERNAL_ALLOCATOR_H_
 #define GEMMLOWP_INTERNAL_ALLOCATOR_H_
 
+#include <limits>
+#include <vector>
+
 #include "common.h"
 
 namespace gemmlowp {
 
-enum class TypeId : std::uint8_t { Uint8, Int8, Uint16, Int16, Uint32, Int32 };
+enum class TypeId : std::uint8_t { Uint8, Int8, Uint16, Int16, Uint32, Int32,
+                                Float };
 
 template <typename T>
 struct GetTypeIdImpl {};
@@ -68,50 +80,194 @@ GEMMLOWP_REGISTER_TYPEID(std::uint16_t, Uint16)
 GEMMLOWP_REGISTER_TYPEID(std::int16_t, Int16)
 GEMMLOWP_REGISTER_TYPEID(std::uint32_t, Uint32)
 GEMMLOWP_REGISTER_TYPEID(std::int32_t, Int32)
+GEMMLOWP_REGISTER_TYPEID(float, Float)
 
 class Allocator {
  public:
   Allocator()
-      : committed_(false),
-        storage_size_(0),
+      : storage_size_(0),
         storage_(nullptr),
-        reserved_blocks_(0),
+        use_huge_pages_(false),
+        external_storage_(nullptr),
+        external_storage_size_(0),
+        committed_blocks_(0),
         reserved_bytes_(0),
+        used_bytes_(0),
+        committed_bytes_(0),
+        high_water_mark_(0),
+        max_retained_bytes_(std::numeric_limits<std::size_t>::max()),
+        decay_commits_(0),
+        session_peak_bytes_(0),
+        recent_peak_bytes_(0),
+        underused_commits_(0),
         generation_(0) {}
 
   ~Allocator() {
-    assert(!committed_);
-    assert(!reserved_blocks_);
+    assert(scopes_.empty());
+    assert(blocks_.empty());
     DeallocateStorage();
   }
 
   // Alignment of allocated blocks.
   static constexpr std::size_t kAlignment = kDefaultCacheLineSize;
 
-  // This is all we need so far, and since the usage pattern is fixed,
-  // there is no point in allowing more until we need to.
-  static constexpr std::size_t kMaxBlocks = 5;
+  // Whether to back the storage with huge pages, see huge_page_alloc.
+  // Large packed blocks then span few pages, which cuts down dTLB misses
+  // in the kernels, at the cost of rounding the storage size up to at
+  // least kHugePageSize. Must not be called while committed.
+  void set_use_huge_pages(bool use_huge_pages) {
+    assert(!committed());
+    if (use_huge_pages != use_huge_pages_) {
+      DeallocateStorage();
+      use_huge_pages_ = use_huge_pages;
+    }
+  }
 
-  void Commit() {
-    assert(!committed_);
+  bool use_huge_pages() const { return use_huge_pages_; }
+
+  // Makes Commit() use the given externally owned buffer of the given size
+  // as storage, instead of allocating storage of its own: the allocator then
+  // never allocates memory, and Commit() fails if the reserved blocks don't
+  // fit. The buffer must be aligned on kAlignment. A null data pointer
+  // reverts to owned storage. Must not be called while committed.
+  void set_external_storage(void* data, std::size_t size) {
+    assert(!committed());
+    assert(!(reinterpret_cast<std::uintptr_t>(data) % kAlignment));
+    if (data) {
+      DeallocateStorage();
+    }
+    external_storage_ = data;
+    external_storage_size_ = size;
+  }
+
+  // Whether any scope is committed.
+  bool committed() const { return !scopes_.empty(); }
+
+  // The number of currently committed scopes.
+  std::size_t scope_depth() const { return scopes_.size(); }
+
+  // The number of bytes that Commit() needs for the blocks reserved so far.
+  std::size_t reserved_bytes() const { return reserved_bytes_; }
 
-    if (reserved_bytes_ > storage_size_) {
+  // The largest number of bytes that were ever committed at once, over all
+  // nested scopes. The storage is grown to that size when no scope is
+  // committed, so that nested commits then fit without allocating.
+  std::size_t high_water_mark() const { return high_water_mark_; }
+
+  // The number of bytes of storage owned by this allocator and retained
+  // between commits. Zero when using external storage.
+  std::size_t storage_size() const { return storage_size_; }
+
+  // Releases the owned storage if it is larger than max_bytes, and lowers
+  // the high water mark to max_bytes, so that the next Commit() allocates
+  // only what it needs, up to that. Must not be called while committed.
+  void Trim(std::size_t max_bytes) {
+    assert(!committed());
+    if (storage_size_ > max_bytes) {
       DeallocateStorage();
-      storage_size_ = RoundUpToPowerOfTwo(reserved_bytes_);
-      storage_ = aligned_alloc(kAlignment, storage_size_);
     }
+    high_water_mark_ = std::min(high_water_mark_, max_bytes);
+    recent_peak_bytes_ = 0;
+    underused_commits_ = 0;
+  }
+
+  // Makes the last Decommit() of each commit/decommit cycle Trim() the
+  // storage to max_bytes. Each cycle may still grow the storage beyond
+  // that while it is committed.
+  void set_max_retained_bytes(std::size_t max_bytes) {
+    max_retained_bytes_ = max_bytes;
+  }
 
-    ReleaseBuildAssertion(!storage_size_ || storage_, "allocation failure");
-    committed_ = true;
+  // Makes the allocator release its storage once it has been larger than
+  // needed for `commits` consecutive commit/decommit cycles, so that the
+  // next cycle reallocates it at the size needed by these recent cycles.
+  // The storage then stops being sized for a long gone peak. 0 disables.
+  void set_decay_commits(int commits) {
+    decay_commits_ = commits;
+    recent_peak_bytes_ = 0;
+    underused_commits_ = 0;
   }
 
+  int decay_commits() const { return decay_commits_; }
+
+  // Forgets the blocks reserved since the last Commit(), without committing
+  // them. This allows measuring the storage that a sequence of Reserve()
+  // calls needs.
+  void DiscardReservations() {
+    generation_++;
+
+    blocks_.resize(committed_blocks_);
+    reserved_bytes_ = 0;
+  }
+
+  // Commits the blocks reserved since the last Commit() as a new scope,
+  // nested in the currently committed scopes if any. The blocks of outer
+  // scopes remain valid. Nested scopes are carved out of the same storage,
+  // after the outer scopes; if they don't fit there (the first times the
+  // nesting gets this deep) they get storage of their own, and the shared
+  // storage is grown when all scopes have been decommitted.
+  void Commit() {
+    Scope scope;
+    scope.first_block = committed_blocks_;
+    scope.bytes = reserved_bytes_;
+    scope.overflow_storage = nullptr;
+
+    std::uint8_t* base = nullptr;
+    if (!committed()) {
+      assert(!used_bytes_);
+      if (external_storage_) {
+        ReleaseBuildAssertion(reserved_bytes_ <= external_storage_size_,
+                              "external storage too small");
+      } else {
+        GrowStorage(std::max(reserved_bytes_, high_water_mark_));
+      }
+    }
+    if (used_bytes_ + reserved_bytes_ <= capacity()) {
+      base = storage_base() + used_bytes_;
+      used_bytes_ += reserved_bytes_;
+    } else {
+      ReleaseBuildAssertion(!external_storage_, "external storage too small");
+      scope.overflow_storage = aligned_alloc(kAlignment, reserved_bytes_);
+      ReleaseBuildAssertion(scope.overflow_storage, "allocation failure");
+      base = static_cast<std::uint8_t*>(scope.overflow_storage);
+    }
+
+    for (std::size_t i = committed_blocks_; i < blocks_.size(); i++) {
+      blocks_[i].data = base + blocks_[i].offset;
+    }
+    committed_blocks_ = blocks_.size();
+    committed_bytes_ += reserved_bytes_;
+    high_water_mark_ = std::max(high_water_mark_, committed_bytes_);
+    session_peak_bytes_ =
+        scopes_.empty() ? committed_bytes_
+                        : std::max(session_peak_bytes_, committed_bytes_);
+    reserved_bytes_ = 0;
+    scopes_.push_back(scope);
+  }
+
+  // Decommits the innermost committed scope, invalidating the handles of
+  // its blocks and of any blocks reserved since. Once all scopes are
+  // decommitted, the allocator is reverted to its original state, except
+  // that it retained its allocated storage, so the next Commit() will be
+  // faster.
   void Decommit() {
-    assert(committed_);
-    committed_ = false;
+    assert(committed());
+    const Scope& scope = scopes_.back();
     generation_++;
 
-    reserved_blocks_ = 0;
+    if (scope.overflow_storage) {
+      aligned_free(scope.overflow_storage);
+    } else {
+      used_bytes_ -= scope.bytes;
+    }
+    committed_bytes_ -= scope.bytes;
+    blocks_.resize(scope.first_block);
+    committed_blocks_ = scope.first_block;
     reserved_bytes_ = 0;
+    scopes_.pop_back();
+    if (scopes_.empty()) {
+      ApplyRetentionPolicy();
+    }
   }
 
   // See generation_
@@ -121,7 +277,7 @@ class Allocator {
   // one by calling Reserve() and, after committing,
   // passes it to GetPointer().
   class Handle {
-    std::uint8_t index_;
+    std::uint32_t index_;
     generation_t generation_;
     TypeId type_;
 
@@ -129,66 +285,155 @@ class Allocator {
   };
 
   // Reserves a block sized for n elements of type T, and
-  // returns a handle to it. Must be called before committing.
+  // returns a handle to it. It is allocated by the next Commit().
   template <typename T>
   Handle Reserve(std::size_t n) {
-    assert(!committed_ && "can't reserve blocks while committed");
-    assert(reserved_blocks_ < kMaxBlocks &&
-           "didn't expect to allocate this many blocks");
-    const std::size_t bytes = RoundUp<kAlignment>(n * sizeof(T));
-    const std::size_t offset = reserved_bytes_;
-    const std::size_t index = reserved_blocks_;
-
-    reserved_blocks_offsets_[index] = offset;
+    Block block;
+    block.offset = reserved_bytes_;
+    block.generation = generation_;
+    block.data = nullptr;
+
     Handle h;
-    h.index_ = index;
+    h.index_ = static_cast<std::uint32_t>(blocks_.size());
     h.generation_ = generation_;
     h.type_ = GetTypeId<T>();
 
-    reserved_blocks_++;
-    reserved_bytes_ += bytes;
+    blocks_.push_back(block);
+    reserved_bytes_ += RoundUp<kAlignment>(n * sizeof(T));
 
     return h;
   }
 
   // Returns the pointer to the allocated buffer for the given handle.
-  // Must be called after committing.
+  // Must be called after committing the block.
   template <typename T>
   T* GetPointer(const Handle& h) const {
-    assert(committed_ && "can't get block pointers unless committed");
-    assert(h.index_ < reserved_blocks_ &&
+    assert(h.index_ < blocks_.size() &&
            "bad handle, points to inexistant block");
-    assert(h.generation_ == generation_ &&
+    assert(h.generation_ == blocks_[h.index_].generation &&
            "handle from earlier generation, have decommitted since");
+    assert(h.index_ < committed_blocks_ &&
+           "can't get block pointers unless committed");
     assert(h.type_ == GetTypeId<T>() && "type mismatch");
-    std::size_t offset = reserved_blocks_offsets_[h.index_];
-    std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(storage_) + offset;
-    return reinterpret_cast<T*>(addr);
+    return reinterpret_cast<T*>(blocks_[h.index_].data);
   }
 
  private:
+  struct Block {
+    // Offset into the scope's storage, set by Reserve().
+    std::size_t offset;
+    // The generation_ at the time of Reserve().
+    generation_t generation;
+    // Set by Commit().
+    std::uint8_t* data;
+  };
+
+  struct Scope {
+    // Index into blocks_ of the first block of this scope.
+    std::size_t first_block;
+    std::size_t bytes;
+    // Non-null if this scope did not fit in the shared storage.
+    void* overflow_storage;
+  };
+
+  std::size_t capacity() const {
+    return external_storage_ ? external_storage_size_ : storage_size_;
+  }
+
+  std::uint8_t* storage_base() const {
+    return static_cast<std::uint8_t*>(external_storage_ ? external_storage_
+                                                        : storage_);
+  }
+
+  // The size of the storage that GrowStorage(size) allocates.
+  std::size_t StorageSizeFor(std::size_t size) const {
+    const std::size_t rounded = RoundUpToPowerOfTwo(size);
+    return use_huge_pages_ ? std::max(rounded, kHugePageSize) : rounded;
+  }
+
+  void GrowStorage(std::size_t size) {
+    if (size <= storage_size_) {
+      return;
+    }
+    DeallocateStorage();
+    storage_size_ = StorageSizeFor(size);
+    if (use_huge_pages_) {
+      storage_ = huge_page_alloc(storage_size_);
+    } else {
+      storage_ = aligned_alloc(kAlignment, storage_size_);
+    }
+    ReleaseBuildAssertion(storage_, "allocation failure");
+  }
+
+  // Called when the outermost scope is decommitted.
+  void ApplyRetentionPolicy() {
+    if (decay_commits_ && storage_size_) {
+      recent_peak_bytes_ = std::max(recent_peak_bytes_, session_peak_bytes_);
+      if (StorageSizeFor(recent_peak_bytes_) < storage_size_) {
+        if (++underused_commits_ >= decay_commits_) {
+          Trim(recent_peak_bytes_);
+        }
+      } else {
+        recent_peak_bytes_ = 0;
+        underused_commits_ = 0;
+      }
+    }
+    if (storage_size_ > max_retained_bytes_) {
+      Trim(max_retained_bytes_);
+    }
+  }
+
   void DeallocateStorage() {
-    assert(!committed_);
-    aligned_free(storage_);
+    assert(!committed());
+    if (use_huge_pages_) {
+      huge_page_free(storage_, storage_size_);
+    } else {
+      aligned_free(storage_);
+    }
+    storage_ = nullptr;
     storage_size_ = 0;
   }
 
-  // Set to true by Commit() and to false by Decommit(). Initially false.
-  bool committed_;
-
-  // The actually allocated storage size and buffer pointer.
+  // The owned storage size and buffer pointer.
   std::size_t storage_size_;
-  mutable void* storage_;
-
-  // The number of blocks that have been reserved by Reserve().
-  std::size_t reserved_blocks_;
-  // The number of bytes that have been reserved by Reserve().
+  void* storage_;
+  // Whether storage_ was allocated by huge_page_alloc.
+  bool use_huge_pages_;
+
+  // See set_external_storage. When set, used instead of storage_.
+  void* external_storage_;
+  std::size_t external_storage_size_;
+
+  // All reserved blocks, committed ones first, in the order of Reserve().
+  // Like scopes_, this retains its capacity across commits, so it only
+  // allocates memory the first times the number of blocks gets this large.
+  std::vector<Block> blocks_;
+  // The number of blocks in committed scopes.
+  std::size_t committed_blocks_;
+  // The number of bytes reserved since the last Commit().
   std::size_t reserved_bytes_;
-  // The offsets of reserved blocks into the storage buffer.
-  std::size_t reserved_blocks_offsets_[kMaxBlocks];
+
+  // The committed scopes, innermost last.
+  std::vector<Scope> scopes_;
+  // The number of bytes of the shared storage used by committed scopes.
+  std::size_t used_bytes_;
+  // The number of bytes used by committed scopes, including overflow ones.
+  std::size_t committed_bytes_;
+  // See high_water_mark().
+  std::size_t high_water_mark_;
+
+  // See set_max_retained_bytes and set_decay_commits.
+  std::size_t max_retained_bytes_;
+  int decay_commits_;
+  // The peak committed bytes of the current or last commit/decommit cycle.
+  std::size_t session_peak_bytes_;
+  // The peak committed bytes over the last underused_commits_ cycles, all
+  // of which could have done with a smaller storage.
+  std::size_t recent_peak_bytes_;
+  int underused_commits_;
 
   // The 'generation' is incremented on Decommit() and allows catching
-  // bad GetPointer() calls still referring to a previous commit.
+  // bad GetPointer() calls still referring to a decommitted block.
   generation_t generation_;
 };
 
@@ -0,0 +1,471 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// binary_gemm.h: GEMM of binary ({-1, +1}) and ternary ({-1, 0, +1})
+// bit-packed matrices, see BitPackedMatrixMap in map.h.
+//
+// Bit-packed operands are already stored along the depth dimension in the
+// most compact way possible, so there is no packing stage: kernels read the
+// LHS and RHS in place. Dot products are computed with XOR/AND and popcount:
+//   Binary:  dot(a, b) = depth - 2 * popcount(a ^ b)
+//   Ternary: dot(a, b) = popcount(m) - 2 * popcount(m & (sa ^ sb)),
+//            where m = nonzero_a & nonzero_b.
+// The int32 results go through a PackedResult and UnpackResult like in the
+// regular GEMM, so all output stages are supported, and work is split into
+// L2/L1 blocks and across threads like in MultiThreadGemm.
+
+#ifndef GEMMLOWP_INTERNAL_BINARY_GEMM_H_
+#define GEMMLOWP_INTERNAL_BINARY_GEMM_H_
+
+#include <bitset>
+
+#include "../public/map.h"
+#include "block_params.h"
+#include "multi_thread_gemm.h"
+#include "unpack.h"
+
+#ifdef GEMMLOWP_AVX2
+#include <immintrin.h>
+#endif
+
+namespace gemmlowp {
+
+inline int Popcount64(std::uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  return static_cast<int>(std::bitset<64>(x).count());
+#endif
+}
+
+// The kernel format that the BlockParams and UnpackResult see. The depth is
+// counted in bytes of bit-packed storage, a cell's depth being one word.
+// Since the kernel scalar types are the default uint8, the zero-point
+// correction in UnpackResult is zero: the int32 dot products computed by
+// the kernel are exactly what enters the output pipeline, as long as the
+// offsets are zero.
+typedef KernelSideFormat<CellFormat<4, 8, CellOrder::WidthMajor>, 1>
+    BitPackedKernelSideFormat;
+typedef KernelFormat<BitPackedKernelSideFormat, BitPackedKernelSideFormat>
+    BitPackedKernelFormat;
+
+// Mask of the valid bits in the last group of a line of the given length.
+inline std::uint64_t LastGroupMask(int line_length) {
+  const int bits = line_length % 64;
+  return bits ? (std::uint64_t(1) << bits) - 1 : ~std::uint64_t(0);
+}
+
+// Accumulates into acc the popcounts that a kernel needs, over the given
+// range of complete groups [start_group, end_group), for a Rows x Cols block.
+// For Binary, acc[r][c] += popcount(a ^ b).
+// For Ternary, acc[r][c] += popcount(m) - 2 * popcount(m & (sa ^ sb)).
+template <BitEncoding Encoding, int Rows, int Cols>
+struct BitPackedKernelAccumulate {
+  static constexpr int kWordsPerGroup =
+      Encoding == BitEncoding::Binary ? 1 : 2;
+
+  static void Run(const std::uint64_t* const* lhs,
+                  const std::uint64_t* const* rhs, int start_group,
+                  int end_group, std::uint64_t last_group_mask,
+                  std::int32_t acc[Rows][Cols]) {
+    int g = start_group;
+#ifdef GEMMLOWP_AVX2
+    g = RunAvx2(lhs, rhs, g, end_group, acc);
+#endif
+    for (; g < end_group; g++) {
+      const std::uint64_t mask =
+          g == end_group - 1 ? last_group_mask : ~std::uint64_t(0);
+      const int w = g * kWordsPerGroup;
+      for (int r = 0; r < Rows; r++) {
+        for (int c = 0; c < Cols; c++) {
+          if (Encoding == BitEncoding::Binary) {
+            acc[r][c] += Popcount64((lhs[r][w] ^ rhs[c][w]) & mask);
+          } else {
+            const std::uint64_t m = lhs[r][w] & rhs[c][w] & mask;
+            acc[r][c] += Popcount64(m) -
+                         2 * Popcount64(m & (lhs[r][w + 1] ^ rhs[c][w + 1]));
+          }
+        }
+      }
+    }
+  }
+
+#ifdef GEMMLOWP_AVX2
+  // Popcount of each byte, using vpshufb on each nibble.
+  static __m256i PopcountBytes(__m256i x) {
+    const __m256i lookup =
+        _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                         1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i lo = _mm256_and_si256(x, low_mask);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                           _mm256_shuffle_epi8(lookup, hi));
+  }
+
+  // Popcount of each 64-bit lane.
+  static __m256i Popcount64Lanes(__m256i x) {
+    return _mm256_sad_epu8(PopcountBytes(x), _mm256_setzero_si256());
+  }
+
+  // Handles 256 bits (4 words) at a time, leaving out the last group since
+  // it may need masking. Returns the first group that was not handled.
+  static int RunAvx2(const std::uint64_t* const* lhs,
+                     const std::uint64_t* const* rhs, int start_group,
+                     int end_group, std::int32_t acc[Rows][Cols]) {
+    static constexpr int kGroupsPerStep = 4 / kWordsPerGroup;
+    // In the Ternary encoding, each 128-bit lane holds the nonzero word of a
+    // group in its low half and the sign word in its high half.
+    const __m256i nonzero_words = _mm256_setr_epi64x(-1, 0, -1, 0);
+    __m256i vacc[Rows][Cols];
+    for (int r = 0; r < Rows; r++) {
+      for (int c = 0; c < Cols; c++) {
+        vacc[r][c] = _mm256_setzero_si256();
+      }
+    }
+    int g = start_group;
+    for (; g + kGroupsPerStep < end_group; g += kGroupsPerStep) {
+      const int w = g * kWordsPerGroup;
+      __m256i l[Rows];
+      for (int r = 0; r < Rows; r++) {
+        l[r] =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs[r] + w));
+      }
+      for (int c = 0; c < Cols; c++) {
+        const __m256i rv =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs[c] + w));
+        for (int r = 0; r < Rows; r++) {
+          if (Encoding == BitEncoding::Binary) {
+            vacc[r][c] = _mm256_add_epi64(
+                vacc[r][c], Popcount64Lanes(_mm256_xor_si256(l[r], rv)));
+          } else {
+            const __m256i m =
+                _mm256_and_si256(_mm256_and_si256(l[r], rv), nonzero_words);
+            const __m256i signs_differ =
+                _mm256_srli_si256(_mm256_xor_si256(l[r], rv), 8);
+            const __m256i neg = _mm256_and_si256(m, signs_differ);
+            vacc[r][c] = _mm256_add_epi64(
+                vacc[r][c],
+                _mm256_sub_epi64(Popcount64Lanes(m),
+                                 _mm256_slli_epi64(Popcount64Lanes(neg), 1)));
+          }
+        }
+      }
+    }
+    for (int r = 0; r < Rows; r++) {
+      for (int c = 0; c < Cols; c++) {
+        std::int64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vacc[r][c]);
+        acc[r][c] += static_cast<std::int32_t>(lanes[0] + lanes[1] +
+                                               lanes[2] + lanes[3]);
+      }
+    }
+    return g;
+  }
+#endif
+};
+
+// Computes a Rows x Cols block of dot products of LHS lines with RHS lines
+// over the groups [start_group, end_group), adding them to dst if
+// start_group > 0 and storing them otherwise, like KernelBase::Run does
+// with start_depth.
+template <BitEncoding Encoding, int Rows, int Cols>
+void BitPackedKernelRun(std::int32_t* dst, int dst_col_stride,
+                        const std::uint64_t* const* lhs,
+                        const std::uint64_t* const* rhs, int line_length,
+                        int start_group, int end_group) {
+  std::int32_t acc[Rows][Cols] = {};
+  const int num_groups = (line_length + 63) / 64;
+  const std::uint64_t last_group_mask =
+      end_group == num_groups ? LastGroupMask(line_length) : ~std::uint64_t(0);
+  BitPackedKernelAccumulate<Encoding, Rows, Cols>::Run(
+      lhs, rhs, start_group, end_group, last_group_mask, acc);
+  std::int32_t offset = 0;
+  if (Encoding == BitEncoding::Binary) {
+    // Number of entries in the current groups.
+    offset = std::min(line_length, end_group * 64) - start_group * 64;
+  }
+  for (int c = 0; c < Cols; c++) {
+    for (int r = 0; r < Rows; r++) {
+      std::int32_t val = acc[r][c];
+      if (Encoding == BitEncoding::Binary) {
+        val = offset - 2 * val;
+      }
+      std::int32_t* d = dst + r + c * dst_col_stride;
+      *d = start_group ? *d + val : val;
+    }
+  }
+}
+
+// Computes a L2 block of the result into packed_result.
+template <BitEncoding Encoding>
+void BitPackedCompute(
+    const BlockParams& block_params, PackedResult* packed_result,
+    const BitPackedMatrixMap<Encoding, MapOrder::RowMajor>& lhs,
+    const BitPackedMatrixMap<Encoding, MapOrder::ColMajor>& rhs) {
+  ScopedProfilingLabel label("compute (bit-packed)");
+  static constexpr int kRows = BitPackedKernelFormat::kRows;
+  static constexpr int kCols = BitPackedKernelFormat::kCols;
+  static constexpr int kBytesPerGroup =
+      8 * BitPackedMatrixMap<Encoding, MapOrder::RowMajor>::kWordsPerGroup;
+  const int rows = lhs.rows();
+  const int cols = rhs.cols();
+  const int line_length = lhs.cols();
+  const int num_groups = (line_length + 63) / 64;
+  const int l1_groups = std::max(1, block_params.l1_depth / kBytesPerGroup);
+  auto dst = packed_result->Map();
+
+  for (int g = 0; g < num_groups; g += l1_groups) {
+    const int end_g = std::min(num_groups, g + l1_groups);
+    for (int r1 = 0; r1 < rows; r1 += block_params.l1_rows) {
+      const int rs1 = std::min(block_params.l1_rows, rows - r1);
+      for (int c = 0; c < cols; c += kCols) {
+        const int cs = std::min(+kCols, cols - c);
+        const std::uint64_t* rhs_lines[kCols];
+        for (int j = 0; j < cs; j++) {
+          rhs_lines[j] = rhs.line(c + j);
+        }
+        for (int r = r1; r < r1 + rs1; r += kRows) {
+          const int rs = std::min(+kRows, r1 + rs1 - r);
+          const std::uint64_t* lhs_lines[kRows];
+          for (int i = 0; i < rs; i++) {
+            lhs_lines[i] = lhs.line(r + i);
+          }
+          if (rs == kRows && cs == kCols) {
+            BitPackedKernelRun<Encoding, kRows, kCols>(
+                dst.data(r, c), dst.cols_stride(), lhs_lines, rhs_lines,
+                line_length, g, end_g);
+          } else {
+            for (int j = 0; j < cs; j++) {
+              for (int i = 0; i < rs; i++) {
+                BitPackedKernelRun<Encoding, 1, 1>(
+                    dst.data(r + i, c + j), dst.cols_stride(), lhs_lines + i,
+                    rhs_lines + j, line_length, g, end_g);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// The task used by BitPackedGemm, computing a block of the result. Unlike
+// GemmWithPackedRhsTask, there is no packed RHS to share: each task reads
+// the RHS in place.
+template <BitEncoding Encoding, typename ResultType, typename LhsOffset,
+          typename RhsOffset, typename OutputPipelineType>
+struct BitPackedGemmTask : Task {
+  typedef BitPackedMatrixMap<Encoding, MapOrder::RowMajor> LhsType;
+  typedef BitPackedMatrixMap<Encoding, MapOrder::ColMajor> RhsType;
+
+  BitPackedGemmTask(const LhsType& _lhs, const RhsType& _rhs,
+                    ResultType* _result, const MatrixBlockBounds& _result_block,
+                    const LhsOffset& _lhs_offset, const RhsOffset& _rhs_offset,
+                    const BlockParams& _block_params,
+                    const OutputPipelineType& _output_pipeline,
+                    const SingleThreadGemmContext* _context, int _task_index)
+      : lhs(_lhs),
+        rhs(_rhs),
+        result(*_result),
+        result_block(_result_block),
+        lhs_offset(_lhs_offset),
+        rhs_offset(_rhs_offset),
+        block_params(_block_params),
+        output_pipeline(_output_pipeline),
+        context(_context),
+        task_index(_task_index) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("BitPackedGemmTask");
+
+    const int rows = result_block.rows;
+    const int cols = result_block.cols;
+    const int depth = lhs.cols();
+
+    // A negative task_index means that the task runs alone, on the
+    // context's own allocator, which needs no configuring.
+    if (task_index >= 0) {
+      context->ConfigureTaskAllocator(local_allocator, task_index);
+    }
+    PackedResult packed_result(local_allocator, block_params);
+    // There are no sums of slices to correct for: the kernel computes
+    // exact dot products.
+    const Allocator::Handle zero_sums_handle = local_allocator->Reserve<
+        std::int32_t>(std::max(block_params.l2_rows, block_params.l2_cols));
+
+    local_allocator->Commit();
+
+    std::int32_t* zero_sums =
+        local_allocator->GetPointer<std::int32_t>(zero_sums_handle);
+    memset(zero_sums, 0,
+           sizeof(std::int32_t) *
+               std::max(block_params.l2_rows, block_params.l2_cols));
+
+    for (int c = 0; c < cols; c += block_params.l2_cols) {
+      int cs = std::min(block_params.l2_cols, cols - c);
+
+      for (int r = 0; r < rows; r += block_params.l2_rows) {
+        int rs = std::min(block_params.l2_rows, rows - r);
+
+        auto curr_result_block = MatrixBlockBounds(
+            result_block.start_row + r, result_block.start_col + c, rs, cs);
+
+        BitPackedCompute(
+            block_params, &packed_result,
+            lhs.block(curr_result_block.start_row, 0, rs, depth),
+            rhs.block(0, curr_result_block.start_col, depth, cs));
+
+        UnpackResult<BitPackedKernelFormat>(
+            &result, curr_result_block, packed_result, depth, zero_sums,
+            zero_sums, lhs_offset.block(curr_result_block.start_row, rs),
+            rhs_offset.block(curr_result_block.start_col, cs),
+            output_pipeline);
+      }
+    }
+
+    local_allocator->Decommit();
+  }
+
+  const LhsType lhs;
+  const RhsType rhs;
+  ResultType result;
+  const MatrixBlockBounds result_block;
+  const LhsOffset& lhs_offset;
+  const RhsOffset& rhs_offset;
+  const BlockParams& block_params;
+  const OutputPipelineType& output_pipeline;
+  const SingleThreadGemmContext* context;
+  const int task_index;
+};
+
+// The bit-packed counterpart of MultiThreadGemmImpl. The offsets must be
+// zero: BitPackedGemmWithOutputPipeline passes VectorDup's of zero.
+template <BitEncoding Encoding, typename ResultType, typename LhsOffset,
+          typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void BitPackedGemm(GemmContextType* context,
+                   const BitPackedMatrixMap<Encoding, MapOrder::RowMajor>& lhs,
+                   const BitPackedMatrixMap<Encoding, MapOrder::ColMajor>& rhs,
+                   ResultType* result, const LhsOffset& lhs_offset,
+                   const RhsOffset& rhs_offset,
+                   const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::BitPackedGemm");
+
+  assert(lhs.cols() == rhs.rows());
+
+  const int rows = result->rows();
+  const int cols = result->cols();
+  // The depth as BlockParams see it: bytes of bit-packed storage per line.
+  const int depth_bytes =
+      8 * BitPackedMatrixMap<Encoding, MapOrder::RowMajor>::WordsPerLine(
+              lhs.cols());
+
+  const int thread_count = HowManyThreads<BitPackedKernelFormat::kRows>(
+      context->max_num_threads(), rows, cols, depth_bytes);
+
+  BlockParams block_params;
+  block_params.Init<BitPackedKernelFormat>(
+      rows, cols, depth_bytes, thread_count, context->l1_bytes_to_use(),
+      context->l2_bytes_to_use(), context->l2_rhs_factor());
+
+  typedef BitPackedGemmTask<Encoding, ResultType, LhsOffset, RhsOffset,
+                            OutputPipelineType>
+      TaskType;
+
+  if (thread_count == 1) {
+    TaskType task(lhs, rhs, result, MatrixBlockBounds(0, 0, rows, cols),
+                  lhs_offset, rhs_offset, block_params, output_pipeline,
+                  context, -1);
+    task.local_allocator = context->allocator();
+    task.Run();
+    return;
+  }
+
+  // As in MultiThreadGemmImpl, the tasks are constructed in place in the
+  // calling thread's scratch storage.
+  static_assert(sizeof(TaskType) <= kMaxGemmTaskBytes,
+                "BitPackedGemmImplScratchSize would undersize the tasks");
+  Allocator* allocator = context->allocator();
+  const Allocator::Handle tasks_handle =
+      allocator->Reserve<std::uint8_t>(thread_count * sizeof(TaskType));
+  allocator->Commit();
+  TaskType* tasks = reinterpret_cast<TaskType*>(
+      allocator->GetPointer<std::uint8_t>(tasks_handle));
+
+  int next_start_row = 0;
+  for (int n = 0; n < thread_count; ++n) {
+    int start_row = next_start_row;
+    next_start_row = std::min(
+        rows,
+        RoundUp<BitPackedKernelFormat::kRows>(rows * (n + 1) / thread_count));
+    int block_rows = next_start_row - start_row;
+    new (&tasks[n])
+        TaskType(lhs, rhs, result,
+                 MatrixBlockBounds(start_row, 0, block_rows, cols), lhs_offset,
+                 rhs_offset, block_params, output_pipeline, context, n);
+  }
+  context->workers_pool()->Execute(thread_count, tasks);
+  for (int n = 0; n < thread_count; ++n) {
+    tasks[n].~TaskType();
+  }
+  allocator->Decommit();
+}
+
+// Returns the scratch memory that BitPackedGemm needs for a GEMM of the
+// given shape (with rows >= cols) on the given context, by replaying its
+// reservations on a throwaway allocator, like MultiThreadGemmScratchSize.
+template <BitEncoding Encoding, typename GemmContextType>
+ScratchSize BitPackedGemmImplScratchSize(const GemmContextType* context,
+                                         int rows, int cols, int depth) {
+  ScratchSize size;
+  if (rows == 0 || cols == 0 || depth == 0) {
+    return size;
+  }
+  assert(rows >= cols);
+
+  const int depth_bytes =
+      8 * BitPackedMatrixMap<Encoding, MapOrder::RowMajor>::WordsPerLine(depth);
+  const int thread_count = HowManyThreads<BitPackedKernelFormat::kRows>(
+      context->max_num_threads(), rows, cols, depth_bytes);
+  BlockParams block_params;
+  block_params.Init<BitPackedKernelFormat>(
+      rows, cols, depth_bytes, thread_count, context->l1_bytes_to_use(),
+      context->l2_bytes_to_use(), context->l2_rhs_factor());
+
+  // What each BitPackedGemmTask reserves.
+  Allocator allocator;
+  {
+    PackedResult packed_result(&allocator, block_params);
+    allocator.Reserve<std::int32_t>(
+        std::max(block_params.l2_rows, block_params.l2_cols));
+  }
+  if (thread_count == 1) {
+    size.main_bytes = allocator.reserved_bytes();
+    allocator.DiscardReservations();
+    return size;
+  }
+  size.per_task_bytes = allocator.reserved_bytes();
+  size.task_count = thread_count;
+  allocator.DiscardReservations();
+
+  allocator.Reserve<std::uint8_t>(thread_count * kMaxGemmTaskBytes);
+  size.main_bytes = allocator.reserved_bytes();
+  allocator.DiscardReservations();
+  return size;
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_BINARY_GEMM_H_
@@ -29,7 +29,19 @@ namespace gemmlowp {
 // and then another subdivision into smaller blocks that should fit in
 // L1 cache. There is then actually a third level of subdivision to fit
 // in registers, but we are not concerned with that here.
+// Optionally, when an L3 size is given, L2 then means the per-core L2 cache,
+// and the RHS is first divided into panels of l3_cols columns that should fit
+// in the shared L3 cache; each panel is packed once and its L2 blocks are
+// then computed in turn.
+// When allowed, very deep GEMMs are also blocked in the depth dimension at
+// the L2 level: the LHS is packed l2_depth at a time, and each depth block
+// accumulates into the int32 packed result, which is only unpacked after the
+// last one. The RHS is still packed for the whole depth, packed_rhs_depth,
+// but each depth block only reads an l2_depth-deep slice of it.
 struct BlockParams {
+  // See FindL2BlockSizes.
+  static constexpr int kMinL2ColsForFullDepth = 64;
+
   // L1 block parameters determine the size of small blocks that should
   // fit in L1 cache.
   int l1_rows;
@@ -42,38 +54,80 @@ struct BlockParams {
   int l2_cols;
   int l2_depth;
 
+  // The depth of the packed RHS blocks: the whole depth, rounded up.
+  // It is equal to l2_depth when there is no depth blocking.
+  int packed_rhs_depth;
+
+  // The L3 block parameter determines the number of columns of the RHS
+  // panels that are packed at once. It is a multiple of l2_cols, and is
+  // equal to it when there is no L3 blocking.
+  int l3_cols;
+
   template <typename KernelFormat>
   void Init(int rows, int cols, int depth, int num_threads, int l1_bytes_to_use,
-            int l2_bytes_to_use, float l2_rhs_factor) {
+            int l2_bytes_to_use, float l2_rhs_factor,
+            int l3_bytes_to_use = 0, bool allow_depth_blocking = false) {
     FindL2BlockSizes<KernelFormat>(rows, cols, depth, num_threads,
-                                   l2_bytes_to_use, l2_rhs_factor, &l2_rows,
-                                   &l2_cols, &l2_depth);
+                                   l2_bytes_to_use, l2_rhs_factor,
+                                   allow_depth_blocking, &l2_rows, &l2_cols,
+                                   &l2_depth);
+    packed_rhs_depth = RoundUp<kRegisterSize>(depth);
+    FindL3BlockSizes<KernelFormat>(cols, l2_cols, packed_rhs_depth,
+                                   l3_bytes_to_use, &l3_cols);
     FindL1BlockSizes<KernelFormat>(l2_rows, l2_cols, l2_depth, l1_bytes_to_use,
                                    &l1_rows, &l1_cols, &l1_depth);
+    if (l2_depth < packed_rhs_depth) {
+      // The depth blocks must start at L1 depth block boundaries of the
+      // packed RHS.
+      l2_depth = CeilQuotient(l2_depth, l1_depth) * l1_depth;
+      if (l2_depth >= packed_rhs_depth) {
+        l2_depth = packed_rhs_depth;
+      }
+    }
   }
 
   template <typename KernelFormat>
   static void FindL2BlockSizes(int rows, int cols, int depth, int num_threads,
                                int l2_bytes_to_use, float l2_rhs_factor,
-                               int* out_l2_rows, int* out_l2_cols,
-                               int* out_l2_depth) {
+                               bool allow_depth_blocking, int* out_l2_rows,
+                               int* out_l2_cols, int* out_l2_depth) {
     int l2_rows = 0;
     int l2_cols = 0;
     int l2_depth = 0;
+    // Size in bytes of packed entries, which is more than 1 for int16.
+    const int lhs_scalar_size = sizeof(typename KernelFormat::Lhs::Scalar);
+    const int rhs_scalar_size = sizeof(typename KernelFormat::Rhs::Scalar);
 
     int per_thread_rows =
         std::max(1, RoundUp<KernelFormat::kRows>(rows) / num_threads);
 
-    // No L2 blocking in the depth dimension at the moment.
-    // Too much loss of accuracy due to storing intermediate results in
-    // low precision.
-    // However, we still want to round l2_depth up to the next multiple
-    // of register size, so as to avoid having to special-case unaligned depths.
+    // We want to round l2_depth up to the next multiple of register size,
+    // so as to avoid having to special-case unaligned depths.
     l2_depth = RoundUp<kRegisterSize>(depth);
 
+    // L2 blocking in the depth dimension only happens when a RHS block
+    // covering the whole depth could not even be kMinL2ColsForFullDepth
+    // columns wide. Depth blocks are accumulated in the int32 packed
+    // result, so they lose no accuracy, but the LHS is then packed again
+    // for each L2 block of the RHS.
+    if (allow_depth_blocking) {
+      const int max_cache_friendly_l2_depth = RoundDown<kRegisterSize>(
+          static_cast<int>(l2_rhs_factor * (l2_bytes_to_use /
+                                            (kMinL2ColsForFullDepth *
+                                             rhs_scalar_size))));
+      if (max_cache_friendly_l2_depth > 0 &&
+          l2_depth > max_cache_friendly_l2_depth) {
+        const int min_l2_depth_blocks =
+            CeilQuotient(l2_depth, max_cache_friendly_l2_depth);
+        l2_depth = RoundUp<kRegisterSize>(
+            CeilQuotient(depth, min_l2_depth_blocks));
+      }
+    }
+
     {
       int max_cache_friendly_l2_cols = std::max(
-          1, static_cast<int>(l2_rhs_factor * (l2_bytes_to_use / l2_depth)));
+          1, static_cast<int>(l2_rhs_factor * (l2_bytes_to_use /
+                                               (l2_depth * rhs_scalar_size))));
       int min_l2_cols_blocks =
           std::max(1, CeilQuotient(cols, max_cache_friendly_l2_cols));
       l2_cols =
@@ -86,9 +140,9 @@ struct BlockParams {
     if (l2_rhs_factor == 1.0f) {
       l2_rows = RoundUp<KernelFormat::kRows>(per_thread_rows);
     } else {
-      int max_cache_friendly_l2_rows =
-          std::max(1, (l2_bytes_to_use - l2_depth * l2_cols) /
-                          (num_threads * (l2_depth + 4 * l2_cols)));
+      int max_cache_friendly_l2_rows = std::max(
+          1, (l2_bytes_to_use - l2_depth * l2_cols * rhs_scalar_size) /
+                 (num_threads * (l2_depth * lhs_scalar_size + 4 * l2_cols)));
       int min_l2_rows_blocks = std::max(
           1, CeilQuotient(per_thread_rows, max_cache_friendly_l2_rows));
       l2_rows = RoundUp<KernelFormat::kRows>(
@@ -100,6 +154,27 @@ struct BlockParams {
     *out_l2_depth = l2_depth;
   }
 
+  // A zero l3_bytes_to_use disables L3 blocking.
+  template <typename KernelFormat>
+  static void FindL3BlockSizes(int cols, int l2_cols, int l2_depth,
+                               int l3_bytes_to_use, int* out_l3_cols) {
+    const int rhs_scalar_size = sizeof(typename KernelFormat::Rhs::Scalar);
+    if (l3_bytes_to_use <= 0 || l2_cols >= cols) {
+      *out_l3_cols = l2_cols;
+      return;
+    }
+    // Like the L2 blocks, the L3 panels are as large as fits, then evened
+    // out, but in units of L2 blocks.
+    const int max_cache_friendly_l3_cols = static_cast<int>(
+        kDefaultL3RhsFactor * (l3_bytes_to_use / (l2_depth * rhs_scalar_size)));
+    const int max_l2_blocks_per_l3_block =
+        std::max(1, max_cache_friendly_l3_cols / l2_cols);
+    const int l2_blocks = CeilQuotient(cols, l2_cols);
+    const int min_l3_blocks =
+        CeilQuotient(l2_blocks, max_l2_blocks_per_l3_block);
+    *out_l3_cols = l2_cols * CeilQuotient(l2_blocks, min_l3_blocks);
+  }
+
   template <typename KernelFormat>
   static void FindL1BlockSizes(int rows, int cols, int depth,
                                int l1_bytes_to_use, int* out_l1_rows,
@@ -107,6 +182,8 @@ struct BlockParams {
     int l1_rows = 0;
     int l1_cols = 0;
     int l1_depth = 0;
+    const int lhs_scalar_size = sizeof(typename KernelFormat::Lhs::Scalar);
+    const int rhs_scalar_size = sizeof(typename KernelFormat::Rhs::Scalar);
 
     // L2 block sizes should already be multiples of kernel block sizes.
     assert(rows % KernelFormat::kRows == 0);
@@ -120,7 +197,8 @@ struct BlockParams {
     {
       int max_cache_friendly_l1_depth = std::max(
           1, (l1_bytes_to_use - 4 * KernelFormat::kRows * KernelFormat::kCols) /
-                 (KernelFormat::kRows + KernelFormat::kCols));
+                 (KernelFormat::kRows * lhs_scalar_size +
+                  KernelFormat::kCols * rhs_scalar_size));
       int min_l1_depth_blocks =
           std::max(1, CeilQuotient(depth, max_cache_friendly_l1_depth));
       l1_depth =
@@ -128,8 +206,8 @@ struct BlockParams {
     }
 
     {
-      int max_cache_friendly_l1_rows =
-          std::max(1, l1_bytes_to_use / (l1_depth + 4 * l1_cols));
+      int max_cache_friendly_l1_rows = std::max(
+          1, l1_bytes_to_use / (l1_depth * lhs_scalar_size + 4 * l1_cols));
       int min_l1_rows_blocks =
           std::max(1, CeilQuotient(rows, max_cache_friendly_l1_rows));
       l1_rows =
@@ -147,6 +225,8 @@ struct BlockParams {
 // rows/colums. See the explanation in kernel.h: in the LHS, 'width' means
 // the number of rows, while in the RHS, 'width' means the number of columns.
 // That allows us to write generic code that applies to either LHS or RHS.
+// The l2_width of the RHS is that of a whole L3 panel, and its l2_depth the
+// whole depth, as that is what is packed at once.
 struct SideBlockParams {
   // L1 block parameters determine the size of small blocks that should
   // fit in L1 cache.
@@ -166,10 +246,12 @@ inline void GetSideBlockParams(Side side, SideBlockParams* side_block_params,
   side_block_params->l1_width =
       side == Side::Lhs ? block_params.l1_rows : block_params.l1_cols;
   side_block_params->l2_width =
-      side == Side::Lhs ? block_params.l2_rows : block_params.l2_cols;
+      side == Side::Lhs ? block_params.l2_rows : block_params.l3_cols;
 
   side_block_params->l1_depth = block_params.l1_depth;
-  side_block_params->l2_depth = block_params.l2_depth;
+  side_block_params->l2_depth = side == Side::Lhs
+                                    ? block_params.l2_depth
+                                    : block_params.packed_rhs_depth;
 }
 
 }  // namespace gemmlowp
@@ -0,0 +1,188 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// call_stats.h: a log of the last GEMMs run on a context, recording for
+// each the path it took (kernel, block parameters, thread count) and the
+// time spent in each of its stages. See
+// SingleThreadGemmContext::set_call_log_capacity.
+
+#ifndef GEMMLOWP_INTERNAL_CALL_STATS_H_
+#define GEMMLOWP_INTERNAL_CALL_STATS_H_
+
+#include <cstdio>
+#include <vector>
+
+#include "block_params.h"
+#include "kernel.h"
+#include "stage_stats.h"
+
+namespace gemmlowp {
+
+// What a GEMM call did. rows, depth and cols are as computed, i.e. with
+// rows >= cols, after transposing if needed.
+struct GemmCallRecord {
+  int rows = 0;
+  int depth = 0;
+  int cols = 0;
+  const char* kernel_name = nullptr;
+  BlockParams block_params = BlockParams();
+  // The number of tasks, each run on its own thread.
+  int thread_count = 0;
+  // Whether the whole RHS was packed at once, rather than in L3 blocks.
+  bool rhs_packed_once = false;
+  std::uint64_t nanoseconds = 0;
+  // The stage stats of this call only, except WorkerWait, which is left
+  // at 0: a worker's wait is counted from the end of its previous task,
+  // possibly in an earlier call, so it cannot be told apart from the idle
+  // time between calls.
+  GemmStageStats stages;
+};
+
+// A bounded ring buffer of GemmCallRecord's. Safe to read from other
+// threads while GEMMs add to it.
+class GemmCallLog {
+ public:
+  // Keeps the last n records. 0, the default, disables the log. Must not be
+  // called while GEMMs are running on the context.
+  void set_capacity(std::size_t n) {
+    ScopedLock sl(&mutex_);
+    records_.clear();
+    records_.resize(n);
+    next_ = 0;
+    size_ = 0;
+  }
+
+  bool enabled() const { return !records_.empty(); }
+
+  void Add(const GemmCallRecord& record) {
+    ScopedLock sl(&mutex_);
+    if (records_.empty()) {
+      return;
+    }
+    records_[next_] = record;
+    next_ = (next_ + 1) % records_.size();
+    size_ = std::min(size_ + 1, records_.size());
+  }
+
+  // The records, oldest first.
+  std::vector<GemmCallRecord> Records() const {
+    ScopedLock sl(&mutex_);
+    std::vector<GemmCallRecord> records;
+    records.reserve(size_);
+    for (std::size_t i = 0; i < size_; i++) {
+      records.push_back(
+          records_[(next_ + records_.size() - size_ + i) % records_.size()]);
+    }
+    return records;
+  }
+
+  void Clear() {
+    ScopedLock sl(&mutex_);
+    next_ = 0;
+    size_ = 0;
+  }
+
+  // Writes one line per record, oldest first.
+  void Print(FILE* file) const {
+    for (const GemmCallRecord& r : Records()) {
+      const BlockParams& p = r.block_params;
+      fprintf(file,
+              "%dx%dx%d %s threads=%d l1=%dx%dx%d l2=%dx%dx%d l3_cols=%d "
+              "rhs_packed_once=%d total_us=%.1f",
+              r.rows, r.depth, r.cols, r.kernel_name, r.thread_count,
+              p.l1_rows, p.l1_depth, p.l1_cols, p.l2_rows, p.l2_depth,
+              p.l2_cols, p.l3_cols, r.rhs_packed_once, 1e-3 * r.nanoseconds);
+      for (int i = 0; i < static_cast<int>(GemmStage::kCount); i++) {
+        if (r.stages.stages[i].calls) {
+          fprintf(file, " %s_us=%.1f",
+                  GemmStageName(static_cast<GemmStage>(i)),
+                  1e-3 * r.stages.stages[i].nanoseconds);
+        }
+      }
+      fprintf(file, "\n");
+    }
+  }
+
+ private:
+  mutable Mutex mutex_;
+  std::vector<GemmCallRecord> records_;
+  std::size_t next_ = 0;
+  std::size_t size_ = 0;
+};
+
+// Adds a record of the GEMM running during its lifetime to the given log,
+// with the stage stats that the GEMM adds to the given counters. Does
+// nothing if log is null.
+class ScopedGemmCallRecord {
+ public:
+  ScopedGemmCallRecord(GemmCallLog* log, const GemmStageCounters* counters,
+                       const KernelBase& kernel,
+                       const BlockParams& block_params, int rows, int depth,
+                       int cols, int thread_count)
+      : log_(log), counters_(counters) {
+    if (!log_) {
+      return;
+    }
+    record_.rows = rows;
+    record_.depth = depth;
+    record_.cols = cols;
+    record_.kernel_name = kernel.Name();
+    record_.block_params = block_params;
+    record_.thread_count = thread_count;
+    record_.rhs_packed_once = block_params.l3_cols >= cols;
+    if (counters_) {
+      stages_start_ = counters_->Snapshot();
+    }
+    start_ = StageClockNanoseconds();
+  }
+
+  ~ScopedGemmCallRecord() {
+    if (!log_) {
+      return;
+    }
+    record_.nanoseconds = StageClockNanoseconds() - start_;
+    if (counters_) {
+      const GemmStageStats stages_end = counters_->Snapshot();
+      for (int i = 0; i < static_cast<int>(GemmStage::kCount); i++) {
+        if (i == static_cast<int>(GemmStage::WorkerWait)) {
+          continue;
+        }
+        GemmStageTotals& totals = record_.stages.stages[i];
+        const GemmStageTotals& start = stages_start_.stages[i];
+        const GemmStageTotals& end = stages_end.stages[i];
+        totals.nanoseconds = end.nanoseconds - start.nanoseconds;
+        totals.bytes = end.bytes - start.bytes;
+        totals.ops = end.ops - start.ops;
+        totals.calls = end.calls - start.calls;
+        for (int e = 0; e < kPerfEventCount; e++) {
+          totals.perf_events[e] = end.perf_events[e] - start.perf_events[e];
+        }
+      }
+    }
+    log_->Add(record_);
+  }
+
+ private:
+  ScopedGemmCallRecord(const ScopedGemmCallRecord&) = delete;
+
+  GemmCallLog* const log_;
+  const GemmStageCounters* const counters_;
+  GemmCallRecord record_;
+  GemmStageStats stages_start_;
+  std::uint64_t start_ = 0;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_CALL_STATS_H_
@@ -54,6 +54,8 @@ const int kDefaultCacheLineSize = 64;
 // Of course, these values are in principle too low for typical x86 CPUs
 // where we should set the L2 value to (L3 cache size / number of cores) at
 // least.
+// Contexts can instead opt into sizes detected at runtime, see
+// SingleThreadGemmContext::UseDetectedCacheSizes.
 //
 #if defined(GEMMLOWP_ARM) && defined(__APPLE__)
 // iPhone/iPad
@@ -87,6 +89,15 @@ const int kDefaultL1CacheSize = 16 * 1024;
 const int kDefaultL2CacheSize = 256 * 1024;
 #endif
 
+// By default, there is no L3 blocking. See
+// SingleThreadGemmContext::set_l3_bytes_to_use.
+const int kDefaultL3CacheSize = 0;
+
+// The proportion of the shared L3 cache that we intend to use for storing
+// RHS panels, leaving the rest to the other data that each core streams
+// through it.
+const float kDefaultL3RhsFactor = 0.5f;
+
 // The proportion of the cache that we intend to use for storing
 // RHS blocks. This should be between 0 and 1, and typically closer to 1,
 // as we typically want to use most of the L2 cache for storing a large
@@ -94,9 +105,9 @@ const int kDefaultL2CacheSize = 256 * 1024;
 #if defined(GEMMLOWP_X86)
 // For IA, use the entire L2 cache for the RHS matrix. LHS matrix is not blocked
 // for L2 cache.
-const float kDefaultL2RhsFactor = 1.00f;
+constexpr float kDefaultL2RhsFactor = 1.00f;
 #else
-const float kDefaultL2RhsFactor = 0.75f;
+constexpr float kDefaultL2RhsFactor = 0.75f;
 #endif
 
 // The number of bytes in a SIMD register. This is used to determine
@@ -134,20 +145,20 @@ inline void Prefetch(const void* ptr) {
 // Returns the runtime argument rounded down to the nearest multiple of
 // the fixed Modulus.
 template <unsigned Modulus, typename Integer>
-Integer RoundDown(Integer i) {
+constexpr Integer RoundDown(Integer i) {
   return i - (i % Modulus);
 }
 
 // Returns the runtime argument rounded up to the nearest multiple of
 // the fixed Modulus.
 template <unsigned Modulus, typename Integer>
-Integer RoundUp(Integer i) {
+constexpr Integer RoundUp(Integer i) {
   return RoundDown<Modulus>(i + Modulus - 1);
 }
 
 // Returns the quotient a / b rounded up ('ceil') to the nearest integer.
 template <typename Integer>
-Integer CeilQuotient(Integer a, Integer b) {
+constexpr Integer CeilQuotient(Integer a, Integer b) {
   return (a + b - 1) / b;
 }
 
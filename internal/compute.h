@@ -25,21 +25,28 @@
 
 namespace gemmlowp {
 
-template <typename PackedLhs, typename PackedRhs, typename PackedResult>
+// BlockParamsType is BlockParams, or FixedShapeBlockParams whose members
+// are constexpr, giving loops with constant bounds.
+template <typename PackedLhs, typename PackedRhs, typename PackedResult,
+          typename BlockParamsType = BlockParams>
 class ComputeImpl {
   typedef typename PackedLhs::KernelSideFormat KernelLhsFormat;
   typedef typename PackedRhs::KernelSideFormat KernelRhsFormat;
   typedef KernelFormat<KernelLhsFormat, KernelRhsFormat> Format;
 
   const KernelBase& kernel_;
-  const BlockParams& block_params_;
+  const BlockParamsType& block_params_;
 
   PackedResult* const packed_result_;
   const PackedLhs& packed_lhs_;
   const PackedRhs& packed_rhs_;
 
+  // See Compute().
+  int rhs_start_col_ = 0;
+  int rhs_start_depth_ = 0;
+
  public:
-  ComputeImpl(const KernelBase& _kernel, const BlockParams& _block_params,
+  ComputeImpl(const KernelBase& _kernel, const BlockParamsType& _block_params,
               PackedResult* _packed_result, const PackedLhs& _packed_lhs,
               const PackedRhs& _packed_rhs)
       : kernel_(_kernel),
@@ -48,7 +55,13 @@ class ComputeImpl {
         packed_lhs_(_packed_lhs),
         packed_rhs_(_packed_rhs) {}
 
-  void Compute(int depth) {
+  // Computes the product of the packed LHS with the l2_cols columns of the
+  // packed RHS starting at rhs_start_col, a multiple of l2_cols, and at
+  // depth rhs_start_depth, a multiple of l2_depth. Depth blocks after the
+  // first accumulate into the packed result.
+  void Compute(int depth, int rhs_start_col, int rhs_start_depth) {
+    rhs_start_col_ = rhs_start_col;
+    rhs_start_depth_ = rhs_start_depth;
     depth = RoundUp<Format::kDepth>(depth);
     assert(depth <= block_params_.l2_depth);
     for (int d = 0; d < depth; d += block_params_.l1_depth) {
@@ -79,12 +92,16 @@ class ComputeImpl {
   void ComputeRun(int start_row, int start_col, int start_depth,
                   int depth) GEMMLOWP_NOINLINE {
     packed_lhs_.seek_run(start_row, start_depth);
-    packed_rhs_.seek_run(start_col, start_depth);
+    packed_rhs_.seek_run(rhs_start_col_ + start_col,
+                         rhs_start_depth_ + start_depth);
     auto packed_result_block = packed_result_->Map().block(
         start_row, start_col, Format::kRows, Format::kCols);
+    // Kernels clear the accumulators at start_depth 0 and accumulate
+    // otherwise.
     kernel_.Run(packed_result_block.data(), packed_result_block.rows_stride(),
                 packed_result_block.cols_stride(), packed_lhs_.current_data(),
-                packed_rhs_.current_data(), start_depth, depth);
+                packed_rhs_.current_data(), rhs_start_depth_ + start_depth,
+                depth);
     MarkPackedResultBlockAsInitialized(packed_result_block);
   }
 
@@ -105,12 +122,13 @@ class ComputeImpl {
 template <typename PackedLhs, typename PackedRhs, typename PackedResult>
 void Compute(const KernelBase& kernel, const BlockParams& block_params,
              PackedResult* packed_result, const PackedLhs& packed_lhs,
-             const PackedRhs& packed_rhs, int depth) {
+             const PackedRhs& packed_rhs, int depth, int rhs_start_col = 0,
+             int rhs_start_depth = 0) {
   ScopedProfilingLabel label("compute");
   ComputeImpl<PackedLhs, PackedRhs, PackedResult> impl(
       kernel, block_params, packed_result, packed_lhs, packed_rhs);
 
-  impl.Compute(depth);
+  impl.Compute(depth, rhs_start_col, rhs_start_depth);
 }
 
 }  // namespace gemmlowp
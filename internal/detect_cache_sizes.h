@@ -0,0 +1,202 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// detect_cache_sizes.h: runtime detection of the sizes of the data caches,
+// as an alternative to the compile-time kDefaultL1CacheSize and
+// kDefaultL2CacheSize. See SingleThreadGemmContext::UseDetectedCacheSizes.
+//
+// On Linux, this reads /sys/devices/system/cpu/cpu0/cache. Elsewhere on
+// x86, or if that is unavailable, it uses the cpuid cache parameters
+// leaves (4 on Intel, 0x8000001D on AMD).
+
+#ifndef GEMMLOWP_INTERNAL_DETECT_CACHE_SIZES_H_
+#define GEMMLOWP_INTERNAL_DETECT_CACHE_SIZES_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "detect_platform.h"
+
+#if defined(GEMMLOWP_X86) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define GEMMLOWP_HAVE_CPUID
+#endif
+
+namespace gemmlowp {
+
+// A data or unified cache level.
+struct CacheLevelInfo {
+  int bytes = 0;
+  // The number of logical CPUs sharing this cache.
+  int shared_cpus = 0;
+};
+
+struct CacheSizes {
+  // The L1 data cache, L2 and L3, in that order. Missing levels have 0
+  // bytes.
+  static constexpr int kMaxLevel = 3;
+  CacheLevelInfo levels[kMaxLevel];
+
+  bool detected() const { return levels[0].bytes > 0; }
+
+  // The share of the given cache level (1 to kMaxLevel) that each core gets
+  // when all the cores sharing it are busy. The logical CPUs sharing the L1
+  // data cache are taken to be the hardware threads of one core, so that
+  // a level shared only by them is not divided.
+  int PerCoreBytes(int level) const {
+    const CacheLevelInfo& info = levels[level - 1];
+    const int threads_per_core = std::max(1, levels[0].shared_cpus);
+    const int cores = std::max(1, info.shared_cpus / threads_per_core);
+    return info.bytes / cores;
+  }
+};
+
+// Returns the number of CPUs in a Linux CPU list such as "0-3,8-11".
+inline int CountCpusInList(const char* list) {
+  int count = 0;
+  const char* p = list;
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    const long first = std::strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = std::strtol(end + 1, &end, 10);
+    }
+    count += static_cast<int>(last - first + 1);
+    p = *end == ',' ? end + 1 : end;
+  }
+  return count;
+}
+
+#ifdef __linux__
+// Reads the first line of a small text file, without the newline.
+inline bool ReadSysfsLine(const char* path, char* buf, int buf_size) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  const bool ok = fgets(buf, buf_size, file) != nullptr;
+  fclose(file);
+  if (ok) {
+    buf[strcspn(buf, "\n")] = '\0';
+  }
+  return ok;
+}
+
+inline bool ReadSysfsCacheSizes(CacheSizes* sizes) {
+  for (int index = 0;; index++) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu0/cache/index%d",
+             index);
+    char path[96];
+    char level[16], type[32], size[32], shared_cpu_list[256];
+    snprintf(path, sizeof(path), "%s/level", dir);
+    if (!ReadSysfsLine(path, level, sizeof(level))) {
+      break;
+    }
+    snprintf(path, sizeof(path), "%s/type", dir);
+    if (!ReadSysfsLine(path, type, sizeof(type))) {
+      break;
+    }
+    snprintf(path, sizeof(path), "%s/size", dir);
+    if (!ReadSysfsLine(path, size, sizeof(size))) {
+      break;
+    }
+    snprintf(path, sizeof(path), "%s/shared_cpu_list", dir);
+    if (!ReadSysfsLine(path, shared_cpu_list, sizeof(shared_cpu_list))) {
+      strcpy(shared_cpu_list, "0");
+    }
+    const int level_number = atoi(level);
+    if (!strcmp(type, "Instruction") || level_number < 1 ||
+        level_number > CacheSizes::kMaxLevel) {
+      continue;
+    }
+    char* unit;
+    long bytes = std::strtol(size, &unit, 10);
+    if (*unit == 'K') {
+      bytes *= 1024;
+    } else if (*unit == 'M') {
+      bytes *= 1024 * 1024;
+    }
+    CacheLevelInfo* info = &sizes->levels[level_number - 1];
+    info->bytes = static_cast<int>(bytes);
+    info->shared_cpus = CountCpusInList(shared_cpu_list);
+  }
+  return sizes->detected();
+}
+#endif
+
+#ifdef GEMMLOWP_HAVE_CPUID
+inline bool ReadCpuidCacheSizes(CacheSizes* sizes) {
+  for (unsigned leaf : {0x4u, 0x8000001Du}) {
+    if (__get_cpuid_max(leaf & 0x80000000u, nullptr) < leaf) {
+      continue;
+    }
+    for (unsigned subleaf = 0; subleaf < 16; subleaf++) {
+      unsigned eax, ebx, ecx, edx;
+      __cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+      const unsigned type = eax & 0x1f;
+      if (type == 0) {
+        break;
+      }
+      const int level = (eax >> 5) & 0x7;
+      // Type 2 is the instruction cache.
+      if (type == 2 || level < 1 || level > CacheSizes::kMaxLevel) {
+        continue;
+      }
+      const unsigned ways = (ebx >> 22) + 1;
+      const unsigned partitions = ((ebx >> 12) & 0x3ff) + 1;
+      const unsigned line_size = (ebx & 0xfff) + 1;
+      const unsigned sets = ecx + 1;
+      CacheLevelInfo* info = &sizes->levels[level - 1];
+      info->bytes = static_cast<int>(ways * partitions * line_size * sets);
+      info->shared_cpus = static_cast<int>((eax >> 14) & 0xfff) + 1;
+    }
+    if (sizes->detected()) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+inline CacheSizes DetectCacheSizesUncached() {
+  CacheSizes sizes;
+#ifdef __linux__
+  if (ReadSysfsCacheSizes(&sizes)) {
+    return sizes;
+  }
+  sizes = CacheSizes();
+#endif
+#ifdef GEMMLOWP_HAVE_CPUID
+  if (ReadCpuidCacheSizes(&sizes)) {
+    return sizes;
+  }
+  sizes = CacheSizes();
+#endif
+  return sizes;
+}
+
+// Returns the cache sizes of the CPU, detected on the first call.
+// Check detected() before using them.
+inline const CacheSizes& DetectCacheSizes() {
+  static const CacheSizes sizes = DetectCacheSizesUncached();
+  return sizes;
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_DETECT_CACHE_SIZES_H_
@@ -20,7 +20,10 @@
 #include "../internal/kernel_default.h"
 #include "../public/map.h"
 #include "../public/output_stages.h"
+#include "binary_gemm.h"
+#include "hybrid_gemm.h"
 #include "multi_thread_gemm.h"
+#include "single_thread_gemv.h"
 
 namespace gemmlowp {
 
@@ -71,6 +74,41 @@ struct TransposeImpl<MatrixMap<Scalar, Order>> {
   }
 };
 
+template <MapOrder Order>
+struct TransposeImpl<NibbleMatrixMap<Order>> {
+  typedef NibbleMatrixMap<Order> SrcType;
+  static constexpr MapOrder TransposedOrder = TransposeMapOrder<Order>::Value;
+  typedef NibbleMatrixMap<TransposedOrder> DstType;
+  static DstType Run(const SrcType& src) {
+    return DstType(src.data(), src.start_index(), src.cols(), src.rows(),
+                   src.stride());
+  }
+};
+
+template <BitEncoding Encoding, MapOrder Order>
+struct TransposeImpl<BitPackedMatrixMap<Encoding, Order>> {
+  typedef BitPackedMatrixMap<Encoding, Order> SrcType;
+  static constexpr MapOrder TransposedOrder = TransposeMapOrder<Order>::Value;
+  typedef BitPackedMatrixMap<Encoding, TransposedOrder> DstType;
+  static DstType Run(const SrcType& src) {
+    return DstType(src.data(), src.cols(), src.rows(), src.stride());
+  }
+};
+
+template <MapOrder Order, VectorShape ParamsShape>
+struct TransposeImpl<QuantizingFloatMatrixMap<Order, ParamsShape>> {
+  typedef QuantizingFloatMatrixMap<Order, ParamsShape> SrcType;
+  static constexpr MapOrder TransposedOrder = TransposeMapOrder<Order>::Value;
+  static constexpr VectorShape TransposedParamsShape =
+      TransposeVectorShape<ParamsShape>::Value;
+  typedef QuantizingFloatMatrixMap<TransposedOrder, TransposedParamsShape>
+      DstType;
+  static DstType Run(const SrcType& src) {
+    return DstType(src.data(), src.cols(), src.rows(), src.stride(),
+                   src.scales(), src.offsets());
+  }
+};
+
 template <VectorShape Shape>
 struct TransposeImpl<OutputStageQuantizeDownInt32ToUint8ScalePC<Shape>> {
   typedef OutputStageQuantizeDownInt32ToUint8ScalePC<Shape> SrcType;
@@ -115,6 +153,18 @@ struct TransposeImpl<OutputStageBiasAddition<VectorMapType>> {
   }
 };
 
+template <>
+struct TransposeImpl<OutputStageScaleInt32ToFloat> {
+  typedef OutputStageScaleInt32ToFloat SrcType;
+  typedef OutputStageScaleInt32ToFloat DstType;
+  static DstType Run(const SrcType& src) {
+    DstType dst;
+    dst.row_scale = Transpose(src.col_scale);
+    dst.col_scale = Transpose(src.row_scale);
+    return dst;
+  }
+};
+
 // TODO(benoitjacob) - does anyone understand C++ variadic templates?
 // How to use them to implement TransposeTuple? Note: there are lots
 // of answers on StackOverflow but they seem to all involve either
@@ -166,13 +216,104 @@ TransposeTuple(const std::tuple<T0, T1, T2, T3, T4, T5>& t) {
                          Transpose(std::get<4>(t)), Transpose(std::get<5>(t)));
 }
 
+// Hook for GEMV implementations bypassing packing, see single_thread_gemv.h.
+// Returns true if the GEMV was handled, false if the generic GEMM path
+// should be used. Overloaded below for the LHS types that have one.
+template <typename GemmContextType, typename LhsType, typename RhsType,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType>
+bool DispatchGemv(GemmContextType*, const LhsType&, const RhsType&,
+                  ResultType*, const LhsOffset&, const RhsOffset&,
+                  const OutputPipelineType&) {
+  return false;
+}
+
+template <typename GemmContextType, MapOrder LhsOrder, typename RhsType,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType>
+bool DispatchGemv(GemmContextType* context,
+                  const NibbleMatrixMap<LhsOrder>& lhs, const RhsType& rhs,
+                  ResultType* result, const LhsOffset& lhs_offset,
+                  const RhsOffset& rhs_offset,
+                  const OutputPipelineType& output_pipeline) {
+  if (result->cols() != 1) {
+    return false;
+  }
+  SingleThreadGemv(context, lhs, rhs, result, lhs_offset, rhs_offset,
+                   output_pipeline);
+  return true;
+}
+
+// Runs a GEMM whose shape has already been normalized by DispatchGemmShape.
+// Overloaded below for operand types that don't use the regular kernels.
+template <typename BitDepthParams, typename LhsType, typename RhsType,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType, typename GemmContextType>
+void DispatchGemmImpl(GemmContextType* context, const LhsType& lhs,
+                      const RhsType& rhs, ResultType* result,
+                      const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  MultiThreadGemmImpl<typename Kernel::Format>(context, Kernel(), lhs, rhs,
+                                               result, lhs_offset, rhs_offset,
+                                               output_pipeline);
+}
+
+// int8 x int16 products, see Int8Int16GemmWithOutputPipelinePC. Both orders
+// are needed since DispatchGemmShape may swap the LHS and RHS.
+template <typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType, typename GemmContextType>
+void DispatchGemmImpl(GemmContextType* context,
+                      const MatrixMap<const std::int8_t, LhsOrder>& lhs,
+                      const MatrixMap<const std::int16_t, RhsOrder>& rhs,
+                      ResultType* result, const LhsOffset& lhs_offset,
+                      const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  typedef DefaultInt8Int16Kernel<std::int8_t, std::int16_t> Kernel;
+  MultiThreadGemmImpl<typename Kernel::Format>(context, Kernel(), lhs, rhs,
+                                               result, lhs_offset, rhs_offset,
+                                               output_pipeline);
+}
+
+template <typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType, typename GemmContextType>
+void DispatchGemmImpl(GemmContextType* context,
+                      const MatrixMap<const std::int16_t, LhsOrder>& lhs,
+                      const MatrixMap<const std::int8_t, RhsOrder>& rhs,
+                      ResultType* result, const LhsOffset& lhs_offset,
+                      const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  typedef DefaultInt8Int16Kernel<std::int16_t, std::int8_t> Kernel;
+  MultiThreadGemmImpl<typename Kernel::Format>(context, Kernel(), lhs, rhs,
+                                               result, lhs_offset, rhs_offset,
+                                               output_pipeline);
+}
+
+// Bit-packed operands have their own kernels, see binary_gemm.h. The
+// BitDepthParams are irrelevant there.
+template <typename BitDepthParams, BitEncoding Encoding, typename ResultType,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void DispatchGemmImpl(
+    GemmContextType* context,
+    const BitPackedMatrixMap<Encoding, MapOrder::RowMajor>& lhs,
+    const BitPackedMatrixMap<Encoding, MapOrder::ColMajor>& rhs,
+    ResultType* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  BitPackedGemm(context, lhs, rhs, result, lhs_offset, rhs_offset,
+                output_pipeline);
+}
+
+// The LHS and RHS are taken as generic map types, as either may be a
+// MatrixMap or a NibbleMatrixMap (4-bit entries).
 template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
-          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsType, typename RhsType, MapOrder ResultOrder,
           typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
           typename GemmContextType>
-void DispatchGemmShape(GemmContextType* context,
-                       const MatrixMap<const InputScalar, LhsOrder>& lhs,
-                       const MatrixMap<const InputScalar, RhsOrder>& rhs,
+void DispatchGemmShape(GemmContextType* context, const LhsType& lhs,
+                       const RhsType& rhs,
                        MatrixMap<OutputScalar, ResultOrder>* result,
                        const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
                        const OutputPipelineType& output_pipeline) {
@@ -196,10 +337,13 @@ void DispatchGemmShape(GemmContextType* context,
         TransposeTuple(output_pipeline));
   }
 
-  typedef DefaultKernel<BitDepthParams> Kernel;
-  MultiThreadGemm<typename Kernel::Format, InputScalar, OutputScalar,
-                  BitDepthParams>(context, Kernel(), lhs, rhs, result,
-                                  lhs_offset, rhs_offset, output_pipeline);
+  if (DispatchGemv(context, lhs, rhs, result, lhs_offset, rhs_offset,
+                   output_pipeline)) {
+    return;
+  }
+
+  DispatchGemmImpl<BitDepthParams>(context, lhs, rhs, result, lhs_offset,
+                                   rhs_offset, output_pipeline);
 }
 
 }  // end namespace gemmlowp
@@ -0,0 +1,281 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// fixed_shape_gemm.h: GEMMs whose shape is known at compile time, see
+// GemmFixedShape in gemmlowp.h.
+//
+// For small shapes run very many times, the per-call overhead of the
+// generic path is significant: BlockParams::Init, loops whose bounds are
+// only known at run time, and leftover handling in UnpackResult for any
+// block size. Here the block sizes are constexpr. ComputeImpl and
+// UnpackResult are instantiated with them, so their loops have constant
+// bounds, and leftover handling is only generated for the remainders that
+// the shape has. These GEMMs are single-threaded, and block for the
+// compile-time default cache sizes rather than for the context's settings.
+
+#ifndef GEMMLOWP_INTERNAL_FIXED_SHAPE_GEMM_H_
+#define GEMMLOWP_INTERNAL_FIXED_SHAPE_GEMM_H_
+
+#include <type_traits>
+
+#include "dispatch_gemm_shape.h"
+
+namespace gemmlowp {
+
+constexpr int ConstexprMax(int a, int b) { return a > b ? a : b; }
+
+// The block parameters that BlockParams::Init computes for a
+// single-threaded GEMM of the given shape, with Rows >= Cols, without L3
+// or depth blocking, as constexpr members named like those of BlockParams.
+template <typename KernelFormat, int Rows, int Depth, int Cols,
+          int L1Bytes = kDefaultL1CacheSize, int L2Bytes = kDefaultL2CacheSize>
+struct FixedShapeBlockParams {
+  static_assert(Rows > 0 && Depth > 0 && Cols > 0, "vacuous GEMM shape");
+  static_assert(Rows >= Cols, "rows < cols must be transposed first");
+
+  static constexpr int kRows = Rows;
+  static constexpr int kDepth = Depth;
+  static constexpr int kCols = Cols;
+  static constexpr int kLhsScalarSize =
+      sizeof(typename KernelFormat::Lhs::Scalar);
+  static constexpr int kRhsScalarSize =
+      sizeof(typename KernelFormat::Rhs::Scalar);
+
+  // See BlockParams::FindL2BlockSizes.
+  static constexpr int l2_depth = RoundUp<kRegisterSize>(Depth);
+  static constexpr int kMaxL2Cols = ConstexprMax(
+      1, static_cast<int>(kDefaultL2RhsFactor *
+                          (L2Bytes / (l2_depth * kRhsScalarSize))));
+  static constexpr int l2_cols = RoundUp<KernelFormat::kCols>(
+      CeilQuotient(Cols, ConstexprMax(1, CeilQuotient(Cols, kMaxL2Cols))));
+  static constexpr int kPerThreadRows =
+      ConstexprMax(1, RoundUp<KernelFormat::kRows>(Rows));
+  static constexpr int kMaxL2Rows = ConstexprMax(
+      1, (L2Bytes - l2_depth * l2_cols * kRhsScalarSize) /
+             (l2_depth * kLhsScalarSize + 4 * l2_cols));
+  static constexpr int l2_rows =
+      kDefaultL2RhsFactor == 1.0f
+          ? RoundUp<KernelFormat::kRows>(kPerThreadRows)
+          : RoundUp<KernelFormat::kRows>(CeilQuotient(
+                kPerThreadRows,
+                ConstexprMax(1, CeilQuotient(kPerThreadRows, kMaxL2Rows))));
+  static constexpr int packed_rhs_depth = l2_depth;
+  static constexpr int l3_cols = l2_cols;
+
+  // See BlockParams::FindL1BlockSizes.
+  static constexpr int l1_cols = l2_cols;
+  static constexpr int kMaxL1Depth = ConstexprMax(
+      1, (L1Bytes - 4 * KernelFormat::kRows * KernelFormat::kCols) /
+             (KernelFormat::kRows * kLhsScalarSize +
+              KernelFormat::kCols * kRhsScalarSize));
+  static constexpr int l1_depth = RoundUp<kRegisterSize>(CeilQuotient(
+      l2_depth, ConstexprMax(1, CeilQuotient(l2_depth, kMaxL1Depth))));
+  static constexpr int kMaxL1Rows =
+      ConstexprMax(1, L1Bytes / (l1_depth * kLhsScalarSize + 4 * l1_cols));
+  static constexpr int l1_rows = RoundUp<KernelFormat::kRows>(CeilQuotient(
+      l2_rows, ConstexprMax(1, CeilQuotient(l2_rows, kMaxL1Rows))));
+
+  // The same parameters as a BlockParams, for PackedSideBlock and
+  // PackedResult.
+  static BlockParams Get() {
+    BlockParams block_params;
+    block_params.l1_rows = l1_rows;
+    block_params.l1_cols = l1_cols;
+    block_params.l1_depth = l1_depth;
+    block_params.l2_rows = l2_rows;
+    block_params.l2_cols = l2_cols;
+    block_params.l2_depth = l2_depth;
+    block_params.packed_rhs_depth = packed_rhs_depth;
+    block_params.l3_cols = l3_cols;
+    return block_params;
+  }
+};
+
+// ComputeImpl passes some of these by reference, e.g. to std::min.
+#define GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(name)                             \
+  template <typename KernelFormat, int Rows, int Depth, int Cols,         \
+            int L1Bytes, int L2Bytes>                                     \
+  constexpr int                                                           \
+      FixedShapeBlockParams<KernelFormat, Rows, Depth, Cols, L1Bytes,     \
+                            L2Bytes>::name;
+GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(l1_rows)
+GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(l1_cols)
+GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(l1_depth)
+GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(l2_rows)
+GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(l2_cols)
+GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM(l2_depth)
+#undef GEMMLOWP_FIXED_SHAPE_BLOCK_PARAM
+
+// Runs a GEMM of the shape of Params, with Rows >= Cols. It follows the
+// loops of SingleThreadGemmImpl, with L2 blocks of compile-time sizes: all
+// but the last block in each dimension have the full L2 size.
+template <typename KernelFormat, typename Params, typename LhsType,
+          typename RhsType, typename ResultType, typename LhsOffset,
+          typename RhsOffset, typename OutputPipelineType>
+class FixedShapeGemmImpl {
+ public:
+  typedef PackedSideBlock<typename KernelFormat::Lhs> PackedLhs;
+  typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+
+  static constexpr int kRowBlocks =
+      CeilQuotient(Params::kRows, Params::l2_rows);
+  static constexpr int kLastBlockRows =
+      Params::kRows - (kRowBlocks - 1) * Params::l2_rows;
+  static constexpr int kColBlocks =
+      CeilQuotient(Params::kCols, Params::l2_cols);
+  static constexpr int kLastBlockCols =
+      Params::kCols - (kColBlocks - 1) * Params::l2_cols;
+
+  FixedShapeGemmImpl(SingleThreadGemmContext* context,
+                     const KernelBase& kernel, const LhsType& lhs,
+                     const RhsType& rhs, ResultType* result,
+                     const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                     const OutputPipelineType& output_pipeline)
+      : block_params_(Params::Get()),
+        allocator_(context->allocator()),
+        kernel_(kernel),
+        lhs_(lhs),
+        rhs_(rhs),
+        result_(result),
+        lhs_offset_(lhs_offset),
+        rhs_offset_(rhs_offset),
+        output_pipeline_(output_pipeline),
+        packed_lhs_(Side::Lhs, allocator_, block_params_),
+        packed_rhs_(Side::Rhs, allocator_, block_params_),
+        packed_result_(allocator_, block_params_) {}
+
+  void Run() {
+    ScopedProfilingLabel label("gemmlowp::FixedShapeGemm");
+    assert(lhs_.rows() == Params::kRows && lhs_.cols() == Params::kDepth);
+    assert(rhs_.rows() == Params::kDepth && rhs_.cols() == Params::kCols);
+    assert(result_->rows() == Params::kRows &&
+           result_->cols() == Params::kCols);
+
+    allocator_->Commit();
+    if (kColBlocks == 1) {
+      PackRhs(&packed_rhs_, rhs_);
+    }
+    for (int i = 0; i < kRowBlocks - 1; i++) {
+      RunRowBlock<Params::l2_rows>(i * Params::l2_rows);
+    }
+    RunRowBlock<kLastBlockRows>((kRowBlocks - 1) * Params::l2_rows);
+    allocator_->Decommit();
+  }
+
+ private:
+  template <int BlockRows>
+  void RunRowBlock(int r) {
+    PackLhs(&packed_lhs_, lhs_.block(r, 0, BlockRows, Params::kDepth));
+    for (int i = 0; i < kColBlocks - 1; i++) {
+      RunBlock<BlockRows, Params::l2_cols>(r, i * Params::l2_cols);
+    }
+    RunBlock<BlockRows, kLastBlockCols>(r,
+                                        (kColBlocks - 1) * Params::l2_cols);
+  }
+
+  template <int BlockRows, int BlockCols>
+  void RunBlock(int r, int c) {
+    if (kColBlocks > 1) {
+      PackRhs(&packed_rhs_, rhs_.block(0, c, Params::kDepth, BlockCols));
+    }
+    {
+      ScopedProfilingLabel label("compute");
+      ComputeImpl<PackedLhs, PackedRhs, PackedResult, Params> impl(
+          kernel_, params_, &packed_result_, packed_lhs_, packed_rhs_);
+      impl.Compute(Params::kDepth, 0, 0);
+    }
+    UnpackResult<KernelFormat>(
+        result_, FixedMatrixBlockBounds<BlockRows, BlockCols>(r, c),
+        packed_result_, Params::kDepth, packed_lhs_.sums_of_each_slice(),
+        packed_rhs_.sums_of_each_slice(), lhs_offset_.block(r, BlockRows),
+        rhs_offset_.block(c, BlockCols), output_pipeline_);
+  }
+
+  // Only for ComputeImpl to refer to; all its members are static.
+  const Params params_ = Params();
+  const BlockParams block_params_;
+  Allocator* const allocator_;
+  const KernelBase& kernel_;
+  const LhsType& lhs_;
+  const RhsType& rhs_;
+  ResultType* const result_;
+  const LhsOffset& lhs_offset_;
+  const RhsOffset& rhs_offset_;
+  const OutputPipelineType& output_pipeline_;
+  PackedLhs packed_lhs_;
+  PackedRhs packed_rhs_;
+  PackedResult packed_result_;
+};
+
+// The scratch storage that FixedShapeGemmImpl reserves for the shape of
+// Params, replayed on a throwaway allocator like
+// MultiThreadGemmScratchSize does.
+template <typename KernelFormat, typename Params>
+ScratchSize FixedShapeGemmImplScratchSize() {
+  const BlockParams block_params = Params::Get();
+  Allocator allocator;
+  {
+    PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(
+        Side::Lhs, &allocator, block_params);
+    PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(
+        Side::Rhs, &allocator, block_params);
+    PackedResult packed_result(&allocator, block_params);
+  }
+  ScratchSize size;
+  size.main_bytes = allocator.reserved_bytes();
+  allocator.DiscardReservations();
+  return size;
+}
+
+template <int Rows, int Depth, int Cols, typename BitDepthParams,
+          typename LhsType, typename RhsType, typename ResultType,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void DispatchFixedShapeGemm(SingleThreadGemmContext* context,
+                            const LhsType& lhs, const RhsType& rhs,
+                            ResultType* result, const LhsOffset& lhs_offset,
+                            const RhsOffset& rhs_offset,
+                            const OutputPipelineType& output_pipeline,
+                            std::false_type /* transpose */) {
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  typedef typename Kernel::Format KernelFormat;
+  typedef FixedShapeBlockParams<KernelFormat, Rows, Depth, Cols> Params;
+  Kernel kernel;
+  FixedShapeGemmImpl<KernelFormat, Params, LhsType, RhsType, ResultType,
+                     LhsOffset, RhsOffset, OutputPipelineType>
+      impl(context, kernel, lhs, rhs, result, lhs_offset, rhs_offset,
+           output_pipeline);
+  impl.Run();
+}
+
+// Like DispatchGemmShape, computes the case of rows < cols as the
+// transposed product.
+template <int Rows, int Depth, int Cols, typename BitDepthParams,
+          typename LhsType, typename RhsType, typename ResultType,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void DispatchFixedShapeGemm(SingleThreadGemmContext* context,
+                            const LhsType& lhs, const RhsType& rhs,
+                            ResultType* result, const LhsOffset& lhs_offset,
+                            const RhsOffset& rhs_offset,
+                            const OutputPipelineType& output_pipeline,
+                            std::true_type /* transpose */) {
+  auto transposed_result_map = Transpose(*result);
+  DispatchFixedShapeGemm<Cols, Depth, Rows, BitDepthParams>(
+      context, Transpose(rhs), Transpose(lhs), &transposed_result_map,
+      Transpose(rhs_offset), Transpose(lhs_offset),
+      TransposeTuple(output_pipeline), std::false_type());
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_FIXED_SHAPE_GEMM_H_
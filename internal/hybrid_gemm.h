@@ -0,0 +1,294 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// hybrid_gemm.h: support for float operands that are quantized to uint8 on
+// the fly, while they are being packed. See HybridFloatGemm in gemmlowp.h.
+//
+// Each line of a QuantizingFloatMatrixMap (a column of a RHS, or a row of a
+// LHS once DispatchGemmShape has transposed the product) gets its own scale
+// and zero point, derived from the min and max of its entries. Since packing
+// always covers the whole depth (see CanPackLhsDepthBlocks), each packed
+// block holds entire lines, so their quantization parameters are known by
+// the time the block is packed, and they are written to arrays from which
+// the offsets and the final dequantization output stage read them during
+// unpacking. The float operand is therefore only read by packing, and no
+// separate quantization pass or quantized copy of it is needed.
+
+#ifndef GEMMLOWP_INTERNAL_HYBRID_GEMM_H_
+#define GEMMLOWP_INTERNAL_HYBRID_GEMM_H_
+
+#include <algorithm>
+
+#include "../public/map.h"
+#include "pack.h"
+
+namespace gemmlowp {
+
+// A map on a float matrix that is to be quantized on the fly. tParamsShape
+// tells along which dimension the quantization parameters vary:
+// VectorShape::Row means one scale and offset per column (a RHS), and
+// VectorShape::Col one per row (a LHS). The offsets are gemmlowp offsets,
+// i.e. the negated zero points: the real value of a quantized entry q is
+// scale * (q + offset). The scales and offsets arrays are not read but
+// written, by PackLhs/PackRhs below.
+template <MapOrder tOrder, VectorShape tParamsShape>
+class QuantizingFloatMatrixMap {
+ public:
+  typedef float Scalar;
+  static constexpr MapOrder kOrder = tOrder;
+  static constexpr VectorShape kParamsShape = tParamsShape;
+
+  QuantizingFloatMatrixMap(const float* data, int rows, int cols, int stride,
+                           float* scales, std::int32_t* offsets)
+      : data_(data),
+        rows_(rows),
+        cols_(cols),
+        stride_(stride),
+        scales_(scales),
+        offsets_(offsets) {}
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int stride() const { return stride_; }
+  const float* data() const { return data_; }
+  float* scales() const { return scales_; }
+  std::int32_t* offsets() const { return offsets_; }
+
+  QuantizingFloatMatrixMap block(int start_row, int start_col, int block_rows,
+                                 int block_cols) const {
+    assert(start_row >= 0);
+    assert(start_row + block_rows <= rows_);
+    assert(start_col >= 0);
+    assert(start_col + block_cols <= cols_);
+    const int data_offset = kOrder == MapOrder::ColMajor
+                                ? start_row + start_col * stride_
+                                : start_row * stride_ + start_col;
+    const int params_offset =
+        kParamsShape == VectorShape::Row ? start_col : start_row;
+    return QuantizingFloatMatrixMap(data_ + data_offset, block_rows,
+                                    block_cols, stride_,
+                                    scales_ + params_offset,
+                                    offsets_ + params_offset);
+  }
+
+ private:
+  const float* data_;
+  int rows_, cols_, stride_;
+  float* scales_;
+  std::int32_t* offsets_;
+};
+
+// Like SideMap, for a QuantizingFloatMatrixMap: one scale and offset per
+// unit of width.
+template <SideMapOrder tOrder>
+class QuantizingFloatSideMap {
+ public:
+  typedef float Scalar;
+  static constexpr SideMapOrder kOrder = tOrder;
+
+  QuantizingFloatSideMap(const float* data, int width, int depth, int stride,
+                         float* scales, std::int32_t* offsets)
+      : data_(data),
+        width_(width),
+        depth_(depth),
+        stride_(stride),
+        scales_(scales),
+        offsets_(offsets) {}
+
+  int width() const { return width_; }
+  int depth() const { return depth_; }
+  int stride() const { return stride_; }
+  int width_stride() const {
+    return kOrder == SideMapOrder::DepthMajor ? 1 : stride_;
+  }
+  int depth_stride() const {
+    return kOrder == SideMapOrder::WidthMajor ? 1 : stride_;
+  }
+  const float* data(int w, int d) const {
+    return data_ + w * width_stride() + d * depth_stride();
+  }
+  float operator()(int w, int d) const { return *data(w, d); }
+  float scale(int w) const { return scales_[w]; }
+  std::int32_t offset(int w) const { return offsets_[w]; }
+
+  QuantizingFloatSideMap block(int start_width, int start_depth,
+                               int block_width, int block_depth) const {
+    assert(start_width >= 0);
+    assert(start_width + block_width <= width_);
+    assert(start_depth >= 0);
+    assert(start_depth + block_depth <= depth_);
+
+    return QuantizingFloatSideMap(data(start_width, start_depth), block_width,
+                                  block_depth, stride_,
+                                  scales_ + start_width,
+                                  offsets_ + start_width);
+  }
+
+  // Chooses the scale and offset of each line from the range of its
+  // entries. The range is extended to contain 0, so that 0 is exactly
+  // representable, as zero-padding in neural networks requires.
+  void ComputeQuantizationParams() const {
+    for (int w = 0; w < width_; w++) {
+      float min = 0.f;
+      float max = 0.f;
+      for (int d = 0; d < depth_; d++) {
+        const float x = (*this)(w, d);
+        min = std::min(min, x);
+        max = std::max(max, x);
+      }
+      if (max == min) {
+        // All zeros.
+        scales_[w] = 1.f;
+        offsets_[w] = 0;
+        continue;
+      }
+      const float scale = (max - min) / 255.f;
+      const std::int32_t zero_point = std::min(
+          255, std::max(0, static_cast<std::int32_t>(-min / scale + 0.5f)));
+      scales_[w] = scale;
+      offsets_[w] = -zero_point;
+    }
+  }
+
+  // Quantizes the count consecutive (in storage order) entries starting
+  // at (w, d), all of which must be in the same line if the storage is
+  // width-major, or be consecutive lines if it is depth-major.
+  void QuantizeContiguous(int w, int d, int count, std::uint8_t* dst) const {
+    const float* src = data(w, d);
+    if (kOrder == SideMapOrder::WidthMajor) {
+      QuantizeLine(src, count, 1.f / scales_[w], -offsets_[w], dst);
+    } else {
+      for (int i = 0; i < count; i++) {
+        QuantizeLine(src + i, 1, 1.f / scales_[w + i], -offsets_[w + i],
+                     dst + i);
+      }
+    }
+  }
+
+ private:
+  static void QuantizeLine(const float* src, int count, float inverse_scale,
+                           std::int32_t zero_point, std::uint8_t* dst) {
+    const float zero_point_float = static_cast<float>(zero_point);
+    for (int i = 0; i < count; i++) {
+      const float q = std::min(
+          255.f, std::max(0.f, src[i] * inverse_scale + zero_point_float));
+      // q is non-negative, so truncating q + 0.5 rounds to nearest.
+      dst[i] = static_cast<std::uint8_t>(q + 0.5f);
+    }
+  }
+
+  const float* data_;  // not owned.
+  int width_, depth_, stride_;
+  float* scales_;          // not owned.
+  std::int32_t* offsets_;  // not owned.
+};
+
+// PackingRegisterBlock for float sources being quantized. Like for 4-bit
+// sources, every source block is first quantized into a local complete
+// block of uint8 entries, which is then packed by the PackingRegisterBlock
+// for uint8 sources, including any architecture-specific specialization
+// of it.
+template <SideMapOrder tOrder, typename PackedSideBlock>
+class PackingRegisterBlock<QuantizingFloatSideMap<tOrder>, PackedSideBlock> {
+ public:
+  typedef typename PackedSideBlock::KernelSideFormat KernelSideFormat;
+  typedef typename KernelSideFormat::InputScalar KernelInputScalar;
+  typedef typename KernelSideFormat::Scalar KernelScalar;
+  static constexpr int kKernelWidth = KernelSideFormat::kWidth;
+  static constexpr int kZeroPointInputValue =
+      ZeroPointInputValue<KernelInputScalar, KernelScalar>::kValue;
+  static_assert(std::is_same<KernelInputScalar, std::uint8_t>::value,
+                "float sources are only quantized to uint8 kernel inputs");
+
+  typedef SideMap<const std::uint8_t, tOrder> QuantizedSrcMapType;
+
+  void UseCompleteSrcInPlace(const QuantizingFloatSideMap<tOrder>& src) {
+    MakeCompleteSrc(src);
+  }
+
+  void MakeCompleteSrc(const QuantizingFloatSideMap<tOrder>& src) {
+    if (src.width() < kKernelWidth || src.depth() < kRegisterSize) {
+      memset(buf_, kZeroPointInputValue, kKernelWidth * kRegisterSize);
+    }
+    if (tOrder == SideMapOrder::WidthMajor) {
+      for (int w = 0; w < src.width(); w++) {
+        src.QuantizeContiguous(w, 0, src.depth(), buf_ + w * kRegisterSize);
+      }
+    } else {
+      for (int d = 0; d < src.depth(); d++) {
+        src.QuantizeContiguous(0, d, src.width(), buf_ + d * kKernelWidth);
+      }
+    }
+    quantized_block_.UseCompleteSrcInPlace(
+        QuantizedSrcMapType(buf_, kKernelWidth, kRegisterSize));
+  }
+
+  void Pack(PackedSideBlock* dst, int start_width) {
+    quantized_block_.Pack(dst, start_width);
+  }
+
+ private:
+  // Quantized source data, in the source storage order.
+  std::uint8_t buf_[kKernelWidth * kRegisterSize];
+
+  PackingRegisterBlock<QuantizedSrcMapType, PackedSideBlock> quantized_block_;
+};
+
+// The quantization parameters of a row depend on all of it, so the LHS
+// can't be packed in depth blocks.
+template <MapOrder Order>
+struct CanPackLhsDepthBlocks<
+    QuantizingFloatMatrixMap<Order, VectorShape::Col>> {
+  static constexpr bool kValue = false;
+};
+
+// Quantizes and packs a block of a float input LHS matrix, into a
+// PackedSideBlock, writing the quantization parameters of its rows.
+template <typename PackedSideBlock, MapOrder Order>
+void PackLhs(PackedSideBlock* dst,
+             const QuantizingFloatMatrixMap<Order, VectorShape::Col>& src) {
+  ScopedProfilingLabel label("pack LHS (quantizing float source)");
+  static const SideMapOrder kSideMapOrder = Order == MapOrder::RowMajor
+                                                ? SideMapOrder::WidthMajor
+                                                : SideMapOrder::DepthMajor;
+  typedef QuantizingFloatSideMap<kSideMapOrder> SideMapType;
+  SideMapType src_side_map(src.data(), src.rows(), src.cols(), src.stride(),
+                           src.scales(), src.offsets());
+  src_side_map.ComputeQuantizationParams();
+  typedef PackSideBlockImpl<SideMapType, PackedSideBlock> ImplType;
+  ImplType impl(dst, src_side_map);
+  impl.PackL2();
+}
+
+// Quantizes and packs a block of a float input RHS matrix, into a
+// PackedSideBlock, writing the quantization parameters of its columns.
+template <typename PackedSideBlock, MapOrder Order>
+void PackRhs(PackedSideBlock* dst,
+             const QuantizingFloatMatrixMap<Order, VectorShape::Row>& src) {
+  ScopedProfilingLabel label("pack RHS (quantizing float source)");
+  static const SideMapOrder kSideMapOrder = Order == MapOrder::ColMajor
+                                                ? SideMapOrder::WidthMajor
+                                                : SideMapOrder::DepthMajor;
+  typedef QuantizingFloatSideMap<kSideMapOrder> SideMapType;
+  SideMapType src_side_map(src.data(), src.cols(), src.rows(), src.stride(),
+                           src.scales(), src.offsets());
+  src_side_map.ComputeQuantizationParams();
+  typedef PackSideBlockImpl<SideMapType, PackedSideBlock> ImplType;
+  ImplType impl(dst, src_side_map);
+  impl.PackL2();
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_HYBRID_GEMM_H_
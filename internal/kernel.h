@@ -165,6 +165,29 @@ struct KernelSideFormatInt8Inputs : KernelSideFormat<tCellFormat, tCells> {
   typedef std::int8_t InputScalar;
 };
 
+// KernelSideFormat for int16 inputs, which are packed as-is, two bytes per
+// entry. See Int8Int16GemmWithOutputPipelinePC.
+template <typename tCellFormat, int tCells>
+struct KernelSideFormatInt16Inputs : KernelSideFormat<tCellFormat, tCells> {
+  typedef std::int16_t Scalar;
+  typedef std::int16_t InputScalar;
+};
+
+// Selects the KernelSideFormat for signed inputs that are packed as-is,
+// according to their scalar type.
+template <typename InputScalar, typename tCellFormat, int tCells>
+struct SignedInputsKernelSideFormat {};
+
+template <typename tCellFormat, int tCells>
+struct SignedInputsKernelSideFormat<std::int8_t, tCellFormat, tCells> {
+  typedef KernelSideFormatInt8Inputs<tCellFormat, tCells> Type;
+};
+
+template <typename tCellFormat, int tCells>
+struct SignedInputsKernelSideFormat<std::int16_t, tCellFormat, tCells> {
+  typedef KernelSideFormatInt16Inputs<tCellFormat, tCells> Type;
+};
+
 // KernelFormat describes fully the input data layout that a kernel expects.
 // It consists of two KernelSideFormat's, one for LHS and one for RHS.
 template <typename tLhs, typename tRhs>
@@ -178,6 +201,17 @@ struct KernelFormat {
   static constexpr int kCols = Rhs::Cell::kWidth * Rhs::kCells;
 };
 
+// The format of kernels multiplying int8 by int16 inputs, in either order
+// (DispatchGemmShape may swap the LHS and RHS). Cells are 4 entries wide
+// and 2 deep, WidthMajor, so that each depth pair of an entry is a 32-bit
+// word, as expected by 16-bit multiply-add instructions such as pmaddwd.
+template <typename LhsScalar, typename RhsScalar>
+using Int8Int16KernelFormat = KernelFormat<
+    typename SignedInputsKernelSideFormat<
+        LhsScalar, CellFormat<4, 2, CellOrder::WidthMajor>, 2>::Type,
+    typename SignedInputsKernelSideFormat<
+        RhsScalar, CellFormat<4, 2, CellOrder::WidthMajor>, 1>::Type>;
+
 inline const char* CellOrderName(CellOrder o) {
   switch (o) {
     case CellOrder::DepthMajor:
@@ -246,6 +280,11 @@ struct ZeroPointInputValue<std::int8_t, std::int8_t> {
   static constexpr std::uint8_t kValue = 0;
 };
 
+template <>
+struct ZeroPointInputValue<std::int16_t, std::int16_t> {
+  static constexpr std::int16_t kValue = 0;
+};
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_KERNEL_H_
@@ -43,15 +43,25 @@ template <bool MaxProductIsLessThan4096>
 struct DefaultKernelImpl<MaxProductIsLessThan4096, true, true>
     : DefaultKernelImpl<MaxProductIsLessThan4096, true, false> {};
 
+// Whether the LHS, once converted to the int8 representation used by
+// int8 kernels, can never take the value -128. For unsigned inputs, packing
+// subtracts 128, so this means that the uint8 input is never 0. For signed
+// inputs, no conversion takes place.
+template <typename LhsRange>
+struct LhsRangeIsNonZeroInInt8 {
+  static constexpr bool kValue = LhsRange::kMinValue >= 0
+                                     ? LhsRange::kMinValue > 0
+                                     : LhsRange::kMinValue > -128;
+};
+
 template <typename BitDepthParams>
 struct DefaultKernel
     : DefaultKernelImpl<(BitDepthParams::LhsRange::kMaxValue *
                              BitDepthParams::RhsRange::kMaxValue <
                          4096),
                         (BitDepthParams::LhsRange::kMinValue >= 0),
-                        (BitDepthParams::LhsRange::kMinValue > 0 ||
-                         (BitDepthParams::LhsRange::kMaxValue <= 127 &&
-                          BitDepthParams::LhsRange::kMinValue > -128))> {};
+                        LhsRangeIsNonZeroInInt8<
+                            typename BitDepthParams::LhsRange>::kValue> {};
 
 }  // end namespace gemmlowp
 
@@ -109,4 +119,22 @@ typedef ReferenceKernel<KernelFormat<
 GEMMLOWP_SET_DEFAULT_KERNEL(false, true, false, DefaultReferenceKernel)
 #endif
 
+// The kernel for int8 x int16 products, see
+// Int8Int16GemmWithOutputPipelinePC. LhsScalar and RhsScalar are int8 and
+// int16, in either order.
+#if defined(GEMMLOWP_SSE4) || defined(GEMMLOWP_AVX2)
+#include "kernel_sse.h"
+namespace gemmlowp {
+template <typename LhsScalar, typename RhsScalar>
+struct DefaultInt8Int16Kernel
+    : SSE4_Kernel8x4Depth2Int8Int16<LhsScalar, RhsScalar> {};
+}  // namespace gemmlowp
+#else
+namespace gemmlowp {
+template <typename LhsScalar, typename RhsScalar>
+struct DefaultInt8Int16Kernel
+    : ReferenceKernel<Int8Int16KernelFormat<LhsScalar, RhsScalar>> {};
+}  // namespace gemmlowp
+#endif
+
 #endif  // GEMMLOWP_INTERNAL_KERNEL_DEFAULT_H_
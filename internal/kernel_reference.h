@@ -46,9 +46,16 @@ struct ReferenceKernel : KernelBase {
   }
 
   void Run(std::int32_t* dst_ptr, std::size_t dst_row_stride,
-           std::size_t dst_col_stride, const std::uint8_t* lhs_ptr,
-           const std::uint8_t* rhs_ptr, std::size_t start_depth,
+           std::size_t dst_col_stride, const std::uint8_t* lhs_data,
+           const std::uint8_t* rhs_data, std::size_t start_depth,
            std::size_t run_depth) const override {
+    // The packed data is of the scalar types of the format, which are
+    // not necessarily uint8 (e.g. int8 or int16).
+    typedef typename Format::Lhs::Scalar LhsScalar;
+    typedef typename Format::Rhs::Scalar RhsScalar;
+    const LhsScalar* lhs_ptr = reinterpret_cast<const LhsScalar*>(lhs_data);
+    const RhsScalar* rhs_ptr = reinterpret_cast<const RhsScalar*>(rhs_data);
+
     std::int32_t accumulator[Format::kRows * Format::kCols];
     memset(accumulator, 0, sizeof(accumulator));
 
@@ -59,11 +66,11 @@ struct ReferenceKernel : KernelBase {
       // The next two loops are over cells of the Lhs (stacked vertically),
       // and over cells of the Rhs (stacked horizontally).
       for (int rc = 0; rc < Format::Lhs::kCells; rc++) {
-        const std::uint8_t* lhs_cell_ptr =
+        const LhsScalar* lhs_cell_ptr =
             lhs_ptr + (dc * Format::Lhs::kCells + rc) *
                           Format::Lhs::Cell::kWidth * Format::kDepth;
         for (int cc = 0; cc < Format::Rhs::kCells; cc++) {
-          const std::uint8_t* rhs_cell_ptr =
+          const RhsScalar* rhs_cell_ptr =
               rhs_ptr + (dc * Format::Rhs::kCells + cc) *
                             Format::Rhs::Cell::kWidth * Format::kDepth;
 
@@ -73,10 +80,10 @@ struct ReferenceKernel : KernelBase {
           for (int di = 0; di < Format::kDepth; di++) {
             for (int ri = 0; ri < Format::Lhs::Cell::kWidth; ri++) {
               for (int ci = 0; ci < Format::Rhs::Cell::kWidth; ci++) {
-                const std::uint8_t* lhs_coeff_ptr =
+                const LhsScalar* lhs_coeff_ptr =
                     lhs_cell_ptr +
                     OffsetIntoCell<typename Format::Lhs::Cell>(ri, di);
-                const std::uint8_t* rhs_coeff_ptr =
+                const RhsScalar* rhs_coeff_ptr =
                     rhs_cell_ptr +
                     OffsetIntoCell<typename Format::Rhs::Cell>(ci, di);
                 std::int32_t* accumulator_coeff_ptr =
@@ -0,0 +1,186 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// load_imbalance.h: measures how evenly MultiThreadGemm spreads its work
+// over its tasks. Each time that it fans tasks out to the workers (once per
+// L3 block of the RHS), it records when each task started and finished
+// relative to the fan-out, and these timings are aggregated per GEMM shape.
+// See MultiThreadGemmContextBase::set_load_imbalance_stats_enabled.
+
+#ifndef GEMMLOWP_INTERNAL_LOAD_IMBALANCE_H_
+#define GEMMLOWP_INTERNAL_LOAD_IMBALANCE_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "../profiling/instrumentation.h"
+#include "stage_stats.h"
+
+namespace gemmlowp {
+
+// The timings of the tasks of one fan-out. Each task writes its own
+// entry, and the thread that fanned them out reads them once they are all
+// done, so no synchronization is needed beyond that of the workers pool.
+class FanOutTimings {
+ public:
+  void Start(int task_count) {
+    task_start_.assign(task_count, 0);
+    task_end_.assign(task_count, 0);
+    start_ = StageClockNanoseconds();
+  }
+
+  void Finish() { end_ = StageClockNanoseconds(); }
+
+  // Called by the task_index-th task when it starts and when it finishes.
+  void TaskStarted(int task_index) {
+    task_start_[task_index] = StageClockNanoseconds() - start_;
+  }
+  void TaskFinished(int task_index) {
+    task_end_[task_index] = StageClockNanoseconds() - start_;
+  }
+
+  int task_count() const { return static_cast<int>(task_start_.size()); }
+  std::uint64_t task_start(int i) const { return task_start_[i]; }
+  std::uint64_t task_end(int i) const { return task_end_[i]; }
+  std::uint64_t task_duration(int i) const {
+    return task_end_[i] - task_start_[i];
+  }
+  std::uint64_t duration() const { return end_ - start_; }
+
+ private:
+  std::uint64_t start_ = 0;
+  std::uint64_t end_ = 0;
+  // Relative to start_.
+  std::vector<std::uint64_t> task_start_;
+  std::vector<std::uint64_t> task_end_;
+};
+
+// The timings of the fan-outs of the GEMMs of one shape, summed over
+// fan-outs. The last task is the one run on the calling thread.
+struct LoadImbalanceEntry {
+  int rows = 0;
+  int depth = 0;
+  int cols = 0;
+  int task_count = 0;
+  std::uint64_t fan_outs = 0;
+  // Per task: the time from the fan-out to its start, and its duration.
+  std::vector<std::uint64_t> task_start_nanoseconds;
+  std::vector<std::uint64_t> task_nanoseconds;
+  // The duration of the longest task of each fan-out.
+  std::uint64_t max_task_nanoseconds = 0;
+  // The time from the fan-out to the start of the last task to start.
+  std::uint64_t last_start_nanoseconds = 0;
+  // The time that the calling thread waited for the workers after its
+  // own task.
+  std::uint64_t main_wait_nanoseconds = 0;
+  // The time from each fan-out until all of its tasks were done.
+  std::uint64_t fan_out_nanoseconds = 0;
+
+  double mean_task_nanoseconds() const {
+    std::uint64_t total = 0;
+    for (std::uint64_t t : task_nanoseconds) {
+      total += t;
+    }
+    return task_count ? static_cast<double>(total) / task_count : 0;
+  }
+
+  // The longest task time over the mean task time: 1 is perfect balance,
+  // and with n tasks, n means that one task did all the work.
+  double imbalance_ratio() const {
+    const double mean = mean_task_nanoseconds();
+    return mean ? max_task_nanoseconds / mean : 0;
+  }
+};
+
+// The entries of all the shapes seen while enabled.
+class LoadImbalanceStats {
+ public:
+  void Add(int rows, int depth, int cols, const FanOutTimings& timings) {
+    ScopedLock sl(&mutex_);
+    const int task_count = timings.task_count();
+    LoadImbalanceEntry* entry = nullptr;
+    for (LoadImbalanceEntry& e : entries_) {
+      if (e.rows == rows && e.depth == depth && e.cols == cols &&
+          e.task_count == task_count) {
+        entry = &e;
+        break;
+      }
+    }
+    if (!entry) {
+      entries_.emplace_back();
+      entry = &entries_.back();
+      entry->rows = rows;
+      entry->depth = depth;
+      entry->cols = cols;
+      entry->task_count = task_count;
+      entry->task_start_nanoseconds.assign(task_count, 0);
+      entry->task_nanoseconds.assign(task_count, 0);
+    }
+    entry->fan_outs++;
+    std::uint64_t max_task = 0;
+    std::uint64_t last_start = 0;
+    for (int i = 0; i < task_count; i++) {
+      entry->task_start_nanoseconds[i] += timings.task_start(i);
+      entry->task_nanoseconds[i] += timings.task_duration(i);
+      max_task = std::max(max_task, timings.task_duration(i));
+      last_start = std::max(last_start, timings.task_start(i));
+    }
+    entry->max_task_nanoseconds += max_task;
+    entry->last_start_nanoseconds += last_start;
+    entry->main_wait_nanoseconds +=
+        timings.duration() - timings.task_end(task_count - 1);
+    entry->fan_out_nanoseconds += timings.duration();
+  }
+
+  std::vector<LoadImbalanceEntry> Entries() const {
+    ScopedLock sl(&mutex_);
+    return entries_;
+  }
+
+  void Reset() {
+    ScopedLock sl(&mutex_);
+    entries_.clear();
+  }
+
+  // Prints one line per shape on stdout, then the mean start delay and
+  // duration of each task, in microseconds per fan-out.
+  void Print() const {
+    for (const LoadImbalanceEntry& e : Entries()) {
+      const double us_per_fan_out = 1e-3 / e.fan_outs;
+      printf(
+          "%dx%dx%d: %d tasks, %llu fan-outs, imbalance %.3f, fan-out %.1f "
+          "us, last start %.1f us, main wait %.1f us\n",
+          e.rows, e.depth, e.cols, e.task_count,
+          static_cast<unsigned long long>(e.fan_outs), e.imbalance_ratio(),
+          e.fan_out_nanoseconds * us_per_fan_out,
+          e.last_start_nanoseconds * us_per_fan_out,
+          e.main_wait_nanoseconds * us_per_fan_out);
+      for (int i = 0; i < e.task_count; i++) {
+        printf("    task %d%s: start %.1f us, duration %.1f us\n", i,
+               i == e.task_count - 1 ? " (calling thread)" : "",
+               e.task_start_nanoseconds[i] * us_per_fan_out,
+               e.task_nanoseconds[i] * us_per_fan_out);
+      }
+    }
+  }
+
+ private:
+  mutable Mutex mutex_;
+  std::vector<LoadImbalanceEntry> entries_;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_LOAD_IMBALANCE_H_
@@ -24,6 +24,7 @@
 #include <thread>  // NOLINT
 #include <vector>
 
+#include "load_imbalance.h"
 #include "single_thread_gemm.h"
 
 namespace gemmlowp {
@@ -211,10 +212,13 @@ class BlockingCounter {
 
 // A workload for a worker.
 struct Task {
-  Task() : local_allocator(nullptr) {}
+  Task() : local_allocator(nullptr), stage_counters(nullptr) {}
   virtual ~Task() {}
   virtual void Run() = 0;
   Allocator* local_allocator;
+  // Where to count the time that threads wait for this task, or null.
+  // See SingleThreadGemmContext::set_stage_stats_enabled.
+  GemmStageCounters* stage_counters;
 };
 
 // A worker thread.
@@ -229,6 +233,7 @@ class Worker {
 
   explicit Worker(BlockingCounter* counter_to_decrement_when_ready)
       : task_(nullptr),
+        wait_nanoseconds_(0),
         state_(State::ThreadStartup),
         counter_to_decrement_when_ready_(counter_to_decrement_when_ready) {
     pthread_cond_init(&state_cond_, nullptr);
@@ -272,6 +277,10 @@ class Worker {
     switch (new_state) {
       case State::Ready:
         if (task_) {
+          if (task_->stage_counters) {
+            task_->stage_counters->Add(GemmStage::WorkerWait,
+                                       wait_nanoseconds_, 0);
+          }
           // Doing work is part of reverting to 'ready' state.
           task_->Run();
           task_ = nullptr;
@@ -304,8 +313,10 @@ class Worker {
       // Get a state to act on
       // In the 'Ready' state, we have nothing to do but to wait until
       // we switch to another state.
+      const std::uint64_t wait_start = StageClockNanoseconds();
       State state_to_act_upon = WaitForVariableChange(
           &state_, State::Ready, &state_cond_, &state_mutex_);
+      wait_nanoseconds_ = StageClockNanoseconds() - wait_start;
 
       // We now have a state to act on, so act.
       switch (state_to_act_upon) {
@@ -329,6 +340,10 @@ class Worker {
   // Called by the master thead to give this worker work to do.
   void StartWork(Task* task) { ChangeState(State::HasWork, task); }
 
+  // Only to be used by the master thread while this worker is Ready.
+  Allocator* local_allocator() { return &local_allocator_; }
+  const Allocator* local_allocator() const { return &local_allocator_; }
+
  private:
   // The underlying thread.
   pthread_t thread_;
@@ -336,6 +351,10 @@ class Worker {
   // The task to be worked on.
   Task* task_;
 
+  // How long the last WaitForVariableChange in ThreadFunc took, to be
+  // counted against the task that ended it.
+  std::uint64_t wait_nanoseconds_;
+
   // The condition variable and mutex guarding state changes.
   pthread_cond_t state_cond_;
   pthread_mutex_t state_mutex_;
@@ -382,7 +401,7 @@ class WorkersPool {
     CreateWorkers(workers_count);
     assert(workers_count <= workers_.size());
     counter_to_decrement_when_ready_.Reset(workers_count);
-    for (std::size_t i = 0; i < tasks_count - 1; i++) {
+    for (std::size_t i = 0; i < workers_count; i++) {
       workers_[i]->StartWork(&tasks[i]);
     }
     // Execute the remaining workload immediately on the current thread.
@@ -390,6 +409,7 @@ class WorkersPool {
     task->local_allocator = &main_thread_task_allocator_;
     task->Run();
     // Wait for the workers submitted above to finish.
+    ScopedGemmStage stage(task->stage_counters, GemmStage::MainWait, 0);
     counter_to_decrement_when_ready_.Wait();
   }
 
@@ -402,7 +422,7 @@ class WorkersPool {
     CreateWorkers(workers_count);
     assert(workers_count <= workers_.size());
     counter_to_decrement_when_ready_.Reset(workers_count);
-    for (int i = 0; i < tasks_count - 1; i++) {
+    for (std::size_t i = 0; i < workers_count; i++) {
       workers_[i]->StartWork(tasks[i]);
     }
     // Execute the remaining workload immediately on the current thread.
@@ -410,7 +430,10 @@ class WorkersPool {
     task->local_allocator = &main_thread_task_allocator_;
     task->Run();
     // Wait for the workers submitted above to finish.
-    counter_to_decrement_when_ready_.Wait();
+    {
+      ScopedGemmStage stage(task->stage_counters, GemmStage::MainWait, 0);
+      counter_to_decrement_when_ready_.Wait();
+    }
     // Cleanup tasks (best to do this from the same thread that allocated
     // the memory).
     std::for_each(tasks.begin(), tasks.end(), [](Task* task) { delete task; });
@@ -421,6 +444,21 @@ class WorkersPool {
     LegacyExecuteAndDestroyTasks(tasks);
   }
 
+  // Appends the local allocators of the tasks to the given vector. Must not
+  // be called while executing tasks.
+  void GetTaskAllocators(std::vector<Allocator*>* allocators) {
+    allocators->push_back(&main_thread_task_allocator_);
+    for (auto w : workers_) {
+      allocators->push_back(w->local_allocator());
+    }
+  }
+  void GetTaskAllocators(std::vector<const Allocator*>* allocators) const {
+    allocators->push_back(&main_thread_task_allocator_);
+    for (const Worker* w : workers_) {
+      allocators->push_back(w->local_allocator());
+    }
+  }
+
  private:
   // Ensures that the pool has at least the given count of workers.
   // If any new worker has to be created, this function waits for it to
@@ -459,22 +497,21 @@ class WorkersPool {
 // RHS has been packed by the master thread; each worker thread
 // then has to pack a block of the LHS and accumulate the Gemm of these
 // packed LHS and RHS blocks.
-template <typename KernelFormat, typename InputScalar, typename OutputScalar,
-          typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
-          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
-          typename OutputPipelineType, typename GemmContextType>
+template <typename KernelFormat, typename LhsType, typename ResultType,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
 struct GemmWithPackedRhsTask : Task {
   typedef PackedSideBlock<typename KernelFormat::Lhs> PackedLhs;
   typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
   GemmWithPackedRhsTask(GemmContextType* _context, const KernelBase& _kernel,
-                        const MatrixMap<const InputScalar, LhsOrder>& _lhs,
-                        const PackedRhs& _packed_rhs,
-                        MatrixMap<OutputScalar, ResultOrder>* _result,
+                        const LhsType& _lhs, const PackedRhs& _packed_rhs,
+                        ResultType* _result,
                         const MatrixBlockBounds& _result_block,
                         const LhsOffset& _lhs_offset,
                         const RhsOffset& _rhs_offset,
                         const BlockParams& _block_params,
-                        const OutputPipelineType& _output_pipeline)
+                        const OutputPipelineType& _output_pipeline,
+                        int _task_index)
       : context(_context),
         kernel(_kernel),
         lhs(_lhs),
@@ -484,55 +521,124 @@ struct GemmWithPackedRhsTask : Task {
         lhs_offset(_lhs_offset),
         rhs_offset(_rhs_offset),
         block_params(_block_params),
-        output_pipeline(_output_pipeline) {}
+        output_pipeline(_output_pipeline),
+        task_index(_task_index),
+        fan_out_timings(nullptr) {
+    stage_counters = _context->stage_counters();
+  }
 
   void Run() override {
     ScopedProfilingLabel label("GemmWithPackedRhsTask");
+    if (fan_out_timings) {
+      fan_out_timings->TaskStarted(task_index);
+    }
 
     const int rows = result_block.rows;
     const int cols = result_block.cols;
     const int depth = lhs.cols();
 
+    context->ConfigureTaskAllocator(local_allocator, task_index);
     PackedLhs packed_lhs(Side::Lhs, local_allocator, block_params);
 
     PackedResult packed_result(local_allocator, block_params);
 
     local_allocator->Commit();
 
-    for (int c = 0; c < cols; c += block_params.l2_cols) {
-      int cs = std::min(block_params.l2_cols, cols - c);
+    // The packed RHS is an L3 panel: each packed LHS block is computed
+    // against each of its L2 blocks in turn. With L2 depth blocking, the LHS
+    // is packed one depth block at a time, for each L2 block of the RHS.
+    const bool depth_blocked =
+        block_params.l2_depth < block_params.packed_rhs_depth;
+    // The sizes of the packed entries, for the stage byte counts.
+    const std::uint64_t lhs_bytes = sizeof(typename KernelFormat::Lhs::Scalar);
+    const std::uint64_t rhs_bytes = sizeof(typename KernelFormat::Rhs::Scalar);
+
+    for (int r = 0; r < rows; r += block_params.l2_rows) {
+      int rs = std::min(block_params.l2_rows, rows - r);
+
+      if (!depth_blocked) {
+        ScopedGemmStage stage(stage_counters, GemmStage::PackLhs,
+                              lhs_bytes * rs * depth);
+        PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+      }
+
+      for (int c = 0; c < cols; c += block_params.l2_cols) {
+        int cs = std::min(block_params.l2_cols, cols - c);
 
-      for (int r = 0; r < rows; r += block_params.l2_rows) {
-        int rs = std::min(block_params.l2_rows, rows - r);
+        for (int d = 0; d < depth; d += block_params.l2_depth) {
+          int ds = std::min(block_params.l2_depth, depth - d);
 
-        PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+          if (depth_blocked) {
+            ScopedGemmStage stage(stage_counters, GemmStage::PackLhs,
+                                  lhs_bytes * rs * ds);
+            packed_lhs.set_accumulate_sums_of_each_slice(d > 0);
+            PackLhs(&packed_lhs, lhs.block(r, d, rs, ds));
+          }
 
-        Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
-                depth);
+          ScopedGemmStage stage(stage_counters, GemmStage::Compute,
+                                (lhs_bytes * rs + rhs_bytes * cs) * ds,
+                                2 * std::uint64_t(rs) * cs * ds);
+          Compute(kernel, block_params, &packed_result, packed_lhs,
+                  packed_rhs, ds, c, d);
+        }
 
+        ScopedGemmStage stage(stage_counters, GemmStage::UnpackResult,
+                              std::uint64_t(rs) * cs * sizeof(std::int32_t));
         auto curr_result_block = MatrixBlockBounds(
             result_block.start_row + r, result_block.start_col + c, rs, cs);
         UnpackResult<KernelFormat>(
             &result, curr_result_block, packed_result, depth,
-            packed_lhs.sums_of_each_slice(), packed_rhs.sums_of_each_slice(),
+            packed_lhs.sums_of_each_slice(),
+            packed_rhs.sums_of_each_slice() + c,
             lhs_offset.block(curr_result_block.start_row, rs),
             rhs_offset.block(curr_result_block.start_col, cs), output_pipeline);
       }
     }
 
     local_allocator->Decommit();
+    if (fan_out_timings) {
+      fan_out_timings->TaskFinished(task_index);
+    }
   }
 
   const GemmContextType* context;
   const KernelBase& kernel;
-  const MatrixMap<const InputScalar, LhsOrder> lhs;
+  const LhsType lhs;
   const PackedRhs packed_rhs;
-  MatrixMap<OutputScalar, ResultOrder> result;
+  ResultType result;
   const MatrixBlockBounds result_block;
   const LhsOffset& lhs_offset;
   const RhsOffset& rhs_offset;
   const BlockParams& block_params;
   const OutputPipelineType& output_pipeline;
+  const int task_index;
+  // Where to record when this task ran, if load imbalance stats are
+  // enabled.
+  FanOutTimings* fan_out_timings;
+};
+
+// An upper bound of the size of a GemmWithPackedRhsTask, which holds only
+// references and small matrix maps, so that MultiThreadGemmScratchSize can
+// reserve storage for the tasks without knowing their type.
+const std::size_t kMaxGemmTaskBytes = 512;
+
+// A task faulting in the scratch storage of a worker, see
+// MultiThreadGemmContext::WarmUp.
+template <typename GemmContextType>
+struct ScratchWarmUpTask : Task {
+  ScratchWarmUpTask(const GemmContextType* _context, std::size_t _bytes,
+                    int _task_index)
+      : context(_context), bytes(_bytes), task_index(_task_index) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("ScratchWarmUpTask");
+    context->ConfigureTaskAllocator(local_allocator, task_index);
+    PrefaultAllocator(local_allocator, bytes);
+  }
+
+  const GemmContextType* context;
+  const std::size_t bytes;
+  const int task_index;
 };
 
 // This base class for multi-threading allows subclasses to implement their own
@@ -545,6 +651,33 @@ class MultiThreadGemmContextBase : public SingleThreadGemmContext {
 
   int max_num_threads() const { return max_num_threads_; }
 
+  // Enables recording, each time that a multi-threaded GEMM fans its tasks
+  // out to the workers, when each task started and finished, and how long
+  // this thread waited for the others. These are aggregated per GEMM
+  // shape, see load_imbalance.h. This costs a few clock reads per fan-out,
+  // and is disabled by default. The stats keep their values while
+  // disabled.
+  void set_load_imbalance_stats_enabled(bool b) {
+    load_imbalance_stats_enabled_ = b;
+  }
+  bool load_imbalance_stats_enabled() const {
+    return load_imbalance_stats_enabled_;
+  }
+
+  // The stats accumulated since the context was created or since the last
+  // call to ResetLoadImbalanceStats, one entry per shape, in the order in
+  // which shapes were first seen.
+  std::vector<LoadImbalanceEntry> load_imbalance_stats() const {
+    return load_imbalance_stats_.Entries();
+  }
+  void ResetLoadImbalanceStats() { load_imbalance_stats_.Reset(); }
+  void PrintLoadImbalanceStats() const { load_imbalance_stats_.Print(); }
+
+  // The stats for GEMMs to update, or null if disabled.
+  LoadImbalanceStats* load_imbalance_counters() {
+    return load_imbalance_stats_enabled_ ? &load_imbalance_stats_ : nullptr;
+  }
+
  protected:
   // The maximum number of worker threads to use (including
   // the master thread).
@@ -561,19 +694,86 @@ class MultiThreadGemmContextBase : public SingleThreadGemmContext {
   // so users who want multi-threading have to make the decision of how many
   // threads to use by themselves.
   int max_num_threads_ = 1;
+
+  // See set_load_imbalance_stats_enabled.
+  bool load_imbalance_stats_enabled_ = false;
+  LoadImbalanceStats load_imbalance_stats_;
 };
 
 class MultiThreadGemmContext : public MultiThreadGemmContextBase {
  public:
   WorkersPool* workers_pool() { return &workers_pool_; }
 
+  // Creates the worker threads for size.task_count tasks, and has each
+  // thread allocate and fault in its share of the scratch storage of the
+  // given size, so that the first GEMM pays for neither. The worker
+  // threads touch their own storage, which then lands on their NUMA node.
+  // See GemmWarmUp in gemmlowp.h.
+  void WarmUp(const ScratchSize& size) {
+    ScopedProfilingLabel label("MultiThreadGemmContext::WarmUp");
+    PrefaultAllocator(&allocator_, size.main_bytes);
+    if (size.task_count < 1) {
+      return;
+    }
+    typedef ScratchWarmUpTask<MultiThreadGemmContext> TaskType;
+    std::vector<TaskType> tasks;
+    tasks.reserve(size.task_count);
+    for (int n = 0; n < size.task_count; n++) {
+      tasks.emplace_back(this, size.per_task_bytes, n);
+    }
+    workers_pool_.Execute(size.task_count, tasks.data());
+  }
+
+  // Like SingleThreadGemmContext::retained_scratch_bytes, but also counting
+  // the storage retained by the allocators of the worker threads.
+  std::size_t retained_scratch_bytes() const {
+    std::vector<const Allocator*> allocators;
+    GetAllocators(&allocators);
+    std::size_t total_bytes = 0;
+    for (const Allocator* allocator : allocators) {
+      total_bytes += allocator->storage_size();
+    }
+    return total_bytes;
+  }
+
+  // Like SingleThreadGemmContext::TrimScratch, but also trimming the
+  // allocators of the worker threads.
+  void TrimScratch(std::size_t target_bytes) {
+    std::vector<Allocator*> allocators;
+    GetAllocators(&allocators);
+    TrimAllocators(&allocators, target_bytes);
+  }
+
  private:
   // The workers pool used by MultiThreadGemm. Making
   // this part of the context allows it to be persistent,
   // avoiding recreating threads on every Gemm.
   WorkersPool workers_pool_;
+
+  void GetAllocators(std::vector<Allocator*>* allocators) {
+    allocators->push_back(&allocator_);
+    workers_pool_.GetTaskAllocators(allocators);
+  }
+  void GetAllocators(std::vector<const Allocator*>* allocators) const {
+    allocators->push_back(&allocator_);
+    workers_pool_.GetTaskAllocators(allocators);
+  }
 };
 
+// The max_num_threads to use for a GEMM with the given tuned parameters:
+// the tuned thread count, within the context's max_num_threads.
+template <typename GemmContextType>
+int TunedMaxNumThreads(const GemmContextType* context,
+                       const TunedBlockParams& tuned) {
+  const int max_num_threads = context->max_num_threads();
+  if (!tuned.max_num_threads) {
+    return max_num_threads;
+  }
+  return max_num_threads > 0
+             ? std::min(max_num_threads, tuned.max_num_threads)
+             : tuned.max_num_threads;
+}
+
 // Determines how many threads should be used for a given Gemm
 // operation.
 template <int KernelRows>
@@ -629,16 +829,16 @@ inline int HowManyThreads(int max_num_threads, int rows, int cols, int depth) {
 // The parallelization scheme used here is to have this master function
 // pack a block of RHS and then start worker threads to pack a block of LHS
 // each, and accumulate the corresponding products.
-template <typename KernelFormat, typename InputScalar, typename OutputScalar,
-          typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
-          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
+// Like SingleThreadGemmImpl, this is templated on the actual LHS and RHS
+// map types; MultiThreadGemm below is the MatrixMap-only entry point.
+template <typename KernelFormat, typename LhsType, typename RhsType,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
           typename OutputPipelineType, typename GemmContextType>
-void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
-                     const MatrixMap<const InputScalar, LhsOrder>& lhs,
-                     const MatrixMap<const InputScalar, RhsOrder>& rhs,
-                     MatrixMap<OutputScalar, ResultOrder>* result,
-                     const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
-                     const OutputPipelineType& output_pipeline) {
+void MultiThreadGemmImpl(GemmContextType* context, const KernelBase& kernel,
+                         const LhsType& lhs, const RhsType& rhs,
+                         ResultType* result, const LhsOffset& lhs_offset,
+                         const RhsOffset& rhs_offset,
+                         const OutputPipelineType& output_pipeline) {
   ScopedProfilingLabel label("gemmlowp::MultiThreadGemm");
 
   assert(lhs.cols() == rhs.rows());
@@ -655,13 +855,14 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
   // The case of rows<cols should have been caught earlier and transposed.
   assert(rows >= cols);
 
+  const TunedBlockParams tuned =
+      context->TunedParamsForShape(rows, depth, cols);
   const int thread_count = HowManyThreads<KernelFormat::kRows>(
-      context->max_num_threads(), rows, cols, depth);
+      TunedMaxNumThreads(context, tuned), rows, cols, depth);
   if (thread_count == 1) {
-    return SingleThreadGemm<KernelFormat, InputScalar, OutputScalar,
-                            BitDepthParams>(context, kernel, lhs, rhs, result,
-                                            lhs_offset, rhs_offset,
-                                            output_pipeline);
+    return SingleThreadGemmImpl<KernelFormat>(context, kernel, lhs, rhs, result,
+                                              lhs_offset, rhs_offset,
+                                              output_pipeline);
   }
   assert(thread_count > 1);
 
@@ -675,22 +876,50 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
 
   BlockParams block_params;
   block_params.Init<KernelFormat>(
-      rows, cols, depth, task_count, context->l1_bytes_to_use(),
-      context->l2_bytes_to_use(), context->l2_rhs_factor());
+      rows, cols, depth, task_count, tuned.l1_bytes_to_use,
+      tuned.l2_bytes_to_use, tuned.l2_rhs_factor, tuned.l3_bytes_to_use,
+      CanPackLhsDepthBlocks<LhsType>::kValue);
+
+  GemmCallLog* call_log = context->call_log();
+  ScopedGemmCallRecord call_record(call_log->enabled() ? call_log : nullptr,
+                                   context->stage_counters(), kernel,
+                                   block_params, rows, depth, cols,
+                                   task_count);
+
+  typedef GemmWithPackedRhsTask<KernelFormat, LhsType, ResultType, LhsOffset,
+                                RhsOffset, OutputPipelineType, GemmContextType>
+      TaskType;
 
   PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(Side::Rhs, allocator,
                                                          block_params);
+  // The tasks of each L3 block are constructed in place in storage reserved
+  // along with the packed RHS, so that no heap allocation is needed.
+  static_assert(sizeof(TaskType) <= kMaxGemmTaskBytes,
+                "MultiThreadGemmScratchSize would undersize the tasks");
+  const Allocator::Handle tasks_handle =
+      allocator->Reserve<std::uint8_t>(task_count * sizeof(TaskType));
   allocator->Commit();
+  TaskType* tasks = reinterpret_cast<TaskType*>(
+      allocator->GetPointer<std::uint8_t>(tasks_handle));
+
+  LoadImbalanceStats* load_imbalance_stats =
+      context->load_imbalance_counters();
+  FanOutTimings fan_out_timings;
+  // The size of the packed RHS entries, for the stage byte counts.
+  const std::uint64_t rhs_bytes = sizeof(typename KernelFormat::Rhs::Scalar);
 
   // We loop over large blocks of the RHS.
-  for (int c = 0; c < cols; c += block_params.l2_cols) {
-    int cs = std::min(block_params.l2_cols, cols - c);
+  for (int c = 0; c < cols; c += block_params.l3_cols) {
+    int cs = std::min(block_params.l3_cols, cols - c);
 
     // Pack a large block of the RHS.
-    PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+    {
+      ScopedGemmStage stage(context->stage_counters(), GemmStage::PackRhs,
+                            rhs_bytes * depth * cs);
+      PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+    }
 
     // Give work to each worker.
-    std::vector<Task*> tasks;
     int next_start_row = 0;
     for (int n = 0; n < task_count; ++n) {
       int start_row = next_start_row;
@@ -699,23 +928,100 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
 
       int block_rows = next_start_row - start_row;
       auto lhs_block = lhs.block(start_row, 0, block_rows, depth);
-      typedef GemmWithPackedRhsTask<KernelFormat, InputScalar, OutputScalar,
-                                    BitDepthParams, LhsOrder, RhsOrder,
-                                    ResultOrder, LhsOffset, RhsOffset,
-                                    OutputPipelineType, GemmContextType>
-          TaskType;
-      tasks.push_back(
-          new TaskType(context, kernel, lhs_block, packed_rhs, result,
-                       MatrixBlockBounds(start_row, c, block_rows, cs),
-                       lhs_offset, rhs_offset, block_params, output_pipeline));
+      TaskType* task = new (&tasks[n])
+          TaskType(context, kernel, lhs_block, packed_rhs, result,
+                   MatrixBlockBounds(start_row, c, block_rows, cs),
+                   lhs_offset, rhs_offset, block_params, output_pipeline, n);
+      if (load_imbalance_stats) {
+        task->fan_out_timings = &fan_out_timings;
+      }
+    }
+    if (load_imbalance_stats) {
+      fan_out_timings.Start(task_count);
     }
     // Execute the work on the workers (and partially on this thread).
-    workers_pool->Execute(tasks);
+    workers_pool->Execute(task_count, tasks);
+    for (int n = 0; n < task_count; ++n) {
+      tasks[n].~TaskType();
+    }
+    if (load_imbalance_stats) {
+      fan_out_timings.Finish();
+      load_imbalance_stats->Add(rows, depth, cols, fan_out_timings);
+    }
   }
 
   allocator->Decommit();
 }
 
+// Returns the scratch memory that MultiThreadGemmImpl needs for a GEMM of
+// the given shape (with rows >= cols) on the given context, by replaying
+// its reservations on a throwaway allocator. allow_depth_blocking must be
+// CanPackLhsDepthBlocks<LhsType>::kValue for the LHS of that GEMM.
+template <typename KernelFormat, typename GemmContextType>
+ScratchSize MultiThreadGemmScratchSize(const GemmContextType* context,
+                                       int rows, int cols, int depth,
+                                       bool allow_depth_blocking = true) {
+  ScratchSize size;
+  if (rows == 0 || cols == 0 || depth == 0) {
+    return size;
+  }
+  assert(rows >= cols);
+
+  const TunedBlockParams tuned =
+      context->TunedParamsForShape(rows, depth, cols);
+  const int thread_count = HowManyThreads<KernelFormat::kRows>(
+      TunedMaxNumThreads(context, tuned), rows, cols, depth);
+  BlockParams block_params;
+  block_params.Init<KernelFormat>(
+      rows, cols, depth, thread_count, tuned.l1_bytes_to_use,
+      tuned.l2_bytes_to_use, tuned.l2_rhs_factor, tuned.l3_bytes_to_use,
+      allow_depth_blocking);
+
+  Allocator allocator;
+  if (thread_count == 1) {
+    // SingleThreadGemmImpl reserves everything on the context's allocator.
+    PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(
+        Side::Lhs, &allocator, block_params);
+    PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(
+        Side::Rhs, &allocator, block_params);
+    PackedResult packed_result(&allocator, block_params);
+    size.main_bytes = allocator.reserved_bytes();
+    allocator.DiscardReservations();
+    return size;
+  }
+
+  PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(
+      Side::Rhs, &allocator, block_params);
+  // The tasks: see MultiThreadGemmImpl. Their size depends on the operand
+  // and output pipeline types, which are not known here, but they only
+  // hold references to these, so this bounds it.
+  allocator.Reserve<std::uint8_t>(thread_count * kMaxGemmTaskBytes);
+  size.main_bytes = allocator.reserved_bytes();
+  allocator.DiscardReservations();
+
+  PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(
+      Side::Lhs, &allocator, block_params);
+  PackedResult packed_result(&allocator, block_params);
+  size.per_task_bytes = allocator.reserved_bytes();
+  size.task_count = thread_count;
+  allocator.DiscardReservations();
+  return size;
+}
+
+template <typename KernelFormat, typename InputScalar, typename OutputScalar,
+          typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
+          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType, typename GemmContextType>
+void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
+                     const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                     const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                     MatrixMap<OutputScalar, ResultOrder>* result,
+                     const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                     const OutputPipelineType& output_pipeline) {
+  MultiThreadGemmImpl<KernelFormat>(context, kernel, lhs, rhs, result,
+                                    lhs_offset, rhs_offset, output_pipeline);
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_MULTI_THREAD_GEMM_H_
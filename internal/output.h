@@ -20,6 +20,7 @@
 #define GEMMLOWP_INTERNAL_OUTPUT_H_
 
 #include <cmath>
+#include <cstring>
 #include <tuple>
 #include <type_traits>
 #include <typeinfo>
@@ -329,6 +330,37 @@ struct OutputStageEvalImpl<OutputStageBiasAddition<VectorType>,
   const OutputStage& output_stage;
 };
 
+template <int Rows, int Cols>
+struct OutputStageEvalImpl<OutputStageScaleInt32ToFloat,
+                           RegisterBlock<std::int32_t, Rows, Cols>> {
+  typedef RegisterBlock<std::int32_t, Rows, Cols> InputType;
+  typedef RegisterBlock<float, Rows, Cols> OutputType;
+  typedef OutputStageScaleInt32ToFloat OutputStage;
+  static_assert(OutputType::kRegisterLanes == 1,
+                "This path is only for scalar float values");
+
+  OutputStageEvalImpl(const OutputStage& s) : output_stage(s) {}
+
+  OutputType Eval(InputType input, int row, int col) const {
+    // The int32 lanes are in the same column-major order, whether they are
+    // held in SIMD registers or not.
+    std::int32_t acc[Rows * Cols];
+    memcpy(acc, input.buf.reg, sizeof(acc));
+    OutputType output;
+    for (int c = 0; c < Cols; c++) {
+      const float col_scale = output_stage.col_scale(col + c);
+      for (int r = 0; r < Rows; r++) {
+        output.buf.reg[r + c * Rows] = static_cast<float>(acc[r + c * Rows]) *
+                                       output_stage.row_scale(row + r) *
+                                       col_scale;
+      }
+    }
+    return output;
+  }
+
+  const OutputStage& output_stage;
+};
+
 template <int Size>
 struct OutputStageEvalBufferImpl<OutputStageClamp,
                                  RegisterBuffer<std::int32_t, Size>> {
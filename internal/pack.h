@@ -28,7 +28,9 @@
 #define GEMMLOWP_INTERNAL_PACK_H_
 
 #include <cstring>
+#include <type_traits>
 
+#include "../public/map.h"
 #include "allocator.h"
 #include "block_params.h"
 #include "common.h"
@@ -47,13 +49,15 @@ template <typename tKernelSideFormat>
 class PackedSideBlock {
  public:
   typedef tKernelSideFormat KernelSideFormat;
+  // Size in bytes of each packed entry.
+  static constexpr int kScalarSize = sizeof(typename KernelSideFormat::Scalar);
 
   PackedSideBlock(Side side, Allocator* allocator,
                   const BlockParams& block_params)
       : allocator_(allocator), pos_(0) {
     GetSideBlockParams(side, &params_, block_params);
-    data_handle_ =
-        allocator_->Reserve<std::uint8_t>(params_.l2_width * params_.l2_depth);
+    data_handle_ = allocator_->Reserve<std::uint8_t>(
+        params_.l2_width * params_.l2_depth * kScalarSize);
     sums_of_each_slice_handle_ =
         allocator_->Reserve<std::int32_t>(params_.l2_width);
   }
@@ -76,12 +80,17 @@ class PackedSideBlock {
   // new int8 current_data impl as well. This change would propagate to all pack
   // impls and the Kernel::Run API, which all assume uint8. For now we leave
   // this as-is pending future refactor.
+  // Positions are counted in entries, so with wider Scalar types (int16),
+  // the byte offset is scaled accordingly and callers must reinterpret the
+  // returned pointer as KernelSideFormat::Scalar*.
   const std::uint8_t* current_data() const {
-    return allocator_->GetPointer<std::uint8_t>(data_handle_) + pos_;
+    return allocator_->GetPointer<std::uint8_t>(data_handle_) +
+           pos_ * kScalarSize;
   }
 
   std::uint8_t* current_data() {
-    return allocator_->GetPointer<std::uint8_t>(data_handle_) + pos_;
+    return allocator_->GetPointer<std::uint8_t>(data_handle_) +
+           pos_ * kScalarSize;
   }
 
   std::int32_t* sums_of_each_slice() {
@@ -95,6 +104,16 @@ class PackedSideBlock {
 
   const SideBlockParams& params() const { return params_; }
 
+  // When set, packing adds to the sums of each slice instead of
+  // overwriting them, so that they cover all the depth blocks packed so
+  // far. See L2 depth blocking in BlockParams.
+  bool accumulate_sums_of_each_slice() const {
+    return accumulate_sums_of_each_slice_;
+  }
+  void set_accumulate_sums_of_each_slice(bool accumulate) {
+    accumulate_sums_of_each_slice_ = accumulate;
+  }
+
  private:
   // The block size parameters that this PackedSizeBlock follows.
   // The L2 parameters determine its overall size, while the L1 parameters,
@@ -125,6 +144,8 @@ class PackedSideBlock {
   // pos_ is mutable because during the computation we will want to
   // be able to iterate on the data in a const PackedSideBlock.
   mutable int pos_;
+
+  bool accumulate_sums_of_each_slice_ = false;
 };
 
 // WidthMajor and DepthMajor are custom phrases modelled after the
@@ -188,6 +209,81 @@ class SideMap {
   int width_, depth_, stride_;
 };
 
+// Similar to NibbleMatrixMap from map.h, but in terms of width/depth instead
+// of rows/columns, like SideMap. Entries are 4-bit values packed two per byte,
+// addressed by nibble index, see NibbleMatrixMap.
+template <SideMapOrder tOrder>
+class NibbleSideMap {
+ public:
+  typedef std::uint8_t Scalar;
+  static constexpr SideMapOrder kOrder = tOrder;
+
+  NibbleSideMap(const std::uint8_t* data, int start_index, int width,
+                int depth, int stride)
+      : data_(data),
+        start_index_(start_index),
+        width_(width),
+        depth_(depth),
+        stride_(stride) {}
+
+  int width() const { return width_; }
+  int depth() const { return depth_; }
+  int stride() const { return stride_; }
+  int width_stride() const {
+    return kOrder == SideMapOrder::DepthMajor ? 1 : stride_;
+  }
+  int depth_stride() const {
+    return kOrder == SideMapOrder::WidthMajor ? 1 : stride_;
+  }
+  int index(int w, int d) const {
+    return start_index_ + w * width_stride() + d * depth_stride();
+  }
+  // Pointer to the byte containing the (w, d) entry. Only for prefetching.
+  const std::uint8_t* data(int w, int d) const {
+    return data_ + (index(w, d) >> 1);
+  }
+  std::uint8_t operator()(int w, int d) const {
+    const int i = index(w, d);
+    return (data_[i >> 1] >> ((i & 1) * 4)) & 0xf;
+  }
+
+  // Expands the count consecutive (in storage order) entries starting
+  // at (w, d) into one byte each.
+  void ExpandContiguous(int w, int d, int count, std::uint8_t* dst) const {
+    int i = index(w, d);
+    int n = 0;
+    if (i & 1) {
+      dst[n++] = data_[i >> 1] >> 4;
+      i++;
+    }
+    const std::uint8_t* src = data_ + (i >> 1);
+    for (; n + 2 <= count; n += 2) {
+      const std::uint8_t byte = *src++;
+      dst[n] = byte & 0xf;
+      dst[n + 1] = byte >> 4;
+    }
+    if (n < count) {
+      dst[n] = *src & 0xf;
+    }
+  }
+
+  NibbleSideMap block(int start_width, int start_depth, int block_width,
+                      int block_depth) const {
+    assert(start_width >= 0);
+    assert(start_width + block_width <= width_);
+    assert(start_depth >= 0);
+    assert(start_depth + block_depth <= depth_);
+
+    return NibbleSideMap(data_, index(start_width, start_depth), block_width,
+                         block_depth, stride_);
+  }
+
+ private:
+  const std::uint8_t* data_;  // not owned.
+  int start_index_;
+  int width_, depth_, stride_;
+};
+
 // A PackingRegisterBlock is a small fixed-size block of a matrix being
 // packed. This class is the generic non-optimized implementation,
 // it is inherited by the generic implementation of PackingRegisterBlock,
@@ -232,7 +328,7 @@ class PackingRegisterBlockBase {
 
   // Temporary buffer for loading incomplete blocks to,
   // in the source storage order
-  std::uint8_t buf_[kKernelWidth * kRegisterSize];
+  KernelInputScalar buf_[kKernelWidth * kRegisterSize];
 
  public:
   // Selects a block if in-place source data that's already a complete block.
@@ -240,44 +336,48 @@ class PackingRegisterBlockBase {
   // Copies an incomplete block of source data into a local temporary
   // complete block by zero-extending it.
   void MakeCompleteSrc(const SrcMapType& src) {
-    memset(buf_, kZeroPointInputValue, kKernelWidth * kRegisterSize);
+    static_assert(sizeof(KernelInputScalar) == 1 || kZeroPointInputValue == 0,
+                  "memset can only fill multi-byte entries with zeros");
+    memset(buf_, kZeroPointInputValue, sizeof(buf_));
     if (kSrcOrder == SideMapOrder::WidthMajor) {
       for (int w = 0; w < src.width(); w++) {
-        memcpy(buf_ + w * kRegisterSize, src.data(w, 0), src.depth());
+        memcpy(buf_ + w * kRegisterSize, src.data(w, 0),
+               src.depth() * sizeof(KernelInputScalar));
       }
     } else {
       assert(kSrcOrder == SideMapOrder::DepthMajor);
       for (int d = 0; d < src.depth(); d++) {
-        memcpy(buf_ + d * kKernelWidth, src.data(0, d), src.width());
+        memcpy(buf_ + d * kKernelWidth, src.data(0, d),
+               src.width() * sizeof(KernelInputScalar));
       }
     }
 
-    // Since the KernelInputScalar type may not be uint8, we need to cast buf_.
-    complete_src_ = SrcMapType(reinterpret_cast<KernelInputScalar*>(buf_),
-                               kKernelWidth, kRegisterSize);
+    complete_src_ = SrcMapType(buf_, kKernelWidth, kRegisterSize);
   }
   // Packs a complete block into the destination. This is the most
   // critical part and the part that we most typically want to
   // override in architecture-specific optimized specializations.
   void Pack(PackedSideBlock* dst, int start_width) {
-    std::uint8_t* dst_ptr = dst->current_data();
+    KernelScalar* dst_ptr =
+        reinterpret_cast<KernelScalar*>(dst->current_data());
     for (int cell_start_depth = 0; cell_start_depth < kRegisterSize;
          cell_start_depth += kCellDepth) {
       for (int cell_start_width = 0; cell_start_width < kKernelWidth;
            cell_start_width += kCellWidth) {
         std::int32_t* cell_sums_of_each_slice_ptr =
             dst->sums_of_each_slice() + start_width + cell_start_width;
-        const SideMap<const std::uint8_t, kSrcOrder> src_cell_map(
-            complete_src_.block(cell_start_width, cell_start_depth, kCellWidth,
-                                kCellDepth));
+        const SrcMapType src_cell_map(complete_src_.block(
+            cell_start_width, cell_start_depth, kCellWidth, kCellDepth));
         for (int w = 0; w < kCellWidth; w++) {
           std::int32_t sum = 0;
           for (int d = 0; d < kCellDepth; d++) {
-            const std::uint8_t src_val = src_cell_map(w, d);
-            const std::int16_t kernel_val_unwrapped =
+            const std::int32_t src_val = src_cell_map(w, d);
+            // For uint8 inputs to int8 kernels, this is the wrap-around
+            // from [0, 255] to [-128, 127].
+            const std::int32_t kernel_val_unwrapped =
                 src_val - kZeroPointInputValue;
-            const std::uint8_t kernel_val_uint8 = kernel_val_unwrapped;
-            dst_ptr[OffsetIntoCell<CellFormat>(w, d)] = kernel_val_uint8;
+            dst_ptr[OffsetIntoCell<CellFormat>(w, d)] =
+                static_cast<KernelScalar>(kernel_val_unwrapped);
             sum += kernel_val_unwrapped;
           }
           cell_sums_of_each_slice_ptr[w] += sum;
@@ -293,6 +393,58 @@ template <typename SrcMapType, typename PackedSideBlock>
 class PackingRegisterBlock
     : public PackingRegisterBlockBase<SrcMapType, PackedSideBlock> {};
 
+// PackingRegisterBlock for 4-bit sources. Nibbles can't be used in place,
+// so every source block is first expanded to one byte per entry into a
+// local complete block, which is then packed by the PackingRegisterBlock
+// for uint8 sources, including any architecture-specific specialization
+// of it. Since 4-bit values are already in the kernel's uint8 range, the
+// expansion is the only extra work.
+template <SideMapOrder tOrder, typename PackedSideBlock>
+class PackingRegisterBlock<NibbleSideMap<tOrder>, PackedSideBlock> {
+ public:
+  typedef typename PackedSideBlock::KernelSideFormat KernelSideFormat;
+  typedef typename KernelSideFormat::InputScalar KernelInputScalar;
+  typedef typename KernelSideFormat::Scalar KernelScalar;
+  static constexpr int kKernelWidth = KernelSideFormat::kWidth;
+  static constexpr int kZeroPointInputValue =
+      ZeroPointInputValue<KernelInputScalar, KernelScalar>::kValue;
+  static_assert(std::is_same<KernelInputScalar, std::uint8_t>::value,
+                "4-bit sources are only supported with uint8 kernel inputs");
+
+  typedef SideMap<const std::uint8_t, tOrder> ExpandedSrcMapType;
+
+  void UseCompleteSrcInPlace(const NibbleSideMap<tOrder>& src) {
+    MakeCompleteSrc(src);
+  }
+
+  void MakeCompleteSrc(const NibbleSideMap<tOrder>& src) {
+    if (src.width() < kKernelWidth || src.depth() < kRegisterSize) {
+      memset(buf_, kZeroPointInputValue, kKernelWidth * kRegisterSize);
+    }
+    if (tOrder == SideMapOrder::WidthMajor) {
+      for (int w = 0; w < src.width(); w++) {
+        src.ExpandContiguous(w, 0, src.depth(), buf_ + w * kRegisterSize);
+      }
+    } else {
+      for (int d = 0; d < src.depth(); d++) {
+        src.ExpandContiguous(0, d, src.width(), buf_ + d * kKernelWidth);
+      }
+    }
+    expanded_block_.UseCompleteSrcInPlace(
+        ExpandedSrcMapType(buf_, kKernelWidth, kRegisterSize));
+  }
+
+  void Pack(PackedSideBlock* dst, int start_width) {
+    expanded_block_.Pack(dst, start_width);
+  }
+
+ private:
+  // Expanded source data, in the source storage order.
+  std::uint8_t buf_[kKernelWidth * kRegisterSize];
+
+  PackingRegisterBlock<ExpandedSrcMapType, PackedSideBlock> expanded_block_;
+};
+
 // Large-scale implementation of packing.
 template <typename SrcMapType, typename PackedSideBlock>
 class PackSideBlockImpl {
@@ -317,8 +469,10 @@ class PackSideBlockImpl {
 
   // The public entry point to pack a block.
   void PackL2() {
-    memset(packed_side_block_->sums_of_each_slice(), 0,
-           sizeof(std::int32_t) * packed_side_block_->params().l2_width);
+    if (!packed_side_block_->accumulate_sums_of_each_slice()) {
+      memset(packed_side_block_->sums_of_each_slice(), 0,
+             sizeof(std::int32_t) * packed_side_block_->params().l2_width);
+    }
     for (int d = 0; d < src_map_.depth();
          d += packed_side_block_->params().l1_depth) {
       int ds = std::min<int>(packed_side_block_->params().l1_depth,
@@ -399,6 +553,13 @@ class PackSideBlockImpl {
   const SrcMapType& src_map_;
 };
 
+// Whether PackLhs can pack blocks of the given map type that cover only
+// part of the depth, as L2 depth blocking requires.
+template <typename MatrixMapType>
+struct CanPackLhsDepthBlocks {
+  static constexpr bool kValue = true;
+};
+
 // Packs a block of the input LHS matrix, into a PackedSideBlock.
 template <typename PackedSideBlock, typename MatrixMapType>
 void PackLhs(PackedSideBlock* dst, const MatrixMapType& src) {
@@ -429,6 +590,36 @@ void PackRhs(PackedSideBlock* dst, const MatrixMapType& src) {
   impl.PackL2();
 }
 
+// Packs a block of a 4-bit input LHS matrix, into a PackedSideBlock.
+template <typename PackedSideBlock, MapOrder Order>
+void PackLhs(PackedSideBlock* dst, const NibbleMatrixMap<Order>& src) {
+  ScopedProfilingLabel label("pack LHS (4-bit source)");
+  static const SideMapOrder kSideMapOrder = Order == MapOrder::RowMajor
+                                                ? SideMapOrder::WidthMajor
+                                                : SideMapOrder::DepthMajor;
+  typedef NibbleSideMap<kSideMapOrder> SideMapType;
+  SideMapType src_side_map(src.data(), src.start_index(), src.rows(),
+                           src.cols(), src.stride());
+  typedef PackSideBlockImpl<SideMapType, PackedSideBlock> ImplType;
+  ImplType impl(dst, src_side_map);
+  impl.PackL2();
+}
+
+// Packs a block of a 4-bit input RHS matrix, into a PackedSideBlock.
+template <typename PackedSideBlock, MapOrder Order>
+void PackRhs(PackedSideBlock* dst, const NibbleMatrixMap<Order>& src) {
+  ScopedProfilingLabel label("pack RHS (4-bit source)");
+  static const SideMapOrder kSideMapOrder = Order == MapOrder::ColMajor
+                                                ? SideMapOrder::WidthMajor
+                                                : SideMapOrder::DepthMajor;
+  typedef NibbleSideMap<kSideMapOrder> SideMapType;
+  SideMapType src_side_map(src.data(), src.start_index(), src.cols(),
+                           src.rows(), src.stride());
+  typedef PackSideBlockImpl<SideMapType, PackedSideBlock> ImplType;
+  ImplType impl(dst, src_side_map);
+  impl.PackL2();
+}
+
 }  // namespace gemmlowp
 
 #ifdef GEMMLOWP_NEON
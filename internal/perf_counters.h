@@ -0,0 +1,194 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// perf_counters.h: hardware event counters of the calling thread, read
+// through Linux's perf_event_open, for the stage stats of stage_stats.h.
+// Unlike standalone/cache_counters.cc, which uses raw ARM PMU events, this
+// uses the generic hardware and cache events that the kernel maps to each
+// CPU. Elsewhere than on Linux, or if GEMMLOWP_NO_PERF_COUNTERS is
+// defined, the counters are never available.
+
+#ifndef GEMMLOWP_INTERNAL_PERF_COUNTERS_H_
+#define GEMMLOWP_INTERNAL_PERF_COUNTERS_H_
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__) && !defined(GEMMLOWP_NO_PERF_COUNTERS)
+#define GEMMLOWP_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "../profiling/pthread_everywhere.h"
+
+namespace gemmlowp {
+
+enum class PerfEvent {
+  Cycles,
+  Instructions,
+  L1DReadMisses,
+  LLCMisses,
+  DTLBReadMisses,
+  kCount
+};
+
+const int kPerfEventCount = static_cast<int>(PerfEvent::kCount);
+
+// The counters of one thread: a group of perf events, which the kernel
+// schedules together so that their counts cover the same time. Events
+// that the CPU doesn't support are left out of the group and read as 0.
+class ThreadPerfCounters {
+ public:
+  // Returns the counters of the calling thread, opening them on first use,
+  // or null if they can't be opened, e.g. if kernel.perf_event_paranoid
+  // forbids it. They are closed when the thread exits.
+  static ThreadPerfCounters* ForCurrentThread() {
+#ifdef GEMMLOWP_PERF_COUNTERS
+    static pthread_key_t key;
+    static auto Delete = [](void* ptr) {
+      delete static_cast<ThreadPerfCounters*>(ptr);
+    };
+    // See ThreadLocalThreadInfo in profiling/instrumentation.h.
+    static const int key_result = pthread_key_create(&key, Delete);
+    (void)key_result;
+    ThreadPerfCounters* counters =
+        static_cast<ThreadPerfCounters*>(pthread_getspecific(key));
+    if (!counters) {
+      counters = new ThreadPerfCounters;
+      pthread_setspecific(key, counters);
+    }
+    return counters->leader_fd_ >= 0 ? counters : nullptr;
+#else
+    return nullptr;
+#endif
+  }
+
+  // Reads the current counts into values, indexed by PerfEvent. Returns
+  // false if they could not be read.
+  bool Read(std::uint64_t* values) const {
+    memset(values, 0, kPerfEventCount * sizeof(values[0]));
+#ifdef GEMMLOWP_PERF_COUNTERS
+    // With PERF_FORMAT_GROUP, the number of events then their counts.
+    std::uint64_t buffer[1 + kPerfEventCount];
+    const ssize_t size = (1 + group_size_) * sizeof(buffer[0]);
+    if (read(leader_fd_, buffer, size) != size) {
+      return false;
+    }
+    for (int i = 0; i < group_size_; i++) {
+      values[group_events_[i]] = buffer[1 + i];
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+ private:
+#ifdef GEMMLOWP_PERF_COUNTERS
+  ThreadPerfCounters() : leader_fd_(-1), group_size_(0) {
+    for (int e = 0; e < kPerfEventCount; e++) {
+      fds_[e] = -1;
+    }
+    for (int e = 0; e < kPerfEventCount; e++) {
+      std::uint32_t type;
+      std::uint64_t config;
+      GetEventConfig(static_cast<PerfEvent>(e), &type, &config);
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      // The leader starts the group disabled until all events are added.
+      attr.disabled = leader_fd_ < 0;
+      const int fd = static_cast<int>(
+          syscall(__NR_perf_event_open, &attr, 0, -1, leader_fd_, 0));
+      if (fd < 0) {
+        // Without cycles, the leader, there are no counters at all.
+        if (e == 0) {
+          return;
+        }
+        continue;
+      }
+      if (leader_fd_ < 0) {
+        leader_fd_ = fd;
+      }
+      fds_[e] = fd;
+      group_events_[group_size_++] = e;
+    }
+    ioctl(leader_fd_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  ~ThreadPerfCounters() {
+    for (int e = 0; e < kPerfEventCount; e++) {
+      if (fds_[e] >= 0) {
+        close(fds_[e]);
+      }
+    }
+  }
+
+  static void GetEventConfig(PerfEvent event, std::uint32_t* type,
+                             std::uint64_t* config) {
+    const std::uint64_t kReadMiss =
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    switch (event) {
+      case PerfEvent::Cycles:
+        *type = PERF_TYPE_HARDWARE;
+        *config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case PerfEvent::Instructions:
+        *type = PERF_TYPE_HARDWARE;
+        *config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case PerfEvent::L1DReadMisses:
+        *type = PERF_TYPE_HW_CACHE;
+        *config = PERF_COUNT_HW_CACHE_L1D | kReadMiss;
+        break;
+      case PerfEvent::LLCMisses:
+        *type = PERF_TYPE_HARDWARE;
+        *config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+      default:
+        *type = PERF_TYPE_HW_CACHE;
+        *config = PERF_COUNT_HW_CACHE_DTLB | kReadMiss;
+        break;
+    }
+  }
+
+  int leader_fd_;
+  int fds_[kPerfEventCount];
+  // The events in the group, in the order in which read returns them.
+  int group_events_[kPerfEventCount];
+  int group_size_;
+#else
+  ThreadPerfCounters() {}
+#endif
+
+  ThreadPerfCounters(const ThreadPerfCounters&) = delete;
+};
+
+// Whether the calling thread can count hardware events.
+inline bool PerfCountersAvailable() {
+  return ThreadPerfCounters::ForCurrentThread() != nullptr;
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_PERF_COUNTERS_H_
@@ -30,6 +30,11 @@
 #include <sys/time.h>
 #endif
 
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/mman.h>
+#endif
+
 #if defined ANDROID || defined __ANDROID__
 #include <malloc.h>
 #include <android/api-level.h>
@@ -113,5 +118,66 @@ inline double real_time_in_seconds() {
 }
 
 #endif
+
+// The huge page size targeted by huge_page_alloc: 2MB is the transparent
+// huge page size on x86-64 and on arm64 with 4KB base pages.
+const size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Allocates size bytes, a multiple of kHugePageSize, aligned on a
+// kHugePageSize boundary and backed by huge pages if the platform allows.
+// On Linux, explicit huge pages (MAP_HUGETLB) are tried first; they are only
+// available if a pool of them has been reserved (/proc/sys/vm/nr_hugepages).
+// Failing that, the memory is advised with MADV_HUGEPAGE, which lets the
+// kernel back it with transparent huge pages. Elsewhere, this is a plain
+// aligned allocation. The memory must be released by huge_page_free, with
+// the same size.
+inline void *huge_page_alloc(size_t size) {
+#ifdef __linux__
+#ifdef MAP_HUGETLB
+  void *hugetlb_ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (hugetlb_ptr != MAP_FAILED) {
+    return hugetlb_ptr;
+  }
+#endif
+  // Over-allocate so that an aligned range can be carved out, and unmap
+  // the rest.
+  const size_t mapped_size = size + kHugePageSize;
+  void *mapped_ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped_ptr == MAP_FAILED) {
+    return nullptr;
+  }
+  const uintptr_t mapped_addr = reinterpret_cast<uintptr_t>(mapped_ptr);
+  const uintptr_t addr =
+      (mapped_addr + kHugePageSize - 1) & ~(uintptr_t(kHugePageSize) - 1);
+  if (addr > mapped_addr) {
+    munmap(mapped_ptr, addr - mapped_addr);
+  }
+  const size_t tail_size = mapped_addr + mapped_size - (addr + size);
+  if (tail_size) {
+    munmap(reinterpret_cast<void *>(addr + size), tail_size);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(reinterpret_cast<void *>(addr), size, MADV_HUGEPAGE);
+#endif
+  return reinterpret_cast<void *>(addr);
+#else
+  return aligned_alloc(kHugePageSize, size);
+#endif
+}
+
+inline void huge_page_free(void *memptr, size_t size) {
+  if (!memptr) {
+    return;
+  }
+#ifdef __linux__
+  munmap(memptr, size);
+#else
+  (void)size;
+  aligned_free(memptr);
+#endif
+}
+
 }  // namespace gemmlowp
 #endif  // GEMMLOWP_INTERNAL_PLATFORM_H_
@@ -19,13 +19,21 @@
 #ifndef GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMM_H_
 #define GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMM_H_
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <limits>
+#include <vector>
 
 #include "../public/map.h"
 #include "allocator.h"
+#include "call_stats.h"
 #include "compute.h"
+#include "detect_cache_sizes.h"
 #include "kernel.h"
 #include "pack.h"
+#include "stage_stats.h"
+#include "tuning_table.h"
 #include "unpack.h"
 
 #ifdef GEMMLOWP_PROFILING_SIZES
@@ -38,6 +46,42 @@
 
 namespace gemmlowp {
 
+// The scratch memory needed by GEMMs of a given shape, see GemmScratchSize
+// in gemmlowp.h. main_bytes are used by the calling thread's allocator,
+// and per_task_bytes by each of the task_count tasks' local allocators
+// when the GEMM is multi-threaded. All sizes are multiples of
+// Allocator::kAlignment.
+struct ScratchSize {
+  std::size_t main_bytes = 0;
+  std::size_t per_task_bytes = 0;
+  int task_count = 0;
+
+  std::size_t total_bytes() const {
+    return main_bytes + task_count * per_task_bytes;
+  }
+};
+
+// The smallest ScratchSize covering both a and b.
+inline ScratchSize MaxScratchSize(const ScratchSize& a, const ScratchSize& b) {
+  ScratchSize result;
+  result.main_bytes = std::max(a.main_bytes, b.main_bytes);
+  result.per_task_bytes = std::max(a.per_task_bytes, b.per_task_bytes);
+  result.task_count = std::max(a.task_count, b.task_count);
+  return result;
+}
+
+// Makes the allocator allocate storage for the given number of bytes, and
+// writes to it so that its pages are faulted in, on the calling thread.
+inline void PrefaultAllocator(Allocator* allocator, std::size_t bytes) {
+  if (!bytes) {
+    return;
+  }
+  auto handle = allocator->Reserve<std::uint8_t>(bytes);
+  allocator->Commit();
+  memset(allocator->GetPointer<std::uint8_t>(handle), 0, bytes);
+  allocator->Decommit();
+}
+
 class SingleThreadGemmContext {
  public:
   Allocator* allocator() { return &allocator_; }
@@ -45,31 +89,242 @@ class SingleThreadGemmContext {
   void set_l1_bytes_to_use(int n) { l1_bytes_to_use_ = n; }
   void set_l2_bytes_to_use(int n) { l2_bytes_to_use_ = n; }
   void set_l2_rhs_factor(float n) { l2_rhs_factor_ = n; }
+  // Enables L3 blocking, for a shared L3 cache of the given size, see
+  // BlockParams. l2_bytes_to_use should then be the per-core L2 size.
+  // 0 disables it.
+  void set_l3_bytes_to_use(int n) { l3_bytes_to_use_ = n; }
+  // Whether the allocators used by GEMMs on this context, including the
+  // per-thread ones, back their storage with huge pages. See
+  // Allocator::set_use_huge_pages.
+  void set_use_huge_pages(bool b) {
+    use_huge_pages_ = b;
+    allocator_.set_use_huge_pages(b);
+  }
+
+  // Sets l1_bytes_to_use and l2_bytes_to_use to each core's share of the
+  // L1 data cache and of the L2 cache, as detected at runtime, instead of
+  // the compile-time defaults, and l3_bytes_to_use to the size of the L3
+  // cache if there is one. Returns false, leaving them unchanged, if
+  // the cache sizes could not be detected. The L2 setting is left unchanged
+  // if only an L1 cache was found.
+  bool UseDetectedCacheSizes() {
+    const CacheSizes& sizes = DetectCacheSizes();
+    if (!sizes.detected()) {
+      return false;
+    }
+    l1_bytes_to_use_ = sizes.PerCoreBytes(1);
+    if (sizes.levels[1].bytes) {
+      l2_bytes_to_use_ = sizes.PerCoreBytes(2);
+      l3_bytes_to_use_ = sizes.levels[2].bytes;
+    }
+    return true;
+  }
+
+  // Makes GEMMs on this context use the parameters that the given table
+  // lists for their shape, or else for the nearest shape, instead of the
+  // cache settings of this context. See tuning_table.h. The table is not
+  // owned, and must outlive its use. A null table reverts to the settings.
+  void set_tuning_table(const TuningTable* table) { tuning_table_ = table; }
+
+  // The parameters to use for a GEMM of the given shape, from the tuning
+  // table if any, else from the cache settings of this context, with a
+  // max_num_threads of 0.
+  TunedBlockParams TunedParamsForShape(int rows, int depth, int cols) const {
+    const TunedBlockParams* tuned =
+        tuning_table_ ? tuning_table_->Lookup(rows, depth, cols) : nullptr;
+    if (tuned) {
+      return *tuned;
+    }
+    TunedBlockParams params;
+    params.l1_bytes_to_use = l1_bytes_to_use_;
+    params.l2_bytes_to_use = l2_bytes_to_use_;
+    params.l2_rhs_factor = l2_rhs_factor_;
+    params.l3_bytes_to_use = l3_bytes_to_use_;
+    return params;
+  }
 
   int l1_bytes_to_use() const { return l1_bytes_to_use_; }
   int l2_bytes_to_use() const { return l2_bytes_to_use_; }
   float l2_rhs_factor() const { return l2_rhs_factor_; }
+  int l3_bytes_to_use() const { return l3_bytes_to_use_; }
+  bool use_huge_pages() const { return use_huge_pages_; }
+
+  // Enables counting the time spent in each stage of the GEMMs run on this
+  // context, see stage_stats.h. This costs two clock reads per packed
+  // block, computed block and unpacked block, and is disabled by default.
+  // The counters keep their values while disabled.
+  void set_stage_stats_enabled(bool b) { stage_stats_enabled_ = b; }
+  bool stage_stats_enabled() const { return stage_stats_enabled_; }
+
+  // The counters accumulated since the context was created or since the
+  // last call to ResetStageStats.
+  GemmStageStats stage_stats() const { return stage_counters_.Snapshot(); }
+  void ResetStageStats() { stage_counters_.Reset(); }
+
+  // Makes the stage stats also count hardware events (cycles,
+  // instructions, cache and TLB misses) on each thread where
+  // perf_event_open allows it, see perf_counters.h and
+  // PerfCountersAvailable. This costs two more system calls per counted
+  // block. Disabled by default.
+  void set_stage_perf_events_enabled(bool b) {
+    stage_counters_.set_perf_events_enabled(b);
+  }
+
+  // The counters for GEMMs to update, or null if neither stage stats nor
+  // the call log are enabled.
+  GemmStageCounters* stage_counters() {
+    return stage_stats_enabled_ || call_log_.enabled() ? &stage_counters_
+                                                       : nullptr;
+  }
+
+  // Makes GEMMs on this context record what they did in a log keeping the
+  // last n calls, see call_stats.h and call_log(). This also enables the
+  // counting of stage stats, which the records include. 0, the default,
+  // disables the log.
+  void set_call_log_capacity(std::size_t n) { call_log_.set_capacity(n); }
+  GemmCallLog* call_log() { return &call_log_; }
+
+  // Makes GEMMs on this context carve all their scratch buffers out of the
+  // given externally owned arena, of size.total_bytes() bytes, aligned on
+  // Allocator::kAlignment, instead of allocating memory. The arena holds
+  // the main_bytes of the calling thread followed by per_task_bytes for
+  // each task. size must cover every GEMM shape and thread count that will
+  // be used, e.g. the maximum of what GemmScratchSize returns for each.
+  // A null arena reverts to internal allocation.
+  void set_scratch_arena(void* arena, const ScratchSize& size) {
+    scratch_arena_ = static_cast<std::uint8_t*>(arena);
+    scratch_size_ = size;
+    allocator_.set_external_storage(arena, size.main_bytes);
+  }
+
+  // Bounds the scratch storage that each allocator used by GEMMs on this
+  // context, including the per-thread ones, retains between GEMMs. See
+  // Allocator::set_max_retained_bytes.
+  void set_max_retained_scratch_bytes(std::size_t n) {
+    max_retained_scratch_bytes_ = n;
+    allocator_.set_max_retained_bytes(n);
+  }
+
+  // Makes each allocator used by GEMMs on this context release its storage
+  // after it has been larger than needed for n consecutive GEMMs, e.g. after
+  // a single unusually large GEMM. See Allocator::set_decay_commits.
+  void set_scratch_decay_calls(int n) {
+    scratch_decay_calls_ = n;
+    allocator_.set_decay_commits(n);
+  }
+
+  std::size_t max_retained_scratch_bytes() const {
+    return max_retained_scratch_bytes_;
+  }
+  int scratch_decay_calls() const { return scratch_decay_calls_; }
+
+  // The scratch storage retained by this context between GEMMs.
+  // MultiThreadGemmContext hides this and TrimScratch with versions that
+  // also cover the allocators of its worker threads. They are not virtual,
+  // so call them on the context's own type, not through a pointer to this
+  // base class, which only sees the calling thread's allocator.
+  std::size_t retained_scratch_bytes() const {
+    return allocator_.storage_size();
+  }
+
+  // Releases retained scratch storage until at most target_bytes remain.
+  // Must not be called while a GEMM is running on this context.
+  void TrimScratch(std::size_t target_bytes) {
+    std::vector<Allocator*> allocators(1, &allocator_);
+    TrimAllocators(&allocators, target_bytes);
+  }
+
+  // Allocates and faults in the scratch storage of the given size ahead of
+  // the first GEMM. See GemmWarmUp in gemmlowp.h.
+  void WarmUp(const ScratchSize& size) {
+    PrefaultAllocator(&allocator_, size.main_bytes);
+  }
+
+  // Applies the allocation options of this context to the local allocator
+  // of the task_index-th task of a multi-threaded GEMM.
+  void ConfigureTaskAllocator(Allocator* allocator, int task_index) const {
+    allocator->set_use_huge_pages(use_huge_pages_);
+    allocator->set_max_retained_bytes(max_retained_scratch_bytes_);
+    if (allocator->decay_commits() != scratch_decay_calls_) {
+      allocator->set_decay_commits(scratch_decay_calls_);
+    }
+    if (!scratch_arena_) {
+      allocator->set_external_storage(nullptr, 0);
+      return;
+    }
+    ReleaseBuildAssertion(task_index < scratch_size_.task_count,
+                          "scratch arena has too few task slots");
+    allocator->set_external_storage(
+        scratch_arena_ + scratch_size_.main_bytes +
+            task_index * scratch_size_.per_task_bytes,
+        scratch_size_.per_task_bytes);
+  }
 
  protected:
+  // Releases the storage of the given allocators, largest first, until they
+  // retain at most target_bytes in total.
+  static void TrimAllocators(std::vector<Allocator*>* allocators,
+                             std::size_t target_bytes) {
+    std::size_t total_bytes = 0;
+    for (Allocator* allocator : *allocators) {
+      total_bytes += allocator->storage_size();
+    }
+    std::sort(allocators->begin(), allocators->end(),
+              [](const Allocator* a, const Allocator* b) {
+                return a->storage_size() > b->storage_size();
+              });
+    for (Allocator* allocator : *allocators) {
+      if (total_bytes <= target_bytes) {
+        break;
+      }
+      total_bytes -= allocator->storage_size();
+      allocator->Trim(0);
+    }
+  }
+
   Allocator allocator_;
 
   // The cache configurationt to use.
   int l1_bytes_to_use_ = kDefaultL1CacheSize;
   int l2_bytes_to_use_ = kDefaultL2CacheSize;
   float l2_rhs_factor_ = kDefaultL2RhsFactor;
+  int l3_bytes_to_use_ = kDefaultL3CacheSize;
+
+  // See set_tuning_table.
+  const TuningTable* tuning_table_ = nullptr;
+
+  bool use_huge_pages_ = false;
+
+  // See set_stage_stats_enabled.
+  bool stage_stats_enabled_ = false;
+  GemmStageCounters stage_counters_;
+
+  // See set_call_log_capacity.
+  GemmCallLog call_log_;
+
+  // See set_max_retained_scratch_bytes and set_scratch_decay_calls.
+  std::size_t max_retained_scratch_bytes_ =
+      std::numeric_limits<std::size_t>::max();
+  int scratch_decay_calls_ = 0;
+
+  // See set_scratch_arena.
+  std::uint8_t* scratch_arena_ = nullptr;
+  ScratchSize scratch_size_;
 };
 
-template <typename KernelFormat, typename InputScalar, typename OutputScalar,
-          typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
-          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
+// The implementation of SingleThreadGemm. It is templated on the actual
+// LHS and RHS map types rather than on their scalar type and storage order,
+// so that inputs other than plain MatrixMap's (e.g. NibbleMatrixMap) can be
+// used, as long as PackLhs/PackRhs know how to pack them.
+template <typename KernelFormat, typename LhsType, typename RhsType,
+          typename ResultType, typename LhsOffset, typename RhsOffset,
           typename OutputPipelineType>
-void SingleThreadGemm(SingleThreadGemmContext* context,
-                      const KernelBase& kernel,
-                      const MatrixMap<const InputScalar, LhsOrder>& lhs,
-                      const MatrixMap<const InputScalar, RhsOrder>& rhs,
-                      MatrixMap<OutputScalar, ResultOrder>* result,
-                      const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
-                      const OutputPipelineType& output_pipeline) {
+void SingleThreadGemmImpl(SingleThreadGemmContext* context,
+                          const KernelBase& kernel, const LhsType& lhs,
+                          const RhsType& rhs, ResultType* result,
+                          const LhsOffset& lhs_offset,
+                          const RhsOffset& rhs_offset,
+                          const OutputPipelineType& output_pipeline) {
   ScopedProfilingLabel label("gemmlowp::SingleThreadGemm");
 
   assert(lhs.cols() == rhs.rows());
@@ -88,10 +343,13 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
 
   Allocator* allocator = context->allocator();
 
+  const TunedBlockParams tuned =
+      context->TunedParamsForShape(rows, depth, cols);
   BlockParams block_params;
   block_params.Init<KernelFormat>(
-      rows, cols, depth, 1, context->l1_bytes_to_use(),
-      context->l2_bytes_to_use(), context->l2_rhs_factor());
+      rows, cols, depth, 1, tuned.l1_bytes_to_use, tuned.l2_bytes_to_use,
+      tuned.l2_rhs_factor, tuned.l3_bytes_to_use,
+      CanPackLhsDepthBlocks<LhsType>::kValue);
 
 #ifdef GEMMLOWP_PROFILING_SIZES
   // Using a static map of label strings. Not reentrant at all!
@@ -103,10 +361,11 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
     char label[256];
     snprintf(label, sizeof(label),
              "(rows = %d, depth = %d, cols = %d, l2_rows = %d, l2_depth = %d, "
-             "l2_cols = %d, l1_rows = %d, l1_depth = %d, l1_cols = %d)",
+             "l2_cols = %d, l1_rows = %d, l1_depth = %d, l1_cols = %d, "
+             "l3_cols = %d)",
              rows, depth, cols, block_params.l2_rows, block_params.l2_depth,
              block_params.l2_cols, block_params.l1_rows, block_params.l1_depth,
-             block_params.l1_cols);
+             block_params.l1_cols, block_params.l3_cols);
     labels_map[sizes_hash] = label;
   }
   ScopedProfilingLabel size_label(labels_map[sizes_hash].c_str());
@@ -121,37 +380,97 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
 
   allocator->Commit();
 
-  const bool pack_rhs_once = block_params.l2_cols >= cols;
+  const bool pack_rhs_once = block_params.l3_cols >= cols;
+
+  GemmStageCounters* stage_counters = context->stage_counters();
+  GemmCallLog* call_log = context->call_log();
+  ScopedGemmCallRecord call_record(call_log->enabled() ? call_log : nullptr,
+                                   stage_counters, kernel, block_params, rows,
+                                   depth, cols, 1);
+
+  // The sizes of the packed entries, for the stage byte counts.
+  const std::uint64_t lhs_bytes = sizeof(typename KernelFormat::Lhs::Scalar);
+  const std::uint64_t rhs_bytes = sizeof(typename KernelFormat::Rhs::Scalar);
 
   if (pack_rhs_once) {
+    ScopedGemmStage stage(stage_counters, GemmStage::PackRhs,
+                          rhs_bytes * depth * cols);
     PackRhs(&packed_rhs, rhs);
   }
 
+  // With L2 depth blocking, the LHS is packed one depth block at a time, for
+  // each L2 block of the RHS in turn.
+  const bool depth_blocked =
+      block_params.l2_depth < block_params.packed_rhs_depth;
+
   for (int r = 0; r < rows; r += block_params.l2_rows) {
     int rs = std::min(block_params.l2_rows, rows - r);
 
-    PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+    if (!depth_blocked) {
+      ScopedGemmStage stage(stage_counters, GemmStage::PackLhs,
+                            lhs_bytes * rs * depth);
+      PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+    }
 
-    for (int c = 0; c < cols; c += block_params.l2_cols) {
-      int cs = std::min(block_params.l2_cols, cols - c);
+    for (int c3 = 0; c3 < cols; c3 += block_params.l3_cols) {
+      int c3s = std::min(block_params.l3_cols, cols - c3);
 
       if (!pack_rhs_once) {
-        PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+        ScopedGemmStage stage(stage_counters, GemmStage::PackRhs,
+                              rhs_bytes * depth * c3s);
+        PackRhs(&packed_rhs, rhs.block(0, c3, depth, c3s));
       }
 
-      Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
-              depth);
-
-      UnpackResult<KernelFormat>(
-          result, MatrixBlockBounds(r, c, rs, cs), packed_result, depth,
-          packed_lhs.sums_of_each_slice(), packed_rhs.sums_of_each_slice(),
-          lhs_offset.block(r, rs), rhs_offset.block(c, cs), output_pipeline);
+      for (int c = c3; c < c3 + c3s; c += block_params.l2_cols) {
+        int cs = std::min(block_params.l2_cols, c3 + c3s - c);
+
+        for (int d = 0; d < depth; d += block_params.l2_depth) {
+          int ds = std::min(block_params.l2_depth, depth - d);
+
+          if (depth_blocked) {
+            ScopedGemmStage stage(stage_counters, GemmStage::PackLhs,
+                                  lhs_bytes * rs * ds);
+            packed_lhs.set_accumulate_sums_of_each_slice(d > 0);
+            PackLhs(&packed_lhs, lhs.block(r, d, rs, ds));
+          }
+
+          ScopedGemmStage stage(stage_counters, GemmStage::Compute,
+                                (lhs_bytes * rs + rhs_bytes * cs) * ds,
+                                2 * std::uint64_t(rs) * cs * ds);
+          Compute(kernel, block_params, &packed_result, packed_lhs,
+                  packed_rhs, ds, c - c3, d);
+        }
+
+        ScopedGemmStage stage(stage_counters, GemmStage::UnpackResult,
+                              std::uint64_t(rs) * cs * sizeof(std::int32_t));
+        UnpackResult<KernelFormat>(
+            result, MatrixBlockBounds(r, c, rs, cs), packed_result, depth,
+            packed_lhs.sums_of_each_slice(),
+            packed_rhs.sums_of_each_slice() + (c - c3),
+            lhs_offset.block(r, rs), rhs_offset.block(c, cs),
+            output_pipeline);
+      }
     }
   }
 
   allocator->Decommit();
 }
 
+template <typename KernelFormat, typename InputScalar, typename OutputScalar,
+          typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
+          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType>
+void SingleThreadGemm(SingleThreadGemmContext* context,
+                      const KernelBase& kernel,
+                      const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                      const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                      MatrixMap<OutputScalar, ResultOrder>* result,
+                      const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  SingleThreadGemmImpl<KernelFormat>(context, kernel, lhs, rhs, result,
+                                     lhs_offset, rhs_offset, output_pipeline);
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMM_H_
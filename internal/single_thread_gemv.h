@@ -0,0 +1,169 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// single_thread_gemv.h: matrix*vector products that bypass packing.
+// See todo/fast-gemv.txt for why packing is a waste of time for GEMV.
+// At the moment this is only used for 4-bit (NibbleMatrixMap) LHS matrices,
+// where packing would additionally have to expand each nibble to a byte:
+// here, nibbles are read directly from the LHS storage.
+
+#ifndef GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_H_
+#define GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_H_
+
+#include "../public/map.h"
+#include "allocator.h"
+#include "output.h"
+#include "single_thread_gemm.h"
+
+namespace gemmlowp {
+
+// Computes, for each row r of a row-major 4-bit LHS, the dot product of that
+// row with the RHS vector, and the sum of the entries of that row.
+template <typename RhsType>
+void GemvNibbleLhsRawProducts(const NibbleMatrixMap<MapOrder::RowMajor>& lhs,
+                              const RhsType& rhs, std::int32_t* dot,
+                              std::int32_t* lhs_sums) {
+  const int depth = lhs.cols();
+  for (int r = 0; r < lhs.rows(); r++) {
+    std::int32_t row_dot = 0;
+    std::int32_t row_sum = 0;
+    int d = 0;
+    int i = lhs.index(r, 0);
+    if (i & 1) {
+      const std::int32_t l = lhs(r, 0);
+      row_dot += l * rhs(0, 0);
+      row_sum += l;
+      d++;
+      i++;
+    }
+    const std::uint8_t* lhs_ptr = lhs.data() + (i >> 1);
+    for (; d <= depth - 2; d += 2) {
+      const std::uint8_t byte = *lhs_ptr++;
+      const std::int32_t l0 = byte & 0xf;
+      const std::int32_t l1 = byte >> 4;
+      row_dot += l0 * rhs(d, 0) + l1 * rhs(d + 1, 0);
+      row_sum += l0 + l1;
+    }
+    if (d < depth) {
+      const std::int32_t l = *lhs_ptr & 0xf;
+      row_dot += l * rhs(d, 0);
+      row_sum += l;
+    }
+    dot[r] = row_dot;
+    lhs_sums[r] = row_sum;
+  }
+}
+
+// Same as above for a column-major 4-bit LHS, which is traversed column by
+// column, accumulating into the whole dot and lhs_sums vectors.
+template <typename RhsType>
+void GemvNibbleLhsRawProducts(const NibbleMatrixMap<MapOrder::ColMajor>& lhs,
+                              const RhsType& rhs, std::int32_t* dot,
+                              std::int32_t* lhs_sums) {
+  const int rows = lhs.rows();
+  memset(dot, 0, rows * sizeof(std::int32_t));
+  memset(lhs_sums, 0, rows * sizeof(std::int32_t));
+  for (int d = 0; d < lhs.cols(); d++) {
+    const std::int32_t rhs_val = rhs(d, 0);
+    int r = 0;
+    int i = lhs.index(0, d);
+    if (i & 1) {
+      const std::int32_t l = lhs(0, d);
+      dot[0] += l * rhs_val;
+      lhs_sums[0] += l;
+      r++;
+      i++;
+    }
+    const std::uint8_t* lhs_ptr = lhs.data() + (i >> 1);
+    for (; r <= rows - 2; r += 2) {
+      const std::uint8_t byte = *lhs_ptr++;
+      const std::int32_t l0 = byte & 0xf;
+      const std::int32_t l1 = byte >> 4;
+      dot[r] += l0 * rhs_val;
+      dot[r + 1] += l1 * rhs_val;
+      lhs_sums[r] += l0;
+      lhs_sums[r + 1] += l1;
+    }
+    if (r < rows) {
+      const std::int32_t l = *lhs_ptr & 0xf;
+      dot[r] += l * rhs_val;
+      lhs_sums[r] += l;
+    }
+  }
+}
+
+// Single-threaded GEMV with a 4-bit LHS. The RHS and result must be
+// column-vectors (cols() == 1). The BitDepthParams hint is ignored, like
+// todo/fast-gemv.txt suggests: the computation is exact in int32.
+template <MapOrder LhsOrder, typename RhsType, typename ResultType,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void SingleThreadGemv(SingleThreadGemmContext* context,
+                      const NibbleMatrixMap<LhsOrder>& lhs, const RhsType& rhs,
+                      ResultType* result, const LhsOffset& lhs_offset,
+                      const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::SingleThreadGemv (4-bit LHS)");
+
+  assert(lhs.cols() == rhs.rows());
+  assert(rhs.cols() == 1);
+  assert(result->cols() == 1);
+
+  const int rows = result->rows();
+  const int depth = lhs.cols();
+
+  Allocator* allocator = context->allocator();
+  const Allocator::Handle dot_handle = allocator->Reserve<std::int32_t>(rows);
+  const Allocator::Handle lhs_sums_handle =
+      allocator->Reserve<std::int32_t>(rows);
+  allocator->Commit();
+
+  std::int32_t* dot = allocator->GetPointer<std::int32_t>(dot_handle);
+  std::int32_t* lhs_sums = allocator->GetPointer<std::int32_t>(lhs_sums_handle);
+
+  GemvNibbleLhsRawProducts(lhs, rhs, dot, lhs_sums);
+
+  std::int32_t rhs_sum = 0;
+  for (int d = 0; d < depth; d++) {
+    rhs_sum += rhs(d, 0);
+  }
+  const std::int32_t ro = rhs_offset(0);
+  for (int r = 0; r < rows; r++) {
+    const std::int32_t lo = lhs_offset(r);
+    dot[r] += ro * lhs_sums[r] + lo * (rhs_sum + depth * ro);
+  }
+
+  using Int32x1x1 = RegisterBlock<std::int32_t, 1, 1>;
+  using Int32x4x1 = RegisterBlock<std::int32_t, 4, 1>;
+  OutputPipelineExecutor<OutputPipelineType, Int32x1x1>
+      output_pipeline_executor_1x1(output_pipeline);
+  OutputPipelineExecutor<OutputPipelineType, Int32x4x1>
+      output_pipeline_executor_4x1(output_pipeline);
+  const MatrixMap<const std::int32_t, MapOrder::ColMajor> acc_map(dot, rows,
+                                                                  1);
+  int r = 0;
+  for (; r <= rows - 4; r += 4) {
+    output_pipeline_executor_4x1.Execute(Load<Int32x4x1>(acc_map, r, 0),
+                                         result, r, 0, r, 0);
+  }
+  for (; r < rows; r++) {
+    output_pipeline_executor_1x1.Execute(Load<Int32x1x1>(acc_map, r, 0),
+                                         result, r, 0, r, 0);
+  }
+
+  allocator->Decommit();
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_H_
@@ -0,0 +1,256 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// stage_stats.h: counters of the time spent in each stage of the GEMMs run
+// on a context (packing, computing, unpacking, and waiting for other
+// threads), aggregated over all threads. Unlike the sampling profiler in
+// profiling/, these are available in every build and enabled at runtime,
+// see SingleThreadGemmContext::set_stage_stats_enabled. Optionally, they
+// also count hardware events, see perf_counters.h.
+
+#ifndef GEMMLOWP_INTERNAL_STAGE_STATS_H_
+#define GEMMLOWP_INTERNAL_STAGE_STATS_H_
+
+#include <atomic>  // NOLINT
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <cstdio>
+
+#include "perf_counters.h"
+
+namespace gemmlowp {
+
+enum class GemmStage {
+  PackLhs,
+  PackRhs,
+  Compute,
+  UnpackResult,
+  // Worker threads waiting for a task, in WaitForVariableChange. This
+  // includes the time that they were idle between GEMMs.
+  WorkerWait,
+  // The calling thread waiting for worker threads to finish their tasks,
+  // in BlockingCounter::Wait.
+  MainWait,
+  kCount
+};
+
+// The totals of one stage. bytes are the packed bytes that the stage
+// writes (PackLhs, PackRhs) or reads (Compute, and the int32 accumulators
+// for UnpackResult); they are 0 for the waits. ops are the multiplications
+// and additions of Compute. perf_events are the counts of hardware events,
+// indexed by PerfEvent, if enabled.
+struct GemmStageTotals {
+  std::uint64_t nanoseconds = 0;
+  std::uint64_t bytes = 0;
+  std::uint64_t ops = 0;
+  std::uint64_t calls = 0;
+  std::uint64_t perf_events[kPerfEventCount] = {};
+
+  std::uint64_t perf_event(PerfEvent event) const {
+    return perf_events[static_cast<int>(event)];
+  }
+};
+
+// A snapshot of the counters of a context.
+struct GemmStageStats {
+  GemmStageTotals stages[static_cast<int>(GemmStage::kCount)];
+
+  const GemmStageTotals& operator[](GemmStage stage) const {
+    return stages[static_cast<int>(stage)];
+  }
+};
+
+// The counters themselves, updated concurrently by all the threads working
+// on GEMMs of a context.
+class GemmStageCounters {
+ public:
+  GemmStageCounters() : perf_events_enabled_(false) { Reset(); }
+
+  // Whether to also count hardware events, on the threads where they can be
+  // opened. Must not be changed while GEMMs are running.
+  void set_perf_events_enabled(bool b) { perf_events_enabled_ = b; }
+  bool perf_events_enabled() const { return perf_events_enabled_; }
+
+  // perf_events may be null if they were not counted.
+  void Add(GemmStage stage, std::uint64_t nanoseconds, std::uint64_t bytes,
+           std::uint64_t ops = 0, const std::uint64_t* perf_events = nullptr) {
+    Counters& counters = counters_[static_cast<int>(stage)];
+    counters.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    counters.ops.fetch_add(ops, std::memory_order_relaxed);
+    counters.calls.fetch_add(1, std::memory_order_relaxed);
+    if (perf_events) {
+      for (int e = 0; e < kPerfEventCount; e++) {
+        counters.perf_events[e].fetch_add(perf_events[e],
+                                          std::memory_order_relaxed);
+      }
+    }
+  }
+
+  GemmStageStats Snapshot() const {
+    GemmStageStats stats;
+    for (int i = 0; i < static_cast<int>(GemmStage::kCount); i++) {
+      stats.stages[i].nanoseconds =
+          counters_[i].nanoseconds.load(std::memory_order_relaxed);
+      stats.stages[i].bytes =
+          counters_[i].bytes.load(std::memory_order_relaxed);
+      stats.stages[i].ops = counters_[i].ops.load(std::memory_order_relaxed);
+      stats.stages[i].calls =
+          counters_[i].calls.load(std::memory_order_relaxed);
+      for (int e = 0; e < kPerfEventCount; e++) {
+        stats.stages[i].perf_events[e] =
+            counters_[i].perf_events[e].load(std::memory_order_relaxed);
+      }
+    }
+    return stats;
+  }
+
+  void Reset() {
+    for (Counters& counters : counters_) {
+      counters.nanoseconds.store(0, std::memory_order_relaxed);
+      counters.bytes.store(0, std::memory_order_relaxed);
+      counters.ops.store(0, std::memory_order_relaxed);
+      counters.calls.store(0, std::memory_order_relaxed);
+      for (auto& count : counters.perf_events) {
+        count.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  struct Counters {
+    std::atomic<std::uint64_t> nanoseconds;
+    std::atomic<std::uint64_t> bytes;
+    std::atomic<std::uint64_t> ops;
+    std::atomic<std::uint64_t> calls;
+    std::atomic<std::uint64_t> perf_events[kPerfEventCount];
+  };
+
+  Counters counters_[static_cast<int>(GemmStage::kCount)];
+  bool perf_events_enabled_;
+};
+
+inline std::uint64_t StageClockNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Adds the time until its destruction, and the hardware events of the
+// calling thread if enabled, to the given stage of the given counters.
+// Does nothing, not even reading the clock, if counters is null, which is
+// how disabled stage stats are passed around.
+class ScopedGemmStage {
+ public:
+  ScopedGemmStage(GemmStageCounters* counters, GemmStage stage,
+                  std::uint64_t bytes, std::uint64_t ops = 0)
+      : counters_(counters),
+        stage_(stage),
+        bytes_(bytes),
+        ops_(ops),
+        perf_counters_(counters && counters->perf_events_enabled()
+                           ? ThreadPerfCounters::ForCurrentThread()
+                           : nullptr) {
+    if (perf_counters_ && !perf_counters_->Read(perf_events_start_)) {
+      perf_counters_ = nullptr;
+    }
+    start_ = counters ? StageClockNanoseconds() : 0;
+  }
+
+  ~ScopedGemmStage() {
+    if (!counters_) {
+      return;
+    }
+    const std::uint64_t nanoseconds = StageClockNanoseconds() - start_;
+    std::uint64_t perf_events[kPerfEventCount];
+    const bool counted_perf_events =
+        perf_counters_ && perf_counters_->Read(perf_events);
+    if (counted_perf_events) {
+      for (int e = 0; e < kPerfEventCount; e++) {
+        perf_events[e] -= perf_events_start_[e];
+      }
+    }
+    counters_->Add(stage_, nanoseconds, bytes_, ops_,
+                   counted_perf_events ? perf_events : nullptr);
+  }
+
+ private:
+  ScopedGemmStage(const ScopedGemmStage&) = delete;
+
+  GemmStageCounters* const counters_;
+  const GemmStage stage_;
+  const std::uint64_t bytes_;
+  const std::uint64_t ops_;
+  const ThreadPerfCounters* perf_counters_;
+  std::uint64_t perf_events_start_[kPerfEventCount];
+  std::uint64_t start_;
+};
+
+inline const char* GemmStageName(GemmStage stage) {
+  switch (stage) {
+    case GemmStage::PackLhs:
+      return "PackLhs";
+    case GemmStage::PackRhs:
+      return "PackRhs";
+    case GemmStage::Compute:
+      return "Compute";
+    case GemmStage::UnpackResult:
+      return "UnpackResult";
+    case GemmStage::WorkerWait:
+      return "WorkerWait";
+    case GemmStage::MainWait:
+      return "MainWait";
+    default:
+      return "?";
+  }
+}
+
+// Prints a table of the given stats on stdout: for each stage, its time,
+// the bandwidth of its bytes and, for Compute, its Gop/s, and if hardware
+// events were counted, the instructions per cycle and the misses per
+// thousand instructions. Times are summed over threads, so rates are per
+// thread.
+inline void PrintGemmStageStats(const GemmStageStats& stats) {
+  printf("%-12s %8s %10s %8s %8s %6s %9s %9s %9s\n", "stage", "calls", "ms",
+         "GB/s", "Gop/s", "IPC", "L1D MPKI", "LLC MPKI", "dTLB MPKI");
+  for (int i = 0; i < static_cast<int>(GemmStage::kCount); i++) {
+    const GemmStageTotals& totals = stats.stages[i];
+    if (!totals.calls) {
+      continue;
+    }
+    const double seconds = 1e-9 * totals.nanoseconds;
+    const double gb_per_second = seconds ? 1e-9 * totals.bytes / seconds : 0;
+    const double gops = seconds ? 1e-9 * totals.ops / seconds : 0;
+    printf("%-12s %8llu %10.3f %8.2f %8.2f",
+           GemmStageName(static_cast<GemmStage>(i)),
+           static_cast<unsigned long long>(totals.calls), 1e3 * seconds,
+           gb_per_second, gops);
+    const std::uint64_t cycles = totals.perf_event(PerfEvent::Cycles);
+    const std::uint64_t instructions =
+        totals.perf_event(PerfEvent::Instructions);
+    if (cycles && instructions) {
+      const double kilo_instructions = 1e-3 * instructions;
+      printf(" %6.2f %9.3f %9.3f %9.3f",
+             static_cast<double>(instructions) / cycles,
+             totals.perf_event(PerfEvent::L1DReadMisses) / kilo_instructions,
+             totals.perf_event(PerfEvent::LLCMisses) / kilo_instructions,
+             totals.perf_event(PerfEvent::DTLBReadMisses) / kilo_instructions);
+    }
+    printf("\n");
+  }
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_STAGE_STATS_H_
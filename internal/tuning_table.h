@@ -0,0 +1,165 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// tuning_table.h: a table of the best known block parameters for given GEMM
+// shapes, as found by test/tune_block_params.cc, that a context can use
+// instead of its cache settings. See SingleThreadGemmContext::
+// set_tuning_table.
+//
+// The table stores the inputs of BlockParams::Init (the cache sizes to
+// block for and the L2 RHS factor) and the thread count, rather than the
+// block sizes themselves: BlockParams derives consistent block sizes from
+// them for any shape, which is what makes falling back to the nearest shape
+// meaningful.
+
+#ifndef GEMMLOWP_INTERNAL_TUNING_TABLE_H_
+#define GEMMLOWP_INTERNAL_TUNING_TABLE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+namespace gemmlowp {
+
+struct TunedBlockParams {
+  int l1_bytes_to_use = 0;
+  int l2_bytes_to_use = 0;
+  float l2_rhs_factor = 0;
+  int l3_bytes_to_use = 0;
+  // 0 means to use the context's max_num_threads.
+  int max_num_threads = 0;
+};
+
+class TuningTable {
+ public:
+  struct Entry {
+    int rows;
+    int depth;
+    int cols;
+    TunedBlockParams params;
+  };
+
+  // Adds or replaces the entry for the given shape. Shapes are stored with
+  // rows >= cols, as GEMMs are computed with rows < cols transposed.
+  void Add(int rows, int depth, int cols, const TunedBlockParams& params) {
+    Normalize(&rows, &cols);
+    for (Entry& entry : entries_) {
+      if (entry.rows == rows && entry.depth == depth && entry.cols == cols) {
+        entry.params = params;
+        return;
+      }
+    }
+    Entry entry;
+    entry.rows = rows;
+    entry.depth = depth;
+    entry.cols = cols;
+    entry.params = params;
+    entries_.push_back(entry);
+  }
+
+  // Returns the parameters for the given shape, or else for the nearest
+  // shape in the table, comparing the ratios of each dimension, or null if
+  // the table is empty.
+  const TunedBlockParams* Lookup(int rows, int depth, int cols) const {
+    Normalize(&rows, &cols);
+    const Entry* nearest = nullptr;
+    float nearest_distance = std::numeric_limits<float>::max();
+    for (const Entry& entry : entries_) {
+      if (entry.rows == rows && entry.depth == depth && entry.cols == cols) {
+        return &entry.params;
+      }
+      const float distance = LogDistance(entry.rows, rows) +
+                             LogDistance(entry.depth, depth) +
+                             LogDistance(entry.cols, cols);
+      if (distance < nearest_distance) {
+        nearest_distance = distance;
+        nearest = &entry;
+      }
+    }
+    return nearest ? &nearest->params : nullptr;
+  }
+
+  const std::vector<Entry>& entries() const { return entries_; }
+
+  // The file format has one line per entry:
+  //   rows depth cols l1_bytes l2_bytes l2_rhs_factor l3_bytes threads
+  // Lines starting with '#' are comments.
+  bool SaveToFile(const char* path) const {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+      return false;
+    }
+    fprintf(file,
+            "# rows depth cols l1_bytes l2_bytes l2_rhs_factor l3_bytes "
+            "threads\n");
+    for (const Entry& entry : entries_) {
+      const TunedBlockParams& p = entry.params;
+      fprintf(file, "%d %d %d %d %d %g %d %d\n", entry.rows, entry.depth,
+              entry.cols, p.l1_bytes_to_use, p.l2_bytes_to_use,
+              p.l2_rhs_factor, p.l3_bytes_to_use, p.max_num_threads);
+    }
+    return fclose(file) == 0;
+  }
+
+  // Adds the entries of the given file. Returns false if it can't be read
+  // or has a malformed line, in which case the entries before it are kept.
+  // Lines with non-positive sizes, cache sizes or l2_rhs_factor are
+  // malformed.
+  bool LoadFromFile(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+      return false;
+    }
+    bool ok = true;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+      if (line[0] == '#' || line[0] == '\n') {
+        continue;
+      }
+      int rows, depth, cols;
+      TunedBlockParams p;
+      if (sscanf(line, "%d %d %d %d %d %f %d %d", &rows, &depth, &cols,
+                 &p.l1_bytes_to_use, &p.l2_bytes_to_use, &p.l2_rhs_factor,
+                 &p.l3_bytes_to_use, &p.max_num_threads) != 8 ||
+          rows <= 0 || depth <= 0 || cols <= 0 || p.l1_bytes_to_use <= 0 ||
+          p.l2_bytes_to_use <= 0 || !(p.l2_rhs_factor > 0)) {
+        ok = false;
+        break;
+      }
+      Add(rows, depth, cols, p);
+    }
+    fclose(file);
+    return ok;
+  }
+
+ private:
+  static void Normalize(int* rows, int* cols) {
+    if (*rows < *cols) {
+      std::swap(*rows, *cols);
+    }
+  }
+
+  static float LogDistance(int a, int b) {
+    const float d = std::log2(static_cast<float>(a) / b);
+    return d * d;
+  }
+
+  std::vector<Entry> entries_;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_TUNING_TABLE_H_
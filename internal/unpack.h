@@ -68,6 +68,26 @@ struct MatrixBlockBounds {
         cols(cols_) {}
 };
 
+// Bounds of a result block whose size is known at compile time. Given
+// these, UnpackResult has constant loop bounds, and its handling of
+// leftover rows and columns is only generated for the remainders that the
+// block actually has.
+template <int tRows, int tCols>
+struct FixedMatrixBlockBounds {
+  static constexpr int rows = tRows;
+  static constexpr int cols = tCols;
+  int start_row;
+  int start_col;
+
+  FixedMatrixBlockBounds(int start_row_, int start_col_)
+      : start_row(start_row_), start_col(start_col_) {}
+};
+
+template <int tRows, int tCols>
+constexpr int FixedMatrixBlockBounds<tRows, tCols>::rows;
+template <int tRows, int tCols>
+constexpr int FixedMatrixBlockBounds<tRows, tCols>::cols;
+
 template <int Rows, int Cols, typename SrcMapType>
 void PrefetchResultBlock(const SrcMapType& src,
                          const VectorMap<const std::int32_t, VectorShape::Col>&
@@ -126,10 +146,11 @@ void UnpackResultBlock(const SrcMapType& src,
   executor.Execute(acc, dst, src_global_row, src_global_col, dst_row, dst_col);
 }
 
+// BlockBoundsType is MatrixBlockBounds or FixedMatrixBlockBounds.
 template <typename KernelFormat, typename ResultBlockType,
-          typename PackedResultType, typename LhsOffset, typename RhsOffset,
-          typename OutputPipelineType>
-void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
+          typename BlockBoundsType, typename PackedResultType,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void UnpackResult(ResultBlockType* dst, const BlockBoundsType& dst_block,
                   const PackedResultType& src, int depth,
                   const std::int32_t* lhs_sums_of_each_slice_ptr,
                   const std::int32_t* rhs_sums_of_each_slice_ptr,
@@ -170,12 +191,19 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
   OutputPipelineExecutor<OutputPipelineType, Int32x8x4>
       output_pipeline_executor_8x4(output_pipeline);
 
-  int c8 = 0;
+  // Each loop over a remainder starts at an explicit boundary rather than
+  // where the previous loop left off, so that with FixedMatrixBlockBounds
+  // the compiler sees all bounds as constants (and doesn't warn about the
+  // loops over remainders overflowing when there are none).
+  const int rows8 = RoundDown<8>(dst_block.rows);
+  const int rows4 = RoundDown<4>(dst_block.rows);
+  const int cols4 = RoundDown<4>(dst_block.cols);
+  int cols8 = 0;
   if (ResultBlockType::kOrder == MapOrder::RowMajor) {
-    for (; c8 <= dst_block.cols - 8; c8 += 8) {
+    cols8 = RoundDown<8>(dst_block.cols);
+    for (int c8 = 0; c8 < cols8; c8 += 8) {
       PrefetchResultBlock<8, 8>(src_map, lhs_sums_of_each_slice, 0, c8);
-      int r = 0;
-      for (; r <= dst_block.rows - 8; r += 8) {
+      for (int r = 0; r < rows8; r += 8) {
         const int global_row = r + dst_block.start_row;
         PrefetchResultBlock<8, 8>(src_map, lhs_sums_of_each_slice, r + 8, c8);
         DstScalarType dst_colmajor_buf[64];
@@ -192,7 +220,7 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
         StoreFinalOutput(LoadContiguous<DstScalarx8x8>(dst_colmajor_buf), dst,
                          r + dst_block.start_row, c8 + dst_block.start_col);
       }
-      for (; r <= dst_block.rows - 4; r += 4) {
+      for (int r = rows8; r < rows4; r += 4) {
         const int global_row = r + dst_block.start_row;
         for (int cx = 0; cx < 8; cx += 4) {
           const int c = c8 + cx;
@@ -204,7 +232,7 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
               global_col);
         }
       }
-      for (; r < dst_block.rows; r++) {
+      for (int r = rows4; r < dst_block.rows; r++) {
         const int global_row = r + dst_block.start_row;
         for (int cx = 0; cx < 8; cx += 4) {
           const int c = c8 + cx;
@@ -218,12 +246,10 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
       }
     }
   }
-  int c = c8;
-  for (; c <= dst_block.cols - 4; c += 4) {
+  for (int c = cols8; c < cols4; c += 4) {
     const int global_col = c + dst_block.start_col;
     PrefetchResultBlock<8, 4>(src_map, lhs_sums_of_each_slice, 0, c);
-    int r = 0;
-    for (; r <= dst_block.rows - 8; r += 8) {
+    for (int r = 0; r < rows8; r += 8) {
       const int global_row = r + dst_block.start_row;
       PrefetchResultBlock<8, 4>(src_map, lhs_sums_of_each_slice, r + 8, c);
       UnpackResultBlock<KernelFormat, Int32x8x4>(
@@ -231,14 +257,14 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
           rhs_sums_of_each_slice, lhs_offset, rhs_offset, depth, r, c,
           global_row, global_col, global_row, global_col);
     }
-    for (; r <= dst_block.rows - 4; r += 4) {
+    for (int r = rows8; r < rows4; r += 4) {
       const int global_row = r + dst_block.start_row;
       UnpackResultBlock<KernelFormat, Int32x4x4>(
           src_map, output_pipeline_executor_4x4, dst, lhs_sums_of_each_slice,
           rhs_sums_of_each_slice, lhs_offset, rhs_offset, depth, r, c,
           global_row, global_col, global_row, global_col);
     }
-    for (; r < dst_block.rows; r++) {
+    for (int r = rows4; r < dst_block.rows; r++) {
       const int global_row = r + dst_block.start_row;
       UnpackResultBlock<KernelFormat, Int32x1x4>(
           src_map, output_pipeline_executor_1x4, dst, lhs_sums_of_each_slice,
@@ -246,11 +272,10 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
           global_row, global_col, global_row, global_col);
     }
   }
-  for (; c < dst_block.cols; c++) {
+  for (int c = cols4; c < dst_block.cols; c++) {
     const int global_col = c + dst_block.start_col;
     PrefetchResultBlock<8, 1>(src_map, lhs_sums_of_each_slice, 0, c);
-    int r = 0;
-    for (; r <= dst_block.rows - 8; r += 8) {
+    for (int r = 0; r < rows8; r += 8) {
       const int global_row = r + dst_block.start_row;
       PrefetchResultBlock<8, 1>(src_map, lhs_sums_of_each_slice, r + 8, c);
       UnpackResultBlock<KernelFormat, Int32x8x1>(
@@ -258,14 +283,14 @@ void UnpackResult(ResultBlockType* dst, const MatrixBlockBounds& dst_block,
           rhs_sums_of_each_slice, lhs_offset, rhs_offset, depth, r, c,
           global_row, global_col, global_row, global_col);
     }
-    for (; r <= dst_block.rows - 4; r += 4) {
+    for (int r = rows8; r < rows4; r += 4) {
       const int global_row = r + dst_block.start_row;
       UnpackResultBlock<KernelFormat, Int32x4x1>(
           src_map, output_pipeline_executor_4x1, dst, lhs_sums_of_each_slice,
           rhs_sums_of_each_slice, lhs_offset, rhs_offset, depth, r, c,
           global_row, global_col, global_row, global_col);
     }
-    for (; r < dst_block.rows; r++) {
+    for (int r = rows4; r < dst_block.rows; r++) {
       const int global_row = r + dst_block.start_row;
       UnpackResultBlock<KernelFormat, Int32x1x1>(
           src_map, output_pipeline_executor_1x1, dst, lhs_sums_of_each_slice,
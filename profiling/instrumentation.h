@@ -17,7 +17,9 @@
 //   ScopedProfilingLabel, RegisterCurrentThreadForProfiling.
 //
 // profiler.h is only needed to drive the profiler:
-//   StartProfiling, FinishProfiling.
+//   StartProfiling, FinishProfiling,
+// and the tracer:
+//   StartTracing, StopTracing, WriteChromeTrace.
 //
 // See the usage example in profiler.h.
 
@@ -47,8 +49,11 @@ using ::uintptr_t;
 #include <cstdlib>
 
 #ifdef GEMMLOWP_PROFILING
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <set>
+#include <vector>
 #endif
 
 #include "./pthread_everywhere.h"
@@ -107,48 +112,210 @@ struct ScopedLock {
 // A pseudo-call-stack. Contrary to a real call-stack, this only
 // contains pointers to literal strings that were manually entered
 // in the instrumented code (see ScopedProfilingLabel).
+// This is a plain snapshot, as recorded by the profiler; the live stack
+// of each thread is an AtomicProfilingStack.
 struct ProfilingStack {
-  static const std::size_t kMaxSize = 30;
+  static const std::size_t kMaxSize = 31;
   typedef const char* LabelsArrayType[kMaxSize];
   LabelsArrayType labels;
   std::size_t size;
-  Mutex* lock;
 
   ProfilingStack() { memset(this, 0, sizeof(ProfilingStack)); }
-  ~ProfilingStack() { delete lock; }
+
+  bool operator==(const ProfilingStack& other) const {
+    return !memcmp(this, &other, sizeof(ProfilingStack));
+  }
+};
+
+static_assert(
+    !(sizeof(ProfilingStack) & (sizeof(ProfilingStack) - 1)),
+    "ProfilingStack should have power-of-two size to fit in cache lines");
+
+// The live pseudo-stack of a thread. It has a single writer, the thread
+// itself, and is read by the profiler thread while it changes, so it is a
+// seqlock rather than being guarded by a mutex: the writer makes sequence_
+// odd while it modifies the stack, and the reader retries if sequence_
+// was odd or changed while it copied the stack. Push and Pop thus take no
+// lock and do no atomic read-modify-write, keeping the overhead of
+// ScopedProfilingLabel low enough for production builds.
+class AtomicProfilingStack {
+ public:
+  static const std::size_t kMaxSize = ProfilingStack::kMaxSize;
+  static const int kMaxReadAttempts = 100;
+
+  AtomicProfilingStack() : size_(0), sequence_(0) {
+    for (auto& label : labels_) {
+      label.store(nullptr, std::memory_order_relaxed);
+    }
+  }
 
   void Push(const char* label) {
-    ScopedLock sl(lock);
+    const std::size_t size = size_.load(std::memory_order_relaxed);
     ReleaseBuildAssertion(size < kMaxSize, "ProfilingStack overflow");
-    labels[size] = label;
-    size++;
+    BeginWrite();
+    labels_[size].store(label, std::memory_order_relaxed);
+    size_.store(size + 1, std::memory_order_relaxed);
+    EndWrite();
   }
 
   void Pop() {
-    ScopedLock sl(lock);
+    const std::size_t size = size_.load(std::memory_order_relaxed);
     ReleaseBuildAssertion(size > 0, "ProfilingStack underflow");
-    size--;
+    BeginWrite();
+    size_.store(size - 1, std::memory_order_relaxed);
+    EndWrite();
   }
 
   void UpdateTop(const char* new_label) {
-    ScopedLock sl(lock);
+    const std::size_t size = size_.load(std::memory_order_relaxed);
     assert(size);
-    labels[size - 1] = new_label;
+    BeginWrite();
+    labels_[size - 1].store(new_label, std::memory_order_relaxed);
+    EndWrite();
   }
 
-  ProfilingStack& operator=(const ProfilingStack& other) {
-    memcpy(this, &other, sizeof(ProfilingStack));
-    return *this;
+  // Copies a consistent snapshot of the stack into dst. Called from another
+  // thread. Returns false, leaving dst empty, if the stack kept changing
+  // for kMaxReadAttempts attempts, e.g. if the writer was preempted in the
+  // middle of a change.
+  bool Read(ProfilingStack* dst) const {
+    for (int attempt = 0; attempt < kMaxReadAttempts; attempt++) {
+      const std::uint32_t sequence = sequence_.load(std::memory_order_acquire);
+      if (sequence & 1) {
+        continue;
+      }
+      std::size_t size = size_.load(std::memory_order_relaxed);
+      if (size > kMaxSize) {
+        // Torn by a concurrent change; the sequence check below will fail.
+        size = kMaxSize;
+      }
+      for (std::size_t i = 0; i < size; i++) {
+        dst->labels[i] = labels_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == sequence) {
+        dst->size = size;
+        return true;
+      }
+    }
+    dst->size = 0;
+    return false;
   }
 
-  bool operator==(const ProfilingStack& other) const {
-    return !memcmp(this, &other, sizeof(ProfilingStack));
+ protected:
+  // Protected rather than private for tests to hold a change open.
+  void BeginWrite() {
+    sequence_.store(sequence_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void EndWrite() {
+    sequence_.store(sequence_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
   }
+
+ private:
+  std::atomic<const char*> labels_[kMaxSize];
+  std::atomic<std::size_t> size_;
+  std::atomic<std::uint32_t> sequence_;
 };
 
-static_assert(
-    !(sizeof(ProfilingStack) & (sizeof(ProfilingStack) - 1)),
-    "ProfilingStack should have power-of-two size to fit in cache lines");
+// The begin or end of a ScopedProfilingLabel scope, as recorded while
+// tracing. See StartTracing in profiler.h.
+struct TraceEvent {
+  const char* label;
+  std::uint64_t nanoseconds;
+  bool begin;
+};
+
+inline std::uint64_t TraceClockNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Whether ScopedProfilingLabel records trace events.
+inline std::atomic<bool>& IsTracing() {
+  static std::atomic<bool> b(false);
+  return b;
+}
+
+// The trace events of a thread, in a ring buffer keeping the last
+// kCapacity events. Like AtomicProfilingStack, it has a single writer,
+// the thread itself, and takes no lock: Read copies the events while they
+// may be overwritten, then discards those that may have been. The storage
+// is only allocated when the thread first records an event.
+class TraceBuffer {
+ public:
+  static const std::size_t kCapacity = 1 << 14;
+
+  TraceBuffer() : slots_(nullptr), write_start_(0), end_(0) {}
+
+  ~TraceBuffer() { delete[] slots_.load(std::memory_order_relaxed); }
+
+  void Record(const char* label, bool begin) {
+    Slot* slots = slots_.load(std::memory_order_relaxed);
+    if (!slots) {
+      slots = new Slot[kCapacity];
+      slots_.store(slots, std::memory_order_release);
+    }
+    const std::uint64_t end = end_.load(std::memory_order_relaxed);
+    write_start_.store(end + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Slot& slot = slots[end & (kCapacity - 1)];
+    slot.label.store(label, std::memory_order_relaxed);
+    slot.nanoseconds.store(TraceClockNanoseconds(), std::memory_order_relaxed);
+    slot.begin.store(begin, std::memory_order_relaxed);
+    end_.store(end + 1, std::memory_order_release);
+  }
+
+  // Appends the events still in the buffer to dst, oldest first. Called
+  // from another thread.
+  void Read(std::vector<TraceEvent>* dst) const {
+    const Slot* slots = slots_.load(std::memory_order_acquire);
+    if (!slots) {
+      return;
+    }
+    const std::uint64_t end = end_.load(std::memory_order_acquire);
+    const std::uint64_t start = end > kCapacity ? end - kCapacity : 0;
+    std::vector<TraceEvent> events;
+    events.reserve(end - start);
+    for (std::uint64_t i = start; i < end; i++) {
+      const Slot& slot = slots[i & (kCapacity - 1)];
+      TraceEvent event;
+      event.label = slot.label.load(std::memory_order_relaxed);
+      event.nanoseconds = slot.nanoseconds.load(std::memory_order_relaxed);
+      event.begin = slot.begin.load(std::memory_order_relaxed);
+      events.push_back(event);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // The writer may have been overwriting any event older than the
+    // kCapacity last ones that it had started writing.
+    const std::uint64_t write_start =
+        write_start_.load(std::memory_order_relaxed);
+    const std::uint64_t first_valid =
+        write_start > kCapacity ? write_start - kCapacity : 0;
+    const std::size_t skip = static_cast<std::size_t>(
+        first_valid > start ? std::min(first_valid, end) - start : 0);
+    dst->insert(dst->end(), events.begin() + skip, events.end());
+  }
+
+ private:
+  struct Slot {
+    std::atomic<const char*> label;
+    std::atomic<std::uint64_t> nanoseconds;
+    std::atomic<bool> begin;
+  };
+
+  TraceBuffer(const TraceBuffer&) = delete;
+
+  std::atomic<Slot*> slots_;
+  // The number of events that the writer started writing, and finished
+  // writing.
+  std::atomic<std::uint64_t> write_start_;
+  std::atomic<std::uint64_t> end_;
+};
 
 struct ThreadInfo;
 
@@ -158,20 +325,31 @@ inline std::set<ThreadInfo*>& ThreadsUnderProfiling() {
   return v;
 }
 
+// The global set of threads that have used a ScopedProfilingLabel, whose
+// events are traced whether or not they are registered for profiling.
+inline std::set<ThreadInfo*>& ThreadsUnderTracing() {
+  static std::set<ThreadInfo*> v;
+  return v;
+}
+
+// Owned by ThreadLocalThreadInfo, which deletes it at thread exit.
 struct ThreadInfo {
-  pthread_key_t key;  // used only to get a callback at thread exit.
-  ProfilingStack stack;
+  AtomicProfilingStack stack;
+  TraceBuffer trace;
+  // A small number identifying the thread in profiles and traces.
+  int id;
 
   ThreadInfo() {
-    pthread_key_create(&key, ThreadExitCallback);
-    pthread_setspecific(key, this);
-    stack.lock = new Mutex();
+    static std::atomic<int> next_id(0);
+    id = next_id++;
+    ScopedLock sl(GlobalMutexes::Profiler());
+    ThreadsUnderTracing().insert(this);
   }
 
-  static void ThreadExitCallback(void* ptr) {
+  ~ThreadInfo() {
     ScopedLock sl(GlobalMutexes::Profiler());
-    ThreadInfo* self = static_cast<ThreadInfo*>(ptr);
-    ThreadsUnderProfiling().erase(self);
+    ThreadsUnderProfiling().erase(this);
+    ThreadsUnderTracing().erase(this);
   }
 };
 
@@ -204,24 +382,47 @@ inline ThreadInfo& ThreadLocalThreadInfo() {
 // samples will then be annotated with this label, while it is in scope
 // (whence the name --- also known as RAII).
 // See the example in profiler.h.
+//
+// While tracing, it also records the begin and end of its scope. The end
+// is only recorded if the begin was.
 class ScopedProfilingLabel {
-  ProfilingStack* profiling_stack_;
+  ThreadInfo* thread_info_;
+  // The label whose begin was traced, or null.
+  const char* traced_label_;
 
  public:
   explicit ScopedProfilingLabel(const char* label)
-      : profiling_stack_(&ThreadLocalThreadInfo().stack) {
-    profiling_stack_->Push(label);
+      : thread_info_(&ThreadLocalThreadInfo()), traced_label_(nullptr) {
+    thread_info_->stack.Push(label);
+    if (IsTracing().load(std::memory_order_relaxed)) {
+      traced_label_ = label;
+      thread_info_->trace.Record(label, true);
+    }
   }
 
-  ~ScopedProfilingLabel() { profiling_stack_->Pop(); }
+  ~ScopedProfilingLabel() {
+    if (traced_label_) {
+      thread_info_->trace.Record(traced_label_, false);
+    }
+    thread_info_->stack.Pop();
+  }
 
-  void Update(const char* new_label) { profiling_stack_->UpdateTop(new_label); }
+  void Update(const char* new_label) {
+    if (traced_label_) {
+      thread_info_->trace.Record(traced_label_, false);
+      thread_info_->trace.Record(new_label, true);
+      traced_label_ = new_label;
+    }
+    thread_info_->stack.UpdateTop(new_label);
+  }
 };
 
 // To be called once on each thread to be profiled.
 inline void RegisterCurrentThreadForProfiling() {
+  // Outside of the lock, which creating the ThreadInfo takes.
+  ThreadInfo* thread_info = &ThreadLocalThreadInfo();
   ScopedLock sl(GlobalMutexes::Profiler());
-  ThreadsUnderProfiling().insert(&ThreadLocalThreadInfo());
+  ThreadsUnderProfiling().insert(thread_info);
 }
 
 #else  // not GEMMLOWP_PROFILING
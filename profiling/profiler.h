@@ -139,6 +139,41 @@
 //
 // 80% WorkerFunc
 // 20% MainFunc
+//
+// Machine-readable and per-thread profiles
+// ========================================
+//
+// FinishProfiling(&profile) returns the samples in a Profile instead of
+// printing them. The Profile can then print one tree per thread
+// (PrintPerThread), or write the samples as folded stacks, the input of
+// flame graph tools such as Brendan Gregg's flamegraph.pl
+// (WriteFoldedStacks), or as JSON (WriteJson):
+//
+//    Profile profile;
+//    FinishProfiling(&profile);
+//    profile.WriteFoldedStacks("profile.folded");
+//
+// SetProfilerSamplingInterval changes the interval between samples from
+// its default of 1 ms, or 10 ms on ARM.
+//
+// Tracing
+// =======
+//
+// The samples above say where time went, but not when. For a timeline,
+// e.g. to see how worker threads are balanced, trace instead:
+//
+//    StartTracing();
+//    Foo();
+//    StopTracing();
+//    WriteChromeTrace("trace.json");
+//
+// While tracing, each ScopedProfilingLabel records when its scope begins
+// and ends, on every thread, registered for profiling or not, into a ring
+// buffer of that thread keeping its last TraceBuffer::kCapacity events.
+// WriteChromeTrace writes the events recorded since StartTracing in the
+// Chrome trace event JSON format, which chrome://tracing and
+// https://ui.perfetto.dev display. The events of threads that have exited
+// are lost. Tracing and sampling can be used at the same time.
 
 #ifndef GEMMLOWP_PROFILING_PROFILER_H_
 #define GEMMLOWP_PROFILING_PROFILER_H_
@@ -147,6 +182,10 @@
 #error Profiling is not enabled!
 #endif
 
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "instrumentation.h"
@@ -239,38 +278,191 @@ class ProfileTreeView {
 
  public:
   explicit ProfileTreeView(const std::vector<ProfilingStack>& stacks) {
-    for (auto stack : stacks) {
+    for (const auto& stack : stacks) {
       AddStack(stack);
     }
     AddOtherNodes();
     Sort();
   }
 
-  void Print() const {
+  void Print(int thread_count) const {
+    printf("\n");
+    printf("gemmlowp profile (%d threads, %d samples)\n", thread_count,
+           static_cast<int>(root_.weight));
+    PrintNode(&root_, 0);
+    printf("\n");
+  }
+
+  void PrintForThread(int thread_id) const {
     printf("\n");
-    printf("gemmlowp profile (%d threads, %d samples)\n",
-           static_cast<int>(ThreadsUnderProfiling().size()),
+    printf("gemmlowp profile of thread %d (%d samples)\n", thread_id,
            static_cast<int>(root_.weight));
     PrintNode(&root_, 0);
     printf("\n");
   }
 };
 
-// This function is the only place that determines our sampling frequency.
-inline void WaitOneProfilerTick() {
-  static const int millisecond = 1000000;
+// Writes a string as a JSON string literal.
+inline void WriteJsonString(FILE* file, const char* str) {
+  fputc('"', file);
+  for (const char* c = str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if (static_cast<unsigned char>(*c) < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// A recorded pseudo-stack, and the thread it was recorded from. See
+// ThreadInfo::id.
+struct ProfileSample {
+  int thread_id;
+  ProfilingStack stack;
+};
+
+// The samples recorded between StartProfiling and FinishProfiling.
+struct Profile {
+  // The number of threads registered for profiling.
+  int thread_count = 0;
+  int sampling_interval_us = 0;
+  std::vector<ProfileSample> samples;
+
+  // Prints a tree view of the samples of all threads on stdout, like
+  // FinishProfiling().
+  void Print() const { ProfileTreeView(Stacks(-1)).Print(thread_count); }
+
+  // Prints a tree view of the samples of each thread on stdout.
+  void PrintPerThread() const {
+    for (int thread_id : ThreadIds()) {
+      ProfileTreeView(Stacks(thread_id)).PrintForThread(thread_id);
+    }
+  }
+
+  // Writes one line per distinct pseudo-stack, with its labels from the
+  // outermost one, separated by semicolons, and its number of samples:
+  //   thread 0;Foo;Bar 42
+  // The first frame is the thread unless merge_threads is true. Stacks
+  // outside of any label have a single "(outside of any label)" frame.
+  // Returns false if the file could not be written.
+  bool WriteFoldedStacks(const char* path, bool merge_threads = false) const {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+      return false;
+    }
+    for (const auto& stack_count : CountStacks(merge_threads)) {
+      const std::vector<std::string>& labels = stack_count.first.second;
+      if (!merge_threads) {
+        fprintf(file, "thread %d;", stack_count.first.first);
+      }
+      if (labels.empty()) {
+        fprintf(file, "(outside of any label)");
+      }
+      for (std::size_t i = 0; i < labels.size(); i++) {
+        // Semicolons would split the frame.
+        std::string label = labels[i];
+        std::replace(label.begin(), label.end(), ';', ',');
+        fprintf(file, "%s%s", i ? ";" : "", label.c_str());
+      }
+      fprintf(file, " %d\n", stack_count.second);
+    }
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+  }
+
+  // Writes the profile as a JSON object, with the samples counted per
+  // thread and distinct pseudo-stack:
+  //   {"thread_count":1,"sampling_interval_us":1000,"sample_count":42,
+  //    "stacks":[{"thread":0,"labels":["Foo","Bar"],"samples":42}]}
+  // Returns false if the file could not be written.
+  bool WriteJson(const char* path) const {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+      return false;
+    }
+    fprintf(file,
+            "{\"thread_count\":%d,\"sampling_interval_us\":%d,"
+            "\"sample_count\":%d,\"stacks\":[",
+            thread_count, sampling_interval_us,
+            static_cast<int>(samples.size()));
+    bool first = true;
+    for (const auto& stack_count : CountStacks(false)) {
+      fprintf(file, "%s\n{\"thread\":%d,\"labels\":[", first ? "" : ",",
+              stack_count.first.first);
+      const std::vector<std::string>& labels = stack_count.first.second;
+      for (std::size_t i = 0; i < labels.size(); i++) {
+        fprintf(file, "%s", i ? "," : "");
+        WriteJsonString(file, labels[i].c_str());
+      }
+      fprintf(file, "],\"samples\":%d}", stack_count.second);
+      first = false;
+    }
+    fprintf(file, "\n]}\n");
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+  }
 
+ private:
+  // The number of samples of each distinct (thread, labels) pair, with
+  // thread -1 if merge_threads is true.
+  typedef std::map<std::pair<int, std::vector<std::string>>, int> StackCounts;
+
+  StackCounts CountStacks(bool merge_threads) const {
+    StackCounts counts;
+    for (const ProfileSample& sample : samples) {
+      std::vector<std::string> labels(sample.stack.labels,
+                                      sample.stack.labels + sample.stack.size);
+      counts[std::make_pair(merge_threads ? -1 : sample.thread_id,
+                            labels)]++;
+    }
+    return counts;
+  }
+
+  // The stacks recorded from the given thread, or from all threads if
+  // thread_id is -1.
+  std::vector<ProfilingStack> Stacks(int thread_id) const {
+    std::vector<ProfilingStack> stacks;
+    for (const ProfileSample& sample : samples) {
+      if (thread_id == -1 || sample.thread_id == thread_id) {
+        stacks.push_back(sample.stack);
+      }
+    }
+    return stacks;
+  }
+
+  std::vector<int> ThreadIds() const {
+    std::vector<int> thread_ids;
+    for (const ProfileSample& sample : samples) {
+      thread_ids.push_back(sample.thread_id);
+    }
+    std::sort(thread_ids.begin(), thread_ids.end());
+    thread_ids.erase(std::unique(thread_ids.begin(), thread_ids.end()),
+                     thread_ids.end());
+    return thread_ids;
+  }
+};
+
+// The interval between samples.
+inline int& ProfilerSamplingIntervalMicroseconds() {
 #if defined __arm__ || defined __aarch64__
   // Reduced sampling frequency on mobile devices helps limit time and memory
   // overhead there.
-  static const int interval = 10 * millisecond;
+  static int interval = 10000;
 #else
-  static const int interval = 1 * millisecond;
+  static int interval = 1000;
 #endif
+  return interval;
+}
 
+// This function is the only place that determines our sampling frequency.
+inline void WaitOneProfilerTick() {
+  const int interval = ProfilerSamplingIntervalMicroseconds();
   timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = interval;
+  ts.tv_sec = interval / 1000000;
+  ts.tv_nsec = (interval % 1000000) * 1000;
   nanosleep(&ts, nullptr);
 }
 
@@ -294,68 +486,72 @@ inline pthread_t& ProfilerThread() {
 }
 
 // Records a stack from a running thread.
-// The tricky part is that we're not interrupting the thread.
-// This is OK because we're looking at a pseudo-stack of labels,
-// not at the real thread stack, and if the pseudo-stack changes
-// while we're recording it, we are OK with getting either the
-// old or the new stack. Note that ProfilingStack::Pop
-// only decrements the size, and doesn't null the popped label,
-// so if we're concurrently recording it, it shouldn't change
-// under our feet until another label is pushed, at which point
-// we are OK with getting either this new label or the old one.
-// In the end, the key atomicity property that we are relying on
-// here is that pointers are changed atomically, and the labels
-// are pointers (to literal strings).
-inline void RecordStack(ThreadInfo* thread, ProfilingStack* dst) {
-  ScopedLock sl(thread->stack.lock);
+// The tricky part is that we're not interrupting the thread, so its
+// pseudo-stack may change while we're recording it. AtomicProfilingStack
+// is a seqlock, so we get either the old or the new stack, never a mix of
+// both. If the thread is in the middle of a change for too long, we get
+// no sample from it this time, which is what the return value says.
+inline bool RecordStack(ThreadInfo* thread, ProfilingStack* dst) {
   assert(!dst->size);
-  while (dst->size < thread->stack.size) {
-    dst->labels[dst->size] = thread->stack.labels[dst->size];
-    dst->size++;
-  }
+  return thread->stack.Read(dst);
+}
+
+// The profile being recorded by the profiler thread. It is only accessed
+// by the profiler thread until FinishProfiling has joined it.
+inline Profile& CurrentProfile() {
+  static Profile p;
+  return p;
 }
 
 // The profiler thread's entry point.
 // Note that a separate thread is to be started each time we call
 // StartProfiling(), and finishes when we call FinishProfiling().
-// So here we only need to handle the recording and reporting of
-// a single profile.
+// So here we only need to handle the recording of a single profile.
 inline void* ProfilerThreadFunc(void*) {
   assert(ProfilerThread() == pthread_self());
 
-  // Since we only handle one profile per profiler thread, the
-  // profile data (the array of recorded stacks) can be a local variable here.
-  std::vector<ProfilingStack> stacks;
+  std::vector<ProfileSample>& samples = CurrentProfile().samples;
 
   while (!ProfilerThreadShouldFinish()) {
     WaitOneProfilerTick();
     {
       ScopedLock sl(GlobalMutexes::Profiler());
       for (auto t : ThreadsUnderProfiling()) {
-        ProfilingStack s;
-        RecordStack(t, &s);
-        stacks.push_back(s);
+        ProfileSample sample;
+        sample.thread_id = t->id;
+        if (RecordStack(t, &sample.stack)) {
+          samples.push_back(sample);
+        }
       }
     }
   }
 
-  // Profiling is finished and we now report the results.
-  ProfileTreeView(stacks).Print();
-
   return nullptr;
 }
 
+// Sets the interval between samples. Must not be called while profiling.
+inline void SetProfilerSamplingInterval(int microseconds) {
+  ScopedLock sl(GlobalMutexes::Profiler());
+  ReleaseBuildAssertion(!IsProfiling(), "Can't change interval of profile");
+  ReleaseBuildAssertion(microseconds > 0, "Invalid sampling interval");
+  ProfilerSamplingIntervalMicroseconds() = microseconds;
+}
+
 // Starts recording samples.
 inline void StartProfiling() {
   ScopedLock sl(GlobalMutexes::Profiler());
   ReleaseBuildAssertion(!IsProfiling(), "We're already profiling!");
   IsProfiling() = true;
   ProfilerThreadShouldFinish() = false;
+  CurrentProfile() = Profile();
+  CurrentProfile().sampling_interval_us =
+      ProfilerSamplingIntervalMicroseconds();
   pthread_create(&ProfilerThread(), nullptr, ProfilerThreadFunc, nullptr);
 }
 
-// Stops recording samples, and prints a profile tree-view on stdout.
-inline void FinishProfiling() {
+// Stops recording samples, and moves them to *profile or, if profile is
+// null, prints a profile tree-view on stdout.
+inline void FinishProfiling(Profile* profile) {
   {
     ScopedLock sl(GlobalMutexes::Profiler());
     ReleaseBuildAssertion(IsProfiling(), "We weren't profiling!");
@@ -365,9 +561,79 @@ inline void FinishProfiling() {
     ProfilerThreadShouldFinish() = true;
   }  // must release the lock here to avoid deadlock with profiler thread.
   pthread_join(ProfilerThread(), nullptr);
+  {
+    ScopedLock sl(GlobalMutexes::Profiler());
+    CurrentProfile().thread_count =
+        static_cast<int>(ThreadsUnderProfiling().size());
+  }
+  if (profile) {
+    *profile = std::move(CurrentProfile());
+    CurrentProfile() = Profile();
+  } else {
+    CurrentProfile().Print();
+  }
   IsProfiling() = false;  // yikes, this should be guarded by the lock!
 }
 
+inline void FinishProfiling() { FinishProfiling(nullptr); }
+
+// The time at which tracing last started.
+inline std::uint64_t& TracingStartNanoseconds() {
+  static std::uint64_t t;
+  return t;
+}
+
+// Starts recording trace events.
+inline void StartTracing() {
+  ScopedLock sl(GlobalMutexes::Profiler());
+  ReleaseBuildAssertion(!IsTracing(), "We're already tracing!");
+  TracingStartNanoseconds() = TraceClockNanoseconds();
+  IsTracing() = true;
+}
+
+// Stops recording trace events. Scopes that began while tracing still
+// record their end.
+inline void StopTracing() {
+  ScopedLock sl(GlobalMutexes::Profiler());
+  ReleaseBuildAssertion(IsTracing(), "We weren't tracing!");
+  IsTracing() = false;
+}
+
+// Writes the trace events recorded since the last StartTracing to the
+// given file, in the Chrome trace event format. May be called while
+// tracing. Returns false if the file could not be written.
+inline bool WriteChromeTrace(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "{\"traceEvents\":[");
+  bool first = true;
+  {
+    ScopedLock sl(GlobalMutexes::Profiler());
+    const std::uint64_t start = TracingStartNanoseconds();
+    std::vector<TraceEvent> events;
+    for (auto t : ThreadsUnderTracing()) {
+      events.clear();
+      t->trace.Read(&events);
+      for (const TraceEvent& event : events) {
+        if (event.nanoseconds < start) {
+          continue;
+        }
+        fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+        WriteJsonString(file, event.label);
+        fprintf(file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                event.begin ? 'B' : 'E', 1e-3 * (event.nanoseconds - start),
+                t->id);
+        first = false;
+      }
+    }
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  const bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_PROFILING_PROFILER_H_
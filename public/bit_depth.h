@@ -30,6 +30,16 @@ struct OperandRange {
 using Uint8Range = OperandRange<0, 255>;
 using Uint8RangeExcludingZero = OperandRange<1, 255>;
 
+// Less-than-8-bit ranges. Values are still stored as std::uint8_t;
+// using one of these ranges is a promise made by the caller that all
+// entries of the corresponding matrix fall within it. No requantization
+// takes place: gemmlowp only uses this guarantee to select kernels that
+// can accumulate more products locally before overflowing.
+using Uint7Range = OperandRange<0, 127>;
+using Uint6Range = OperandRange<0, 63>;
+using Uint5Range = OperandRange<0, 31>;
+using Uint4Range = OperandRange<0, 15>;
+
 using Int8Range = OperandRange<-128, 127>;
 using Int8RangeExcludingLow = OperandRange<-127, 127>;
 
@@ -53,6 +63,20 @@ using L8R8WithLhsNonzeroBitDepthParams =
 using SignedL8R8WithLhsNonzeroBitDepthParams =
     BitDepthParams<Int8RangeExcludingLow, Int8Range>;
 
+// Less-than-8-bit variants. These are contracts, not requests: the caller
+// guarantees that the uint8 LHS/RHS entries are within the given ranges,
+// see doc/less-than-8-bit.md. Passing out-of-range values results in
+// unspecified (possibly overflowed) results.
+//
+// L7R7: each product fits in 14 bits.
+using L7R7BitDepthParams = BitDepthParams<Uint7Range, Uint7Range>;
+// L6R6: each product fits in 12 bits, which allows e.g.
+// NEON_32_Kernel12x4Depth2Assuming12BitProducts.
+using L6R6BitDepthParams = BitDepthParams<Uint6Range, Uint6Range>;
+// L4R8: 4-bit LHS (e.g. weights) times 8-bit RHS (e.g. activations).
+// Each product fits in 12 bits.
+using L4R8BitDepthParams = BitDepthParams<Uint4Range, Uint8Range>;
+
 // Deprecated: when gemmlowp used to allow requantizing 8bit
 // inputs to less-than-8-bit depths, the public setting allowing
 // that was DefaultL7R5BitDepthParams. That requantization
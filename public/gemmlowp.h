@@ -16,7 +16,10 @@
 
 #ifndef GEMMLOWP_PUBLIC_GEMMLOWP_H_
 #define GEMMLOWP_PUBLIC_GEMMLOWP_H_
+#include <vector>
+
 #include "../internal/dispatch_gemm_shape.h"
+#include "../internal/fixed_shape_gemm.h"
 #include "bit_depth.h"
 #include "map.h"
 #include "output_stages.h"
@@ -42,6 +45,29 @@ void GemmWithOutputPipelinePC(GemmContextType* context,
       context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
 }
 
+// Variant of GemmWithOutputPipelinePC with a 4-bit LHS, typically the weights
+// in an inference workload, stored as nibbles, two per byte, see
+// NibbleMatrixMap. The RHS is an ordinary uint8 matrix. The 4-bit entries are
+// expanded to bytes while packing the LHS, and in the matrix*vector case
+// (rhs.cols() == 1) they are read directly without packing. A natural choice
+// of BitDepthParams here is L4R8BitDepthParams.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void GemmWithOutputPipelinePC(GemmContextType* context,
+                              const NibbleMatrixMap<LhsOrder>& lhs,
+                              const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                              MatrixMap<OutputScalar, ResultOrder>* result,
+                              const LhsOffset& lhs_offset,
+                              const RhsOffset& rhs_offset,
+                              const OutputPipelineType& output_pipeline) {
+  static_assert(std::is_same<InputScalar, std::uint8_t>::value,
+                "4-bit LHS matrices require a uint8 RHS");
+  DispatchGemmShape<InputScalar, OutputScalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+}
+
 // Computes a general matrix product ("GEMM").
 // This is the legacy version that does not support per channel quantization.
 // The meaning of the offsets, result_mult_int and result_shift
@@ -65,6 +91,260 @@ void GemmWithOutputPipeline(GemmContextType* context,
       output_pipeline);
 }
 
+// Variant of GemmWithOutputPipeline with a 4-bit LHS, see above.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+void GemmWithOutputPipeline(GemmContextType* context,
+                            const NibbleMatrixMap<LhsOrder>& lhs,
+                            const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                            MatrixMap<OutputScalar, ResultOrder>* result,
+                            int lhs_offset, int rhs_offset,
+                            const OutputPipelineType& output_pipeline) {
+  typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+  typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+  const OffsetColDup lhs_offset_vector(lhs_offset, lhs.rows());
+  const OffsetRowDup rhs_offset_vector(rhs_offset, rhs.cols());
+  GemmWithOutputPipelinePC<InputScalar, OutputScalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset_vector, rhs_offset_vector,
+      output_pipeline);
+}
+
+// Variant of GemmWithOutputPipelinePC for GEMMs whose shape, Rows x Depth
+// x Cols, is known at compile time, typically small shapes run very many
+// times. The block sizes are then computed at compile time, see
+// internal/fixed_shape_gemm.h. The maps must have that shape. These GEMMs
+// are single-threaded and block for the default cache sizes, ignoring the
+// context's cache settings, thread count and tuning table. With a scratch
+// arena, size it with FixedShapeGemmScratchSize, not GemmScratchSize.
+template <int Rows, int Depth, int Cols, typename InputScalar,
+          typename OutputScalar, typename BitDepthParams, MapOrder LhsOrder,
+          MapOrder RhsOrder, MapOrder ResultOrder, typename LhsOffset,
+          typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void GemmFixedShapePC(GemmContextType* context,
+                      const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                      const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                      MatrixMap<OutputScalar, ResultOrder>* result,
+                      const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  DispatchFixedShapeGemm<Rows, Depth, Cols, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline,
+      std::integral_constant<bool, (Rows < Cols)>());
+}
+
+// Variant of GemmFixedShapePC with scalar offsets, like
+// GemmWithOutputPipeline.
+template <int Rows, int Depth, int Cols, typename InputScalar,
+          typename OutputScalar, typename BitDepthParams, MapOrder LhsOrder,
+          MapOrder RhsOrder, MapOrder ResultOrder, typename OutputPipelineType,
+          typename GemmContextType>
+void GemmFixedShape(GemmContextType* context,
+                    const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                    MatrixMap<OutputScalar, ResultOrder>* result,
+                    int lhs_offset, int rhs_offset,
+                    const OutputPipelineType& output_pipeline) {
+  typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+  typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+  const OffsetColDup lhs_offset_vector(lhs_offset, Rows);
+  const OffsetRowDup rhs_offset_vector(rhs_offset, Cols);
+  GemmFixedShapePC<Rows, Depth, Cols, InputScalar, OutputScalar,
+                   BitDepthParams>(context, lhs, rhs, result,
+                                   lhs_offset_vector, rhs_offset_vector,
+                                   output_pipeline);
+}
+
+// Computes the product of an int8 LHS, typically the weights, by an int16
+// RHS, typically activations needing more than 8 bits of precision. Offsets
+// and the output pipeline have the same meaning as in
+// GemmWithOutputPipelinePC. Accumulation is in int32, so the
+// offset-adjusted products summed over the depth must fit in int32.
+template <typename OutputScalar, MapOrder LhsOrder, MapOrder RhsOrder,
+          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType, typename GemmContextType>
+void Int8Int16GemmWithOutputPipelinePC(
+    GemmContextType* context, const MatrixMap<const std::int8_t, LhsOrder>& lhs,
+    const MatrixMap<const std::int16_t, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  DispatchGemmShape<std::int16_t, OutputScalar, DefaultL8R8BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+}
+
+// Computes a matrix product of binary or ternary bit-packed matrices,
+// see BitPackedMatrixMap. The LHS is RowMajor and the RHS ColMajor, so that
+// both are bit-packed along the depth dimension. The products are exact int32
+// dot products of {-1, +1} (Binary) or {-1, 0, +1} (Ternary) values, which
+// are then fed to the output pipeline; there are no offsets. With a scratch
+// arena, size it with BitPackedGemmScratchSize.
+template <typename OutputScalar, BitEncoding Encoding, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+void BitPackedGemmWithOutputPipeline(
+    GemmContextType* context,
+    const BitPackedMatrixMap<Encoding, MapOrder::RowMajor>& lhs,
+    const BitPackedMatrixMap<Encoding, MapOrder::ColMajor>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result,
+    const OutputPipelineType& output_pipeline) {
+  typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+  typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+  const OffsetColDup lhs_offset_vector(0, lhs.rows());
+  const OffsetRowDup rhs_offset_vector(0, rhs.cols());
+  DispatchGemmShape<std::uint8_t, OutputScalar, DefaultL8R8BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset_vector, rhs_offset_vector,
+      output_pipeline);
+}
+
+// Computes the float product of uint8 quantized weights by float
+// activations. The real value of the LHS entry (r, d) is
+// lhs_scale(r) * (lhs(r, d) + lhs_offset(r)). The RHS is quantized to uint8
+// while it is packed, each column with its own scale and zero point derived
+// from its range of values. The int32 accumulators are then dequantized by
+// an OutputStageScaleInt32ToFloat stage, so that the RHS is only read once
+// and neither a quantized copy of it nor an int32 result is materialized.
+// The scales and zero points of the RHS columns are kept in the context's
+// scratch storage; see HybridFloatGemmScratchSize.
+template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename GemmContextType>
+void HybridFloatGemm(GemmContextType* context,
+                     const MatrixMap<const std::uint8_t, LhsOrder>& lhs,
+                     const LhsOffset& lhs_offset,
+                     const VectorMap<const float, VectorShape::Col>& lhs_scale,
+                     const MatrixMap<const float, RhsOrder>& rhs,
+                     MatrixMap<float, ResultOrder>* result) {
+  assert(lhs.cols() == rhs.rows());
+  assert(lhs_scale.size() == lhs.rows());
+  Allocator* allocator = context->allocator();
+  const Allocator::Handle rhs_scales_handle =
+      allocator->Reserve<float>(rhs.cols());
+  const Allocator::Handle rhs_offsets_handle =
+      allocator->Reserve<std::int32_t>(rhs.cols());
+  allocator->Commit();
+  float* rhs_scales = allocator->GetPointer<float>(rhs_scales_handle);
+  std::int32_t* rhs_offsets =
+      allocator->GetPointer<std::int32_t>(rhs_offsets_handle);
+  const QuantizingFloatMatrixMap<RhsOrder, VectorShape::Row> quantizing_rhs(
+      rhs.data(), rhs.rows(), rhs.cols(), rhs.stride(), rhs_scales,
+      rhs_offsets);
+  // Both vectors are filled by the packing of the RHS, before any part of
+  // the result that depends on them is unpacked.
+  const VectorMap<const std::int32_t, VectorShape::Row> rhs_offset(
+      rhs_offsets, rhs.cols());
+  OutputStageScaleInt32ToFloat scale_stage;
+  scale_stage.row_scale = lhs_scale;
+  scale_stage.col_scale =
+      VectorMap<const float, VectorShape::Row>(rhs_scales, rhs.cols());
+  DispatchGemmShape<std::uint8_t, float, DefaultL8R8BitDepthParams>(
+      context, lhs, quantizing_rhs, result, lhs_offset, rhs_offset,
+      std::make_tuple(scale_stage));
+  allocator->Decommit();
+}
+
+// Returns the scratch memory that GemmWithOutputPipeline and
+// GemmWithOutputPipelinePC need for a GEMM of the given shape, given the
+// context's current settings (max_num_threads, cache sizes). This is what
+// GemmContext::set_scratch_arena must provide for GEMMs of that shape to
+// run without allocating memory; see MaxScratchSize to cover several shapes.
+template <typename BitDepthParams, typename GemmContextType>
+ScratchSize GemmScratchSize(const GemmContextType* context, int rows,
+                            int depth, int cols) {
+  // DispatchGemmShape computes products with rows < cols transposed.
+  if (rows < cols) {
+    std::swap(rows, cols);
+  }
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  return MultiThreadGemmScratchSize<typename Kernel::Format>(context, rows,
+                                                             cols, depth);
+}
+
+// Like GemmScratchSize, for BitPackedGemmWithOutputPipeline with the given
+// encoding; depth is in entries, not in words.
+template <BitEncoding Encoding, typename GemmContextType>
+ScratchSize BitPackedGemmScratchSize(const GemmContextType* context, int rows,
+                                     int depth, int cols) {
+  // DispatchGemmShape computes products with rows < cols transposed.
+  if (rows < cols) {
+    std::swap(rows, cols);
+  }
+  return BitPackedGemmImplScratchSize<Encoding>(context, rows, cols, depth);
+}
+
+// Like GemmScratchSize, for GemmFixedShape and GemmFixedShapePC. These
+// block for the default cache sizes, whatever the context's settings, so
+// the size only depends on the shape. Combine it with MaxScratchSize.
+template <int Rows, int Depth, int Cols, typename BitDepthParams>
+ScratchSize FixedShapeGemmScratchSize() {
+  // DispatchFixedShapeGemm computes products with Rows < Cols transposed.
+  typedef typename DefaultKernel<BitDepthParams>::Format KernelFormat;
+  typedef FixedShapeBlockParams<KernelFormat, ConstexprMax(Rows, Cols), Depth,
+                                (Rows < Cols ? Rows : Cols)>
+      Params;
+  return FixedShapeGemmImplScratchSize<KernelFormat, Params>();
+}
+
+// Like GemmScratchSize, for HybridFloatGemm, which also keeps the scales
+// and zero points of the RHS columns in the calling thread's scratch.
+template <typename GemmContextType>
+ScratchSize HybridFloatGemmScratchSize(const GemmContextType* context,
+                                       int rows, int depth, int cols) {
+  // DispatchGemmShape computes products with rows < cols transposed, and
+  // the quantizing RHS then becomes the LHS, which is packed over the whole
+  // depth (see CanPackLhsDepthBlocks).
+  const bool transposed = rows < cols;
+  typedef DefaultKernel<DefaultL8R8BitDepthParams> Kernel;
+  ScratchSize size = MultiThreadGemmScratchSize<typename Kernel::Format>(
+      context, transposed ? cols : rows, transposed ? rows : cols, depth,
+      !transposed);
+  Allocator allocator;
+  allocator.Reserve<float>(cols);
+  allocator.Reserve<std::int32_t>(cols);
+  size.main_bytes += allocator.reserved_bytes();
+  allocator.DiscardReservations();
+  return size;
+}
+
+// The shape of a GEMM: the result has rows x cols entries, and depth is
+// the number of columns of the LHS and rows of the RHS.
+struct GemmShape {
+  int rows;
+  int depth;
+  int cols;
+};
+
+// Prepares the context for GEMMs of the given shapes, so that the first
+// one does not pay for the creation of the worker threads and for page
+// faults in freshly allocated scratch storage. The thread count is the
+// context's max_num_threads(), so set it first. If run_gemms is true, also
+// computes a GEMM of each shape on zeros, which brings the code into the
+// instruction cache, though only that of the empty output pipeline.
+template <typename BitDepthParams, typename GemmContextType>
+void GemmWarmUp(GemmContextType* context, const std::vector<GemmShape>& shapes,
+                bool run_gemms) {
+  ScratchSize size;
+  for (const GemmShape& shape : shapes) {
+    size = MaxScratchSize(size, GemmScratchSize<BitDepthParams>(
+                                    context, shape.rows, shape.depth,
+                                    shape.cols));
+  }
+  context->WarmUp(size);
+  if (!run_gemms) {
+    return;
+  }
+  for (const GemmShape& shape : shapes) {
+    std::vector<std::uint8_t> lhs(shape.rows * shape.depth);
+    std::vector<std::uint8_t> rhs(shape.depth * shape.cols);
+    std::vector<std::int32_t> result(shape.rows * shape.cols);
+    MatrixMap<const std::uint8_t, MapOrder::RowMajor> lhs_map(
+        lhs.data(), shape.rows, shape.depth);
+    MatrixMap<const std::uint8_t, MapOrder::ColMajor> rhs_map(
+        rhs.data(), shape.depth, shape.cols);
+    MatrixMap<std::int32_t, MapOrder::ColMajor> result_map(
+        result.data(), shape.rows, shape.cols);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t, BitDepthParams>(
+        context, lhs_map, rhs_map, &result_map, 0, 0, std::make_tuple());
+  }
+}
+
 // Computes a general matrix product ("GEMM").
 // The meaning of the offsets, result_mult_int and result_shift
 // parameters is the same as in the standard EightBitIntGemm interface
@@ -76,6 +76,175 @@ class MatrixMap {
   }
 };
 
+// A NibbleMatrixMap is a view of an existing buffer of 4-bit unsigned
+// values, packed two per byte, as a matrix of values in [0, 15].
+//
+// Entries are addressed by a linear 'nibble index', which is computed
+// exactly like the element index in a MatrixMap of the same storage order:
+// (row, col) is at index col * stride + row in a ColMajor map, and at
+// index row * stride + col in a RowMajor map, the stride being counted in
+// nibbles. The nibble of index i is stored in the byte data[i / 2]:
+// in its low 4 bits if i is even, in its high 4 bits if i is odd.
+// In particular, consecutive entries along a row (RowMajor) or column
+// (ColMajor) share bytes, so a 4-bit matrix takes half the storage of the
+// equivalent uint8 matrix.
+//
+// This is only meant to be used as the LHS or RHS of a GEMM: unlike
+// MatrixMap, it offers no pointer to individual entries, and can't be
+// written to.
+template <MapOrder tOrder>
+class NibbleMatrixMap {
+ public:
+  typedef std::uint8_t Scalar;
+  static constexpr MapOrder kOrder = tOrder;
+
+ protected:
+  const std::uint8_t* data_;  // not owned.
+  int start_index_;  // nibble index of the (0, 0) entry.
+  int rows_, cols_, stride_;
+
+ public:
+  NibbleMatrixMap(const std::uint8_t* data, int rows, int cols)
+      : data_(data),
+        start_index_(0),
+        rows_(rows),
+        cols_(cols),
+        stride_(kOrder == MapOrder::ColMajor ? rows : cols) {}
+  NibbleMatrixMap(const std::uint8_t* data, int rows, int cols, int stride)
+      : data_(data),
+        start_index_(0),
+        rows_(rows),
+        cols_(cols),
+        stride_(stride) {}
+  NibbleMatrixMap(const std::uint8_t* data, int start_index, int rows,
+                  int cols, int stride)
+      : data_(data),
+        start_index_(start_index),
+        rows_(rows),
+        cols_(cols),
+        stride_(stride) {}
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int stride() const { return stride_; }
+  int rows_stride() const { return kOrder == MapOrder::ColMajor ? 1 : stride_; }
+  int cols_stride() const { return kOrder == MapOrder::RowMajor ? 1 : stride_; }
+  // The base buffer pointer, and the nibble index of the (0, 0) entry in it.
+  const std::uint8_t* data() const { return data_; }
+  int start_index() const { return start_index_; }
+  int index(int row, int col) const {
+    return start_index_ + row * rows_stride() + col * cols_stride();
+  }
+  std::uint8_t operator()(int row, int col) const {
+    const int i = index(row, col);
+    return (data_[i >> 1] >> ((i & 1) * 4)) & 0xf;
+  }
+
+  NibbleMatrixMap block(int start_row, int start_col, int block_rows,
+                        int block_cols) const {
+    assert(start_row >= 0);
+    assert(start_row + block_rows <= rows_);
+    assert(start_col >= 0);
+    assert(start_col + block_cols <= cols_);
+
+    return NibbleMatrixMap(data_, index(start_row, start_col), block_rows,
+                           block_cols, stride_);
+  }
+};
+
+// How entries are encoded in a BitPackedMatrixMap.
+enum class BitEncoding {
+  // One bit per entry, representing a value in {-1, +1}:
+  // a set bit means +1, a clear bit means -1.
+  Binary,
+  // Two bits per entry, representing a value in {-1, 0, +1}:
+  // a 'nonzero' bit, and a 'sign' bit which is set for -1 and
+  // only matters if the nonzero bit is set.
+  Ternary
+};
+
+// A BitPackedMatrixMap is a view of an existing buffer of 64-bit words
+// holding a binary or ternary matrix, bit-packed along rows (RowMajor) or
+// columns (ColMajor). We call 'lines' the rows of a RowMajor map and the
+// columns of a ColMajor map.
+//
+// Each line is stored as groups of 64 consecutive entries, entry i of a group
+// being bit i of the group's words. A group takes one word in the Binary
+// encoding; in the Ternary encoding it takes two consecutive words: first the
+// nonzero bits, then the sign bits. Line n starts at data + n * stride, the
+// stride being counted in words. Bits beyond the end of a line are ignored.
+//
+// This is only meant to be used as an operand of
+// BitPackedGemmWithOutputPipeline (see gemmlowp.h), as the RowMajor LHS or the
+// ColMajor RHS, which is the layout where both operands are bit-packed along
+// the depth dimension.
+template <BitEncoding tEncoding, MapOrder tOrder>
+class BitPackedMatrixMap {
+ public:
+  static constexpr BitEncoding kEncoding = tEncoding;
+  static constexpr MapOrder kOrder = tOrder;
+  static constexpr int kWordsPerGroup =
+      tEncoding == BitEncoding::Binary ? 1 : 2;
+
+  // The number of words needed to store a line of the given length.
+  static int WordsPerLine(int line_length) {
+    return kWordsPerGroup * ((line_length + 63) / 64);
+  }
+
+ protected:
+  const std::uint64_t* data_;  // not owned.
+  int rows_, cols_, stride_;
+
+ public:
+  BitPackedMatrixMap(const std::uint64_t* data, int rows, int cols)
+      : data_(data),
+        rows_(rows),
+        cols_(cols),
+        stride_(WordsPerLine(kOrder == MapOrder::RowMajor ? cols : rows)) {}
+  BitPackedMatrixMap(const std::uint64_t* data, int rows, int cols, int stride)
+      : data_(data), rows_(rows), cols_(cols), stride_(stride) {}
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int stride() const { return stride_; }
+  int line_length() const {
+    return kOrder == MapOrder::RowMajor ? cols_ : rows_;
+  }
+  const std::uint64_t* data() const { return data_; }
+  const std::uint64_t* line(int n) const { return data_ + n * stride_; }
+
+  // Returns the value of the (row, col) entry, in {-1, 0, +1}. Slow; mostly
+  // useful for testing.
+  int operator()(int row, int col) const {
+    const int n = kOrder == MapOrder::RowMajor ? row : col;
+    const int i = kOrder == MapOrder::RowMajor ? col : row;
+    const std::uint64_t* group = line(n) + (i / 64) * kWordsPerGroup;
+    const int bit = (group[0] >> (i % 64)) & 1;
+    if (kEncoding == BitEncoding::Binary) {
+      return bit ? 1 : -1;
+    }
+    const int sign = (group[1] >> (i % 64)) & 1;
+    return bit ? (sign ? -1 : 1) : 0;
+  }
+
+  // Blocks must start at a group boundary along lines.
+  BitPackedMatrixMap block(int start_row, int start_col, int block_rows,
+                           int block_cols) const {
+    assert(start_row >= 0);
+    assert(start_row + block_rows <= rows_);
+    assert(start_col >= 0);
+    assert(start_col + block_cols <= cols_);
+    const int start_line = kOrder == MapOrder::RowMajor ? start_row : start_col;
+    const int start_in_line =
+        kOrder == MapOrder::RowMajor ? start_col : start_row;
+    assert(start_in_line % 64 == 0);
+
+    return BitPackedMatrixMap(
+        line(start_line) + (start_in_line / 64) * kWordsPerGroup, block_rows,
+        block_cols, stride_);
+  }
+};
+
 enum class VectorShape { Col, Row };
 
 // A VectorMap is a view of an existing buffer as a vector. It does not own
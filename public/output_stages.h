@@ -199,6 +199,15 @@ struct OutputStageClamp {
   std::int32_t max;
 };
 
+// This output stage takes int32 values and returns float values: each entry
+// is multiplied by the product of the scale of its row and the scale of its
+// column. This dequantizes the result of a product of matrices quantized
+// with per-row (LHS) and per-column (RHS) scales, see HybridFloatGemm.
+struct OutputStageScaleInt32ToFloat {
+  VectorMap<const float, VectorShape::Col> row_scale;
+  VectorMap<const float, VectorShape::Row> col_scale;
+};
+
 struct OutputStageTanh {
   std::int32_t real_zero_as_int32;
   std::int32_t real_amplitude_as_int32;
@@ -0,0 +1,127 @@
+// Compares gemmlowp's performance with the compile-time default cache sizes
+// (kDefaultL1CacheSize, kDefaultL2CacheSize) against the cache sizes
+// detected at runtime (GemmContext::UseDetectedCacheSizes), printing the
+// block parameters that each choice leads to.
+//
+// Build, from this directory:
+//   c++ -std=c++11 -O3 -march=native -pthread cache_sizes.cc -o cache_sizes
+//
+// Environment variables:
+//   THREADS: number of threads passed to set_max_num_threads (default 1).
+//   DUMP_CSV: if set, print one CSV line per size instead of a table.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../public/gemmlowp.h"
+
+struct GemmData {
+  int size;
+  std::vector<std::uint8_t> lhs, rhs, result;
+
+  explicit GemmData(int n)
+      : size(n), lhs(n * n), rhs(n * n), result(n * n) {
+    std::default_random_engine random_engine;
+    for (int i = 0; i < n * n; i++) {
+      lhs[i] = random_engine();
+      rhs[i] = random_engine();
+    }
+  }
+
+  void Run(gemmlowp::GemmContext* context) {
+    using gemmlowp::MapOrder;
+    const gemmlowp::MatrixMap<const std::uint8_t, MapOrder::RowMajor> lhs_map(
+        lhs.data(), size, size);
+    const gemmlowp::MatrixMap<const std::uint8_t, MapOrder::ColMajor> rhs_map(
+        rhs.data(), size, size);
+    gemmlowp::MatrixMap<std::uint8_t, MapOrder::ColMajor> result_map(
+        result.data(), size, size);
+    gemmlowp::GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                                     gemmlowp::DefaultL8R8BitDepthParams>(
+        context, lhs_map, rhs_map, &result_map, -128, -128,
+        gemmlowp::MakeStandardOutputPipeline(0, 1, 16));
+  }
+};
+
+// Returns Gop/s, after a warm-up run.
+double Measure(GemmData* data, gemmlowp::GemmContext* context) {
+  const double macs = static_cast<double>(data->size) * data->size * data->size;
+  // Aim for about 1e10 multiply-adds per measurement.
+  const int iters = std::max(1, static_cast<int>(1e10 / macs));
+  data->Run(context);
+  const auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < iters; i++) {
+    data->Run(context);
+  }
+  const auto t1 = std::chrono::steady_clock::now();
+  return 2e-9 * macs * iters / std::chrono::duration<double>(t1 - t0).count();
+}
+
+void Study(int size, int threads) {
+  typedef gemmlowp::DefaultKernel<gemmlowp::DefaultL8R8BitDepthParams>::Format
+      KernelFormat;
+  GemmData data(size);
+  for (bool detected : {false, true}) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(threads);
+    if (detected) {
+      context.UseDetectedCacheSizes();
+    }
+    gemmlowp::BlockParams block_params;
+    block_params.Init<KernelFormat>(
+        size, size, size, threads, context.l1_bytes_to_use(),
+        context.l2_bytes_to_use(), context.l2_rhs_factor(),
+        context.l3_bytes_to_use());
+    const double gops = Measure(&data, &context);
+    if (getenv("DUMP_CSV")) {
+      printf("%d,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.3f\n", size,
+             detected ? "detected" : "default", context.l1_bytes_to_use(),
+             context.l2_bytes_to_use(), context.l3_bytes_to_use(),
+             block_params.l1_rows, block_params.l1_depth,
+             block_params.l1_cols, block_params.l2_rows,
+             block_params.l2_depth, block_params.l2_cols,
+             block_params.l3_cols, gops);
+    } else {
+      printf(
+          "%5d  %-8s  %8d  %9d  %10d  %5dx%5dx%5d  %5dx%5dx%5d  %7d  %8.3f\n",
+          size, detected ? "detected" : "default", context.l1_bytes_to_use(),
+          context.l2_bytes_to_use(), context.l3_bytes_to_use(),
+          block_params.l1_rows, block_params.l1_depth, block_params.l1_cols,
+          block_params.l2_rows, block_params.l2_depth, block_params.l2_cols,
+          block_params.l3_cols, gops);
+    }
+    fflush(stdout);
+  }
+}
+
+int main() {
+  const char* threads_env = getenv("THREADS");
+  const int threads = threads_env ? atoi(threads_env) : 1;
+  const gemmlowp::CacheSizes& sizes = gemmlowp::DetectCacheSizes();
+  if (!sizes.detected()) {
+    fprintf(stderr, "Could not detect the cache sizes.\n");
+    return 1;
+  }
+  if (getenv("DUMP_CSV")) {
+    printf(
+        "size,cache_sizes,l1_bytes,l2_bytes,l3_bytes,l1_rows,l1_depth,l1_cols,"
+        "l2_rows,l2_depth,l2_cols,l3_cols,gops\n");
+  } else {
+    for (int level = 1; level <= gemmlowp::CacheSizes::kMaxLevel; level++) {
+      const gemmlowp::CacheLevelInfo& info = sizes.levels[level - 1];
+      printf("L%d: %d bytes shared by %d CPUs, %d bytes per core\n", level,
+             info.bytes, info.shared_cpus, sizes.PerCoreBytes(level));
+    }
+    printf("%d thread(s); block sizes are rows x depth x cols.\n", threads);
+    printf("%5s  %-8s  %8s  %9s  %10s  %17s  %17s  %7s  %8s\n", "size",
+           "caches", "l1_bytes", "l2_bytes", "l3_bytes", "l1_block",
+           "l2_block", "l3_cols", "Gop/s");
+  }
+  for (int size = 128; size <= 2048; size *= 2) {
+    Study(size, threads);
+  }
+}
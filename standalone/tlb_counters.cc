@@ -0,0 +1,218 @@
+// Measures dTLB misses in gemmlowp GEMMs, with and without huge-page backed
+// Allocator storage (GemmContext::set_use_huge_pages), using perf_event
+// like cache_counters.cc. Unlike cache_counters.cc, this uses the generic
+// perf hardware cache events, so it runs on any Linux host whose PMU exposes
+// them (x86-64, arm64), not only on 64-bit ARM.
+//
+// Build, from this directory:
+//   c++ -std=c++11 -O3 -march=native -pthread tlb_counters.cc -o tlb_counters
+//
+// Environment variables:
+//   THREADS: number of threads passed to set_max_num_threads (default 1).
+//   DUMP_CSV: if set, print one CSV line per size instead of a table.
+//
+// Transparent huge pages must be enabled in "madvise" or "always" mode
+// (/sys/kernel/mm/transparent_hugepage/enabled) for the huge-page runs to
+// make a difference, unless a pool of explicit huge pages has been reserved.
+
+#include <asm/unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../public/gemmlowp.h"
+
+#ifndef __linux__
+#error This program is for Linux only.
+#endif
+
+struct PerfEvent {
+  perf_event_attr pe;
+  int fd = -1;
+
+  PerfEvent(std::uint32_t type, std::uint64_t config) {
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = type;
+    pe.config = config;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    // Count in the worker threads too.
+    pe.inherit = 1;
+    fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+    static bool warned = false;
+    if (fd == -1 && !warned) {
+      fprintf(stderr,
+              "perf_event_open failed for type %u config 0x%llx, "
+              "reporting -1\n",
+              type, static_cast<unsigned long long>(config));
+      warned = true;
+    }
+  }
+
+  void Start() {
+    if (fd == -1) {
+      return;
+    }
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  std::int64_t Stop() {
+    if (fd == -1) {
+      return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    std::int64_t count = 0;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+      return -1;
+    }
+    return count;
+  }
+
+  ~PerfEvent() {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+};
+
+struct HwCacheEvent : PerfEvent {
+  HwCacheEvent(std::uint64_t cache, std::uint64_t op, std::uint64_t result)
+      : PerfEvent(PERF_TYPE_HW_CACHE, cache | (op << 8) | (result << 16)) {}
+};
+
+struct TlbCounts {
+  std::int64_t dtlb_loads = 0;
+  std::int64_t dtlb_load_misses = 0;
+  std::int64_t dtlb_store_misses = 0;
+  std::int64_t cycles = 0;
+  double seconds = 0;
+};
+
+struct GemmData {
+  int size;
+  std::vector<std::uint8_t> lhs, rhs, result;
+
+  explicit GemmData(int n)
+      : size(n), lhs(n * n), rhs(n * n), result(n * n) {
+    std::default_random_engine random_engine;
+    for (int i = 0; i < n * n; i++) {
+      lhs[i] = random_engine();
+      rhs[i] = random_engine();
+    }
+  }
+
+  void Run(gemmlowp::GemmContext* context) {
+    using gemmlowp::MapOrder;
+    const gemmlowp::MatrixMap<const std::uint8_t, MapOrder::RowMajor> lhs_map(
+        lhs.data(), size, size);
+    const gemmlowp::MatrixMap<const std::uint8_t, MapOrder::ColMajor> rhs_map(
+        rhs.data(), size, size);
+    gemmlowp::MatrixMap<std::uint8_t, MapOrder::ColMajor> result_map(
+        result.data(), size, size);
+    gemmlowp::GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                                     gemmlowp::DefaultL8R8BitDepthParams>(
+        context, lhs_map, rhs_map, &result_map, -128, -128,
+        gemmlowp::MakeStandardOutputPipeline(0, 1, 16));
+  }
+};
+
+void MeasureTlbCounts(GemmData* data, gemmlowp::GemmContext* context,
+                      int iters, TlbCounts* counts) {
+  HwCacheEvent dtlb_loads(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                          PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+  HwCacheEvent dtlb_load_misses(PERF_COUNT_HW_CACHE_DTLB,
+                                PERF_COUNT_HW_CACHE_OP_READ,
+                                PERF_COUNT_HW_CACHE_RESULT_MISS);
+  HwCacheEvent dtlb_store_misses(PERF_COUNT_HW_CACHE_DTLB,
+                                 PERF_COUNT_HW_CACHE_OP_WRITE,
+                                 PERF_COUNT_HW_CACHE_RESULT_MISS);
+  PerfEvent cycles(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+
+  // Warm-up: allocates the storage and starts the worker threads, so that
+  // neither is measured. Transparent huge pages are also only populated
+  // on first touch.
+  data->Run(context);
+
+  dtlb_loads.Start();
+  dtlb_load_misses.Start();
+  dtlb_store_misses.Start();
+  cycles.Start();
+  const auto t0 = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < iters; i++) {
+    data->Run(context);
+  }
+
+  const auto t1 = std::chrono::steady_clock::now();
+  counts->dtlb_loads = dtlb_loads.Stop();
+  counts->dtlb_load_misses = dtlb_load_misses.Stop();
+  counts->dtlb_store_misses = dtlb_store_misses.Stop();
+  counts->cycles = cycles.Stop();
+  counts->seconds = std::chrono::duration<double>(t1 - t0).count();
+}
+
+// Per-GEMM averages, -1 meaning that the counter is unavailable.
+double PerIter(std::int64_t count, int iters) {
+  return count < 0 ? -1. : static_cast<double>(count) / iters;
+}
+
+void Study(int size, int threads) {
+  GemmData data(size);
+  // Aim for about 1e10 multiply-adds per measurement.
+  const double macs = static_cast<double>(size) * size * size;
+  const int iters = std::max(1, static_cast<int>(1e10 / macs));
+
+  for (bool use_huge_pages : {false, true}) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(threads);
+    context.set_use_huge_pages(use_huge_pages);
+    TlbCounts counts;
+    MeasureTlbCounts(&data, &context, iters, &counts);
+    const double gops = 2e-9 * macs * iters / counts.seconds;
+    const double misses = PerIter(counts.dtlb_load_misses, iters);
+    const double misses_per_mmac =
+        misses < 0 ? -1. : misses / (macs * 1e-6);
+    if (getenv("DUMP_CSV")) {
+      printf("%d,%d,%.3f,%.0f,%.0f,%.0f,%.3f\n", size, use_huge_pages, gops,
+             PerIter(counts.dtlb_loads, iters), misses,
+             PerIter(counts.dtlb_store_misses, iters), misses_per_mmac);
+    } else {
+      printf(
+          "%5d  %-10s  %8.3f  %14.0f  %14.0f  %14.0f  %12.3f  %14.0f\n", size,
+          use_huge_pages ? "huge" : "regular", gops,
+          PerIter(counts.dtlb_loads, iters), misses,
+          PerIter(counts.dtlb_store_misses, iters), misses_per_mmac,
+          PerIter(counts.cycles, iters));
+    }
+    fflush(stdout);
+  }
+}
+
+int main() {
+  const char* threads_env = getenv("THREADS");
+  const int threads = threads_env ? atoi(threads_env) : 1;
+  if (getenv("DUMP_CSV")) {
+    printf(
+        "size,huge_pages,gops,dtlb_loads,dtlb_load_misses,dtlb_store_misses,"
+        "dtlb_load_misses_per_mmac\n");
+  } else {
+    printf("Per-GEMM averages, %d thread(s); -1 means unavailable.\n",
+           threads);
+    printf("%5s  %-10s  %8s  %14s  %14s  %14s  %12s  %14s\n", "size",
+           "storage", "Gop/s", "dtlb_loads", "dtlb_ld_miss", "dtlb_st_miss",
+           "ld_miss/Mmac", "cycles");
+  }
+  for (int size = 128; size <= 2048; size *= 2) {
+    Study(size, threads);
+  }
+}
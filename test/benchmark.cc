@@ -18,6 +18,7 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <map>
@@ -26,6 +27,7 @@
 #include <TargetConditionals.h>
 #endif
 
+#include "benchmark_shapes.h"
 #include "test.h"
 
 #ifndef GEMMLOWP_TEST_BIT_DEPTH_PARAMS
@@ -61,6 +63,14 @@ struct gemm_t {
   gemm_t(int r, int d, int c) : rows(r), depth(d), cols(c) {}
 };
 
+std::vector<gemm_t> to_gemms(const std::vector<BenchmarkShape>& shapes) {
+  std::vector<gemm_t> gemms;
+  for (const BenchmarkShape& shape : shapes) {
+    gemms.emplace_back(shape.rows, shape.depth, shape.cols);
+  }
+  return gemms;
+}
+
 bool operator<(const gemm_t& a, const gemm_t& b) {
   return a.rows < b.rows ||
          (a.rows <= b.rows &&
@@ -150,21 +160,8 @@ double gflops_for_gemms(GemmContext* context,
 void benchmark(GemmContext* context) {
   std::map<gemm_t, std::vector<double>> benchmark_results;
 
-  std::vector<gemm_t> benchmark_gemms;
-  benchmark_gemms.emplace_back(10, 10, 10);
-  benchmark_gemms.emplace_back(20, 20, 20);
-  benchmark_gemms.emplace_back(30, 30, 30);
-  benchmark_gemms.emplace_back(40, 40, 40);
-  benchmark_gemms.emplace_back(50, 50, 50);
-  benchmark_gemms.emplace_back(60, 60, 60);
-  benchmark_gemms.emplace_back(64, 256, 147);
-  benchmark_gemms.emplace_back(100, 100, 1);
-  benchmark_gemms.emplace_back(100, 100, 100);
-  benchmark_gemms.emplace_back(100, 1000, 100);
-  benchmark_gemms.emplace_back(1000, 1000, 1);
-  benchmark_gemms.emplace_back(1000, 1000, 10);
-  benchmark_gemms.emplace_back(1000, 1000, 100);
-  benchmark_gemms.emplace_back(1000, 1000, 1000);
+  const std::vector<gemm_t> benchmark_gemms =
+      to_gemms(StandardBenchmarkShapes());
 
   const int repeat = 2;
 
@@ -277,63 +274,56 @@ void benchmark_gemm_sizes(GemmContext* context,
 }
 
 void benchmark_googlenet(GemmContext* context) {
-  // These are the m, n, k sizes for a typical GoogLeNet.
-  const int googlenet_gemm_sizes[] = {
-      12544, 64,  147, 3136, 64,   64,   3136, 192,  576,  784, 64,   192,
-      784,   96,  192, 784,  128,  864,  784,  16,   192,  784, 32,   400,
-      784,   32,  192, 784,  128,  256,  784,  128,  256,  784, 192,  1152,
-      784,   32,  256, 784,  96,   800,  784,  64,   256,  196, 192,  480,
-      196,   96,  480, 196,  204,  864,  196,  16,   480,  196, 48,   400,
-      196,   64,  480, 196,  160,  508,  196,  112,  508,  196, 224,  1008,
-      196,   24,  508, 196,  64,   600,  196,  64,   508,  196, 128,  512,
-      196,   128, 512, 196,  256,  1152, 196,  24,   512,  196, 64,   600,
-      196,   64,  512, 196,  112,  512,  196,  144,  512,  196, 288,  1296,
-      196,   32,  512, 196,  64,   800,  196,  64,   512,  196, 256,  528,
-      196,   160, 528, 196,  320,  1440, 196,  32,   528,  196, 128,  800,
-      196,   128, 528, 49,   256,  832,  49,   160,  832,  49,  320,  1440,
-      49,    48,  832, 49,   128,  1200, 49,   128,  832,  49,  384,  832,
-      49,    192, 832, 49,   384,  1728, 49,   48,   832,  49,  128,  1200,
-      49,    128, 832, 16,   128,  508,  1,    1024, 2048, 1,   1008, 1024,
-      16,    128, 528, 1,    1024, 2048, 1,    1008, 1024, 1,   1008, 1024,
-  };
-  assert(sizeof(googlenet_gemm_sizes) % (3 * sizeof(googlenet_gemm_sizes[0])) ==
-         0);
-  const std::size_t num_googlenet_gemms =
-      sizeof(googlenet_gemm_sizes) / (3 * sizeof(googlenet_gemm_sizes[0]));
-
-  std::vector<gemm_t> googlenet_gemms(num_googlenet_gemms);
-  for (std::size_t i = 0; i < num_googlenet_gemms; i++) {
-    googlenet_gemms[i].rows = googlenet_gemm_sizes[3 * i + 1];
-    googlenet_gemms[i].depth = googlenet_gemm_sizes[3 * i + 2];
-    googlenet_gemms[i].cols = googlenet_gemm_sizes[3 * i + 0];
-  }
+  const std::vector<gemm_t> googlenet_gemms = to_gemms(GoogLeNetShapes());
 
   const double mintime = 20.0;
   benchmark_gemm_sizes(context, googlenet_gemms, mintime);
 }
 
 void benchmark_small_model(GemmContext* context) {
-  // These are the m, n, k sizes for a small model with large batches.
-  const int small_model_gemm_sizes[] = {
-      29232, 16, 25, 7308, 6, 400, 203, 3002, 216,
-  };
-  assert(sizeof(small_model_gemm_sizes) %
-             (3 * sizeof(small_model_gemm_sizes[0])) ==
-         0);
-  const std::size_t num_small_model_gemms =
-      sizeof(small_model_gemm_sizes) / (3 * sizeof(small_model_gemm_sizes[0]));
-
-  std::vector<gemm_t> small_model_gemms(num_small_model_gemms);
-  for (std::size_t i = 0; i < num_small_model_gemms; i++) {
-    small_model_gemms[i].rows = small_model_gemm_sizes[3 * i + 1];
-    small_model_gemms[i].depth = small_model_gemm_sizes[3 * i + 2];
-    small_model_gemms[i].cols = small_model_gemm_sizes[3 * i + 0];
-  }
+  const std::vector<gemm_t> small_model_gemms =
+      to_gemms(SmallModelShapes());
 
   const double mintime = 10.0;
   benchmark_gemm_sizes(context, small_model_gemms, mintime);
 }
 
+// Reports how evenly multi-threaded GEMMs spread their work over their
+// threads: for each shape, the ratio of the longest task time to the mean
+// task time, when each task started, and how long the calling thread
+// waited for the others. See internal/load_imbalance.h.
+void benchmark_load_imbalance(GemmContext* context) {
+  std::vector<gemm_t> benchmark_gemms;
+  benchmark_gemms.emplace_back(100, 1000, 100);
+  benchmark_gemms.emplace_back(1000, 1000, 10);
+  benchmark_gemms.emplace_back(1000, 1000, 100);
+  benchmark_gemms.emplace_back(1000, 1000, 1000);
+  benchmark_gemms.emplace_back(3136, 576, 192);
+  benchmark_gemms.emplace_back(12544, 147, 64);
+
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+
+  for (auto gemm : benchmark_gemms) {
+    std::vector<gemm_t> unique_gemm;
+    unique_gemm.push_back(gemm);
+    // Warm-up, not recorded.
+    context->set_load_imbalance_stats_enabled(false);
+    time_for_gemms<LhsType, RhsType, ResultType>(context, unique_gemm);
+    context->set_load_imbalance_stats_enabled(true);
+    time_for_gemms<LhsType, RhsType, ResultType>(context, unique_gemm);
+  }
+  context->set_load_imbalance_stats_enabled(false);
+
+  // Shapes that ran on a single thread have no entry.
+  if (context->load_imbalance_stats().empty()) {
+    std::cout << "No GEMM was multi-threaded." << std::endl;
+  }
+  context->PrintLoadImbalanceStats();
+  std::cout << std::endl;
+}
+
 void benchmark_all() {
   {
     gemmlowp::GemmContext context;
@@ -366,5 +356,19 @@ void benchmark_all() {
 
 // For iOS, we need to define our own main(), so skip it here.
 #if !(defined(__APPLE__) && (TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR))
-int main() { gemmlowp::benchmark_all(); }
+// With the argument "load_imbalance", runs benchmark_load_imbalance instead
+// of the throughput and latency benchmarks, on the number of threads given
+// by the THREADS environment variable, or by default on all hardware
+// threads.
+int main(int argc, char* argv[]) {
+  if (argc > 1 && !strcmp(argv[1], "load_imbalance")) {
+    const char* threads_env = getenv("THREADS");
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(threads_env ? atoi(threads_env) : 0);
+    std::cout << "Benchmarking multi-threaded load imbalance..." << std::endl;
+    gemmlowp::benchmark_load_imbalance(&context);
+    return 0;
+  }
+  gemmlowp::benchmark_all();
+}
 #endif
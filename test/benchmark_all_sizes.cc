@@ -27,6 +27,8 @@ namespace std {
 }
 #endif
 
+#include "benchmark_shapes.h"
+
 // Minimum duration of each benchmark measurement. Also, duration
 // of sleep time between each two consecutive benchmark measurements to
 // prevent over-heating.
@@ -259,19 +261,7 @@ float benchmark(const Shape& shape) {
 #endif
 }
 
-std::set<int> all_sizes() {
-  std::set<int> sizes;
-  for (int i = 1; i <= 2048; i *= 2) {
-    sizes.insert(i);
-  }
-  for (double x = 8; x <= 2048; x *= std::sqrt(2.)) {
-    sizes.insert(static_cast<int>(std::round(x)));
-  }
-  for (double x = 16; x <= 512; x *= std::pow(2., 1. / 4.)) {
-    sizes.insert(static_cast<int>(std::round(x)));
-  }
-  return sizes;
-}
+std::set<int> all_sizes() { return gemmlowp::BenchmarkSizes(); }
 
 std::mt19937& RandomEngine() {
   static std::mt19937 engine;
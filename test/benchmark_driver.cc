@@ -0,0 +1,562 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// benchmark_driver.cc: a benchmark whose results can be saved and compared
+// across builds, to catch regressions.
+//
+// Usage:
+//   benchmark_driver run [set_or_shape...]
+//   benchmark_driver compare baseline.json candidate.json
+//
+// run measures the latency of each GEMM call for each of the given shapes,
+// given as rowsxdepthxcols or as the name of a set of shapes from
+// benchmark_shapes.h (standard, googlenet, small_model, cubic, scaling), by
+// default standard. Each shape is measured REPETITIONS times, the shapes
+// taking turns so that slow drifts of the machine's speed affect them all
+// alike. For each shape, it prints the min, median, 90th and 99th
+// percentile latencies over all calls, and the Gop/s at the median latency.
+//
+// By default, each shape is run in a loop on warm caches, which measures
+// its best case. COLD and GAP_US instead make the calls look like GEMMs run
+// between other work: COLD=flush streams over a COLD_BYTES buffer before
+// each call, evicting the operands and packed blocks from the caches, and
+// COLD=rotate cycles through enough distinct LHS (weight) matrices to fill
+// COLD_BYTES, so each call packs an LHS that isn't cached. GAP_US sleeps
+// before each call; a few milliseconds are enough for the worker threads to
+// stop busy-waiting and go to sleep, so that calls also pay for waking them
+// up.
+// HISTOGRAM prints the distribution of the latencies of each shape.
+//
+// compare reads two JSON files written by run, and for each shape in both,
+// compares the medians of the repetitions with a Mann-Whitney U test. A
+// shape regressed if its median latency grew by more than THRESHOLD with a
+// p-value below 0.05. This needs at least 4 repetitions in each file. The
+// exit status is 1 if any shape regressed.
+//
+// Environment variables:
+//   THREADS: number of threads passed to set_max_num_threads (default 1).
+//   REPETITIONS: number of measurements of each shape (default 5).
+//   MIN_TIME: minimum duration in seconds of each measurement (default 0.1).
+//   MIN_CALLS: minimum number of calls of each measurement (default 1).
+//   COLD: none (default), flush or rotate, see above.
+//   COLD_BYTES: bytes that COLD evicts from the caches (default 64 MiB).
+//   GAP_US: microseconds to sleep before each call (default 0).
+//   HISTOGRAM: if set, print a latency histogram of each shape.
+//   JSON, CSV: files to also write the results of run to.
+//   THRESHOLD: relative change of the median latency below which compare
+//     ignores differences (default 0.05).
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "benchmark_shapes.h"
+#include "test.h"
+
+namespace gemmlowp {
+
+// The p-value below which compare deems a difference significant.
+const double kSignificanceLevel = 0.05;
+
+// How to keep the caches cold between calls, see COLD above.
+enum class ColdMode { None, Flush, Rotate };
+
+const char* ColdModeName(ColdMode mode) {
+  switch (mode) {
+    case ColdMode::Flush:
+      return "flush";
+    case ColdMode::Rotate:
+      return "rotate";
+    default:
+      return "none";
+  }
+}
+
+// The most LHS matrices that COLD=rotate cycles through, bounding the
+// memory used for tiny shapes.
+const int kMaxRotatedMatrices = 4096;
+
+struct BenchmarkOptions {
+  int threads = 1;
+  int repetitions = 5;
+  double min_time_secs = 0.1;
+  int min_calls = 1;
+  ColdMode cold = ColdMode::None;
+  std::size_t cold_bytes = 64 << 20;
+  int gap_us = 0;
+};
+
+struct ShapeResult {
+  BenchmarkShape shape;
+  // The latency of every call, in seconds.
+  std::vector<double> latencies;
+  // The median latency of each repetition, in seconds.
+  std::vector<double> repetition_medians;
+};
+
+std::string ShapeName(const BenchmarkShape& shape) {
+  char name[64];
+  snprintf(name, sizeof(name), "%dx%dx%d", shape.rows, shape.depth,
+           shape.cols);
+  return name;
+}
+
+// The value at the given fraction of the sorted values, by nearest rank.
+double Percentile(const std::vector<double>& sorted, double fraction) {
+  assert(!sorted.empty());
+  const std::size_t rank =
+      static_cast<std::size_t>(std::ceil(fraction * sorted.size()));
+  return sorted[std::max<std::size_t>(rank, 1) - 1];
+}
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return Percentile(values, 0.5);
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Evicts the caches by reading and writing every cache line of a buffer of
+// the given size.
+void FlushCaches(std::size_t bytes) {
+  static std::vector<std::uint8_t> buffer;
+  buffer.resize(bytes);
+  const std::size_t kCacheLineSize = 64;
+  for (std::size_t i = 0; i < buffer.size(); i += kCacheLineSize) {
+    buffer[i]++;
+  }
+}
+
+// Runs the GEMMs of the given shape, one repetition, appending the
+// latencies to result.
+void MeasureRepetition(GemmContext* context, const BenchmarkOptions& options,
+                       ShapeResult* result) {
+  const BenchmarkShape& shape = result->shape;
+  int lhs_count = 1;
+  if (options.cold == ColdMode::Rotate) {
+    const std::size_t lhs_bytes = std::size_t(shape.rows) * shape.depth;
+    lhs_count = static_cast<int>(std::min<std::size_t>(
+        kMaxRotatedMatrices,
+        std::max<std::size_t>(2, CeilQuotient(options.cold_bytes, lhs_bytes))));
+  }
+  std::vector<Matrix<std::uint8_t, MapOrder::RowMajor>> lhs(lhs_count);
+  for (auto& m : lhs) {
+    m.Resize(shape.rows, shape.depth);
+    MakeRandom<OperandRange<0, 255>>(&m);
+  }
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(shape.depth, shape.cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> dst(shape.rows, shape.cols);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  const auto output_pipeline = MakeStandardOutputPipeline(0, 1, 16);
+  int next_lhs = 0;
+  auto run = [&]() {
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                           DefaultL8R8BitDepthParams>(
+        context, lhs[next_lhs].const_map(), rhs.const_map(), &dst.map(), -128,
+        -128, output_pipeline);
+    next_lhs = (next_lhs + 1) % lhs_count;
+  };
+  // Warm-up, not counted.
+  run();
+  std::vector<double> latencies;
+  const auto start = std::chrono::steady_clock::now();
+  do {
+    // Neither the flush nor the gap are part of the latency.
+    if (options.cold == ColdMode::Flush) {
+      FlushCaches(options.cold_bytes);
+    }
+    if (options.gap_us) {
+      std::this_thread::sleep_for(std::chrono::microseconds(options.gap_us));
+    }
+    const auto call_start = std::chrono::steady_clock::now();
+    run();
+    latencies.push_back(SecondsSince(call_start));
+  } while (SecondsSince(start) < options.min_time_secs ||
+           static_cast<int>(latencies.size()) < options.min_calls);
+  result->latencies.insert(result->latencies.end(), latencies.begin(),
+                           latencies.end());
+  result->repetition_medians.push_back(Median(latencies));
+}
+
+std::vector<ShapeResult> RunBenchmarks(
+    const std::vector<BenchmarkShape>& shapes,
+    const BenchmarkOptions& options) {
+  GemmContext context;
+  context.set_max_num_threads(options.threads);
+  std::vector<ShapeResult> results(shapes.size());
+  for (std::size_t i = 0; i < shapes.size(); i++) {
+    results[i].shape = shapes[i];
+  }
+  for (int r = 0; r < options.repetitions; r++) {
+    for (std::size_t i = 0; i < results.size(); i++) {
+      fprintf(stderr, "repetition %d/%d, shape %d/%d...\r", r + 1,
+              options.repetitions, static_cast<int>(i + 1),
+              static_cast<int>(results.size()));
+      MeasureRepetition(&context, options, &results[i]);
+    }
+  }
+  fprintf(stderr, "\n");
+  return results;
+}
+
+// The summary of a ShapeResult, in microseconds.
+struct ShapeSummary {
+  std::size_t calls;
+  double min_us;
+  double median_us;
+  double p90_us;
+  double p99_us;
+  double gops;
+};
+
+ShapeSummary Summarize(const ShapeResult& result) {
+  std::vector<double> sorted = result.latencies;
+  std::sort(sorted.begin(), sorted.end());
+  ShapeSummary summary;
+  summary.calls = sorted.size();
+  summary.min_us = 1e6 * sorted.front();
+  summary.median_us = 1e6 * Percentile(sorted, 0.5);
+  summary.p90_us = 1e6 * Percentile(sorted, 0.9);
+  summary.p99_us = 1e6 * Percentile(sorted, 0.99);
+  const BenchmarkShape& s = result.shape;
+  summary.gops = 2e-3 * s.rows * s.depth * s.cols / summary.median_us;
+  return summary;
+}
+
+// Prints the number of calls of the given result in latency buckets of a
+// quarter of an octave, from the fastest call to the slowest.
+void PrintHistogram(const ShapeResult& result) {
+  const int kBucketsPerOctave = 4;
+  const int kBarWidth = 50;
+  auto bucket = [=](double secs) {
+    return static_cast<int>(
+        std::floor(kBucketsPerOctave * std::log2(std::max(1e-3, 1e6 * secs))));
+  };
+  const auto minmax =
+      std::minmax_element(result.latencies.begin(), result.latencies.end());
+  const int first_bucket = bucket(*minmax.first);
+  std::vector<std::size_t> counts(bucket(*minmax.second) - first_bucket + 1);
+  for (double latency : result.latencies) {
+    counts[bucket(latency) - first_bucket]++;
+  }
+  const std::size_t max_count = *std::max_element(counts.begin(), counts.end());
+  printf("\n%s latency histogram:\n", ShapeName(result.shape).c_str());
+  for (std::size_t i = 0; i < counts.size(); i++) {
+    const int b = first_bucket + static_cast<int>(i);
+    printf("%11.2f - %11.2f us %8llu ",
+           std::exp2(static_cast<double>(b) / kBucketsPerOctave),
+           std::exp2(static_cast<double>(b + 1) / kBucketsPerOctave),
+           static_cast<unsigned long long>(counts[i]));
+    const int bar = static_cast<int>(
+        std::ceil(static_cast<double>(kBarWidth) * counts[i] / max_count));
+    for (int j = 0; j < bar; j++) {
+      putchar('#');
+    }
+    putchar('\n');
+  }
+}
+
+void PrintResults(const std::vector<ShapeResult>& results) {
+  printf("%-18s %8s %11s %11s %11s %11s %8s\n", "shape", "calls", "min_us",
+         "median_us", "p90_us", "p99_us", "Gop/s");
+  for (const ShapeResult& result : results) {
+    const ShapeSummary s = Summarize(result);
+    printf("%-18s %8llu %11.2f %11.2f %11.2f %11.2f %8.2f\n",
+           ShapeName(result.shape).c_str(),
+           static_cast<unsigned long long>(s.calls), s.min_us, s.median_us,
+           s.p90_us, s.p99_us, s.gops);
+  }
+}
+
+// Writes each result on its own line, which ReadJsonResults relies on.
+bool WriteJsonResults(const char* path, const BenchmarkOptions& options,
+                      const std::vector<ShapeResult>& results) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file,
+          "{\n\"threads\": %d,\n\"repetitions\": %d,\n\"min_time_s\": %g,\n"
+          "\"min_calls\": %d,\n\"cold\": \"%s\",\n\"cold_bytes\": %llu,\n"
+          "\"gap_us\": %d,\n\"results\": [\n",
+          options.threads, options.repetitions, options.min_time_secs,
+          options.min_calls, ColdModeName(options.cold),
+          static_cast<unsigned long long>(options.cold_bytes), options.gap_us);
+  for (std::size_t i = 0; i < results.size(); i++) {
+    const ShapeResult& result = results[i];
+    const ShapeSummary s = Summarize(result);
+    fprintf(file,
+            "{\"shape\": \"%s\", \"rows\": %d, \"depth\": %d, \"cols\": %d, "
+            "\"calls\": %llu, \"min_us\": %.3f, \"median_us\": %.3f, "
+            "\"p90_us\": %.3f, \"p99_us\": %.3f, \"gops\": %.3f, "
+            "\"repetition_median_us\": [",
+            ShapeName(result.shape).c_str(), result.shape.rows,
+            result.shape.depth, result.shape.cols,
+            static_cast<unsigned long long>(s.calls), s.min_us, s.median_us,
+            s.p90_us, s.p99_us, s.gops);
+    for (std::size_t r = 0; r < result.repetition_medians.size(); r++) {
+      fprintf(file, "%s%.3f", r ? ", " : "",
+              1e6 * result.repetition_medians[r]);
+    }
+    fprintf(file, "]}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(file, "]\n}\n");
+  return !fclose(file);
+}
+
+bool WriteCsvResults(const char* path,
+                     const std::vector<ShapeResult>& results) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "shape,rows,depth,cols,calls,min_us,median_us,p90_us,"
+                "p99_us,gops\n");
+  for (const ShapeResult& result : results) {
+    const ShapeSummary s = Summarize(result);
+    fprintf(file, "%s,%d,%d,%d,%llu,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+            ShapeName(result.shape).c_str(), result.shape.rows,
+            result.shape.depth, result.shape.cols,
+            static_cast<unsigned long long>(s.calls), s.min_us, s.median_us,
+            s.p90_us, s.p99_us, s.gops);
+  }
+  return !fclose(file);
+}
+
+// The repetition medians of each shape of a file written by
+// WriteJsonResults, in microseconds, in the order of the file.
+typedef std::vector<std::pair<std::string, std::vector<double>>>
+    RepetitionMedians;
+
+bool ReadJsonResults(const char* path, RepetitionMedians* medians) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  const char kShapeKey[] = "\"shape\": \"";
+  const char kMediansKey[] = "\"repetition_median_us\": [";
+  char line[4096];
+  while (fgets(line, sizeof(line), file)) {
+    const char* shape = strstr(line, kShapeKey);
+    const char* values = strstr(line, kMediansKey);
+    if (!shape || !values) {
+      continue;
+    }
+    shape += strlen(kShapeKey);
+    const char* shape_end = strchr(shape, '"');
+    if (!shape_end) {
+      continue;
+    }
+    std::vector<double> repetition_medians;
+    const char* ptr = values + strlen(kMediansKey);
+    while (true) {
+      char* end;
+      const double value = strtod(ptr, &end);
+      if (end == ptr) {
+        break;
+      }
+      repetition_medians.push_back(value);
+      ptr = end;
+      while (*ptr == ',' || *ptr == ' ') {
+        ptr++;
+      }
+    }
+    medians->emplace_back(std::string(shape, shape_end), repetition_medians);
+  }
+  fclose(file);
+  return true;
+}
+
+// The two-sided p-value of the Mann-Whitney U test of whether a and b come
+// from the same distribution, by the normal approximation with tie and
+// continuity corrections.
+double MannWhitneyPValue(const std::vector<double>& a,
+                         const std::vector<double>& b) {
+  const double n1 = a.size();
+  const double n2 = b.size();
+  const double n = n1 + n2;
+  if (!n1 || !n2) {
+    return 1;
+  }
+  // Each value, and whether it is from a.
+  std::vector<std::pair<double, bool>> values;
+  for (double v : a) {
+    values.emplace_back(v, true);
+  }
+  for (double v : b) {
+    values.emplace_back(v, false);
+  }
+  std::sort(values.begin(), values.end());
+  // The sum of the ranks of a, ties getting the mean of their ranks.
+  double rank_sum = 0;
+  double tie_term = 0;
+  for (std::size_t i = 0; i < values.size();) {
+    std::size_t j = i;
+    while (j < values.size() && values[j].first == values[i].first) {
+      j++;
+    }
+    const double ties = j - i;
+    const double mean_rank = (i + 1 + j) / 2.0;
+    for (std::size_t k = i; k < j; k++) {
+      if (values[k].second) {
+        rank_sum += mean_rank;
+      }
+    }
+    tie_term += ties * ties * ties - ties;
+    i = j;
+  }
+  const double u = rank_sum - n1 * (n1 + 1) / 2;
+  const double mean = n1 * n2 / 2;
+  const double variance =
+      n1 * n2 / 12 * ((n + 1) - tie_term / (n * (n - 1)));
+  if (variance <= 0) {
+    return 1;
+  }
+  const double z =
+      std::max(0.0, std::abs(u - mean) - 0.5) / std::sqrt(variance);
+  return std::erfc(z / std::sqrt(2.0));
+}
+
+int CompareMain(const char* baseline_path, const char* candidate_path,
+                double threshold) {
+  RepetitionMedians baseline, candidate;
+  if (!ReadJsonResults(baseline_path, &baseline)) {
+    fprintf(stderr, "Could not read %s\n", baseline_path);
+    return 2;
+  }
+  if (!ReadJsonResults(candidate_path, &candidate)) {
+    fprintf(stderr, "Could not read %s\n", candidate_path);
+    return 2;
+  }
+  std::map<std::string, std::vector<double>> candidate_by_shape(
+      candidate.begin(), candidate.end());
+  int regressions = 0;
+  printf("%-18s %12s %12s %9s %8s\n", "shape", "baseline_us", "candidate_us",
+         "change", "p");
+  for (const auto& entry : baseline) {
+    auto it = candidate_by_shape.find(entry.first);
+    if (it == candidate_by_shape.end() || entry.second.empty() ||
+        it->second.empty()) {
+      continue;
+    }
+    const double baseline_us = Median(entry.second);
+    const double candidate_us = Median(it->second);
+    const double change = candidate_us / baseline_us - 1;
+    const double p = MannWhitneyPValue(entry.second, it->second);
+    const bool significant =
+        p < kSignificanceLevel && std::abs(change) > threshold;
+    const char* verdict = "";
+    if (significant) {
+      verdict = change > 0 ? "REGRESSION" : "improvement";
+    }
+    if (significant && change > 0) {
+      regressions++;
+    }
+    printf("%-18s %12.2f %12.2f %+8.1f%% %8.4f %s\n", entry.first.c_str(),
+           baseline_us, candidate_us, 100 * change, p, verdict);
+  }
+  printf("%d regression(s)\n", regressions);
+  return regressions ? 1 : 0;
+}
+
+int RunMain(int argc, char* argv[]) {
+  std::vector<BenchmarkShape> shapes;
+  if (!AppendBenchmarkShapeArgs(argc, argv, &shapes)) {
+    return 2;
+  }
+  if (shapes.empty()) {
+    shapes = StandardBenchmarkShapes();
+  }
+  BenchmarkOptions options;
+  if (const char* threads_env = getenv("THREADS")) {
+    options.threads = atoi(threads_env);
+  }
+  if (const char* repetitions_env = getenv("REPETITIONS")) {
+    options.repetitions = std::max(1, atoi(repetitions_env));
+  }
+  if (const char* min_time_env = getenv("MIN_TIME")) {
+    options.min_time_secs = atof(min_time_env);
+  }
+  if (const char* min_calls_env = getenv("MIN_CALLS")) {
+    options.min_calls = atoi(min_calls_env);
+  }
+  if (const char* cold_env = getenv("COLD")) {
+    if (!strcmp(cold_env, "flush")) {
+      options.cold = ColdMode::Flush;
+    } else if (!strcmp(cold_env, "rotate")) {
+      options.cold = ColdMode::Rotate;
+    } else if (strcmp(cold_env, "none")) {
+      fprintf(stderr, "Unknown COLD: %s\n", cold_env);
+      return 2;
+    }
+  }
+  if (const char* cold_bytes_env = getenv("COLD_BYTES")) {
+    options.cold_bytes = std::max(1ll, atoll(cold_bytes_env));
+  }
+  if (const char* gap_us_env = getenv("GAP_US")) {
+    options.gap_us = std::max(0, atoi(gap_us_env));
+  }
+
+  const std::vector<ShapeResult> results = RunBenchmarks(shapes, options);
+  PrintResults(results);
+  if (getenv("HISTOGRAM")) {
+    for (const ShapeResult& result : results) {
+      PrintHistogram(result);
+    }
+  }
+  const char* json_path = getenv("JSON");
+  if (json_path && !WriteJsonResults(json_path, options, results)) {
+    fprintf(stderr, "Could not write %s\n", json_path);
+    return 2;
+  }
+  const char* csv_path = getenv("CSV");
+  if (csv_path && !WriteCsvResults(csv_path, results)) {
+    fprintf(stderr, "Could not write %s\n", csv_path);
+    return 2;
+  }
+  return 0;
+}
+
+int BenchmarkDriverMain(int argc, char* argv[]) {
+  if (argc >= 2 && !strcmp(argv[1], "run")) {
+    return RunMain(argc - 2, argv + 2);
+  }
+  if (argc == 4 && !strcmp(argv[1], "compare")) {
+    const char* threshold_env = getenv("THRESHOLD");
+    return CompareMain(argv[2], argv[3],
+                       threshold_env ? atof(threshold_env) : 0.05);
+  }
+  fprintf(stderr,
+          "Usage:\n  %s run [set_or_shape...]\n"
+          "  %s compare baseline.json candidate.json\n",
+          argv[0], argv[0]);
+  return 2;
+}
+
+}  // namespace gemmlowp
+
+int main(int argc, char* argv[]) {
+  return gemmlowp::BenchmarkDriverMain(argc, argv);
+}
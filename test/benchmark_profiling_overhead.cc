@@ -0,0 +1,122 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// benchmark_profiling_overhead.cc: measures the cost of profiling
+// instrumentation on GEMM throughput. Build it twice, with and without
+// -DGEMMLOWP_TEST_PROFILE (the CMake targets benchmark_profiling_overhead
+// and benchmark_profiling_overhead_profiled), and compare the Gop/s that
+// each prints. With profiling compiled in, it measures each size without
+// and then with the sampling profiler running.
+//
+// Environment variables:
+//   THREADS: number of threads passed to set_max_num_threads (default 1).
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "test.h"
+
+#ifdef GEMMLOWP_PROFILING
+#include "../profiling/profiler.h"
+#endif
+
+namespace gemmlowp {
+
+// Minimum duration of each measurement.
+const double kMinMeasurementSecs = 0.2;
+
+// Each measurement is the best of this many.
+const int kRepeats = 3;
+
+struct BenchmarkShape {
+  int rows;
+  int depth;
+  int cols;
+};
+
+// Small shapes are where the per-label overhead matters most.
+const BenchmarkShape kShapes[] = {
+    {16, 16, 16}, {64, 64, 64}, {256, 64, 16}, {128, 256, 128},
+    {512, 512, 512}};
+
+double MeasureGops(GemmContext* context, const BenchmarkShape& shape) {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(shape.rows, shape.depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(shape.depth, shape.cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(shape.rows, shape.cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  const auto output_pipeline = MakeStandardOutputPipeline(0, 1, 16);
+  auto run = [&]() {
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                           DefaultL8R8BitDepthParams>(
+        context, lhs.const_map(), rhs.const_map(), &result.map(), -128, -128,
+        output_pipeline);
+  };
+  run();
+  double best_gops = 0;
+  for (int repeat = 0; repeat < kRepeats; repeat++) {
+    int iters = 1;
+    while (true) {
+      const double start = real_time_in_seconds();
+      for (int i = 0; i < iters; i++) {
+        run();
+      }
+      const double elapsed = real_time_in_seconds() - start;
+      if (elapsed >= kMinMeasurementSecs) {
+        best_gops = std::max(best_gops, 2e-9 * shape.rows * shape.depth *
+                                            shape.cols * iters / elapsed);
+        break;
+      }
+      iters *= 2;
+    }
+  }
+  return best_gops;
+}
+
+int BenchmarkMain() {
+  const char* threads_env = getenv("THREADS");
+  const int threads = threads_env ? atoi(threads_env) : 1;
+  GemmContext context;
+  context.set_max_num_threads(threads);
+
+#ifdef GEMMLOWP_PROFILING
+  RegisterCurrentThreadForProfiling();
+  printf("Profiling compiled in, %d thread(s).\n", threads);
+  printf("%17s  %12s  %12s\n", "rowsxdepthxcols", "Gop/s idle",
+         "Gop/s sampled");
+  for (const BenchmarkShape& shape : kShapes) {
+    const double idle_gops = MeasureGops(&context, shape);
+    StartProfiling();
+    const double sampled_gops = MeasureGops(&context, shape);
+    // Prints the profile, which also shows that the labels are recorded.
+    FinishProfiling();
+    printf("%5dx%5dx%5d  %12.3f  %12.3f\n", shape.rows, shape.depth,
+           shape.cols, idle_gops, sampled_gops);
+    fflush(stdout);
+  }
+#else
+  printf("Profiling compiled out, %d thread(s).\n", threads);
+  printf("%17s  %12s\n", "rowsxdepthxcols", "Gop/s");
+  for (const BenchmarkShape& shape : kShapes) {
+    printf("%5dx%5dx%5d  %12.3f\n", shape.rows, shape.depth, shape.cols,
+           MeasureGops(&context, shape));
+    fflush(stdout);
+  }
+#endif
+  return 0;
+}
+
+}  // namespace gemmlowp
+
+int main() { return gemmlowp::BenchmarkMain(); }
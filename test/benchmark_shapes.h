@@ -0,0 +1,178 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// benchmark_shapes.h: the sets of GEMM shapes that the benchmarks run, so
+// that they all measure the same thing.
+
+#ifndef GEMMLOWP_TEST_BENCHMARK_SHAPES_H_
+#define GEMMLOWP_TEST_BENCHMARK_SHAPES_H_
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <vector>
+
+namespace gemmlowp {
+
+struct BenchmarkShape {
+  int rows;
+  int depth;
+  int cols;
+};
+
+// An assortment of shapes from tiny to large, see benchmark() in
+// benchmark.cc.
+inline std::vector<BenchmarkShape> StandardBenchmarkShapes() {
+  return {
+      {10, 10, 10},       {20, 20, 20},     {30, 30, 30},
+      {40, 40, 40},       {50, 50, 50},     {60, 60, 60},
+      {64, 256, 147},     {100, 100, 1},    {100, 100, 100},
+      {100, 1000, 100},   {1000, 1000, 1},  {1000, 1000, 10},
+      {1000, 1000, 100},  {1000, 1000, 1000},
+  };
+}
+
+// Returns the shapes given as (cols, rows, depth) triples in sizes.
+inline std::vector<BenchmarkShape> ShapesFromColsRowsDepth(
+    const int* sizes, std::size_t sizes_count) {
+  assert(sizes_count % 3 == 0);
+  std::vector<BenchmarkShape> shapes(sizes_count / 3);
+  for (std::size_t i = 0; i < shapes.size(); i++) {
+    shapes[i].rows = sizes[3 * i + 1];
+    shapes[i].depth = sizes[3 * i + 2];
+    shapes[i].cols = sizes[3 * i + 0];
+  }
+  return shapes;
+}
+
+// The GEMMs of a typical GoogLeNet.
+inline std::vector<BenchmarkShape> GoogLeNetShapes() {
+  // These are the m, n, k sizes for a typical GoogLeNet.
+  static const int googlenet_gemm_sizes[] = {
+      12544, 64,  147, 3136, 64,   64,   3136, 192,  576,  784, 64,   192,
+      784,   96,  192, 784,  128,  864,  784,  16,   192,  784, 32,   400,
+      784,   32,  192, 784,  128,  256,  784,  128,  256,  784, 192,  1152,
+      784,   32,  256, 784,  96,   800,  784,  64,   256,  196, 192,  480,
+      196,   96,  480, 196,  204,  864,  196,  16,   480,  196, 48,   400,
+      196,   64,  480, 196,  160,  508,  196,  112,  508,  196, 224,  1008,
+      196,   24,  508, 196,  64,   600,  196,  64,   508,  196, 128,  512,
+      196,   128, 512, 196,  256,  1152, 196,  24,   512,  196, 64,   600,
+      196,   64,  512, 196,  112,  512,  196,  144,  512,  196, 288,  1296,
+      196,   32,  512, 196,  64,   800,  196,  64,   512,  196, 256,  528,
+      196,   160, 528, 196,  320,  1440, 196,  32,   528,  196, 128,  800,
+      196,   128, 528, 49,   256,  832,  49,   160,  832,  49,  320,  1440,
+      49,    48,  832, 49,   128,  1200, 49,   128,  832,  49,  384,  832,
+      49,    192, 832, 49,   384,  1728, 49,   48,   832,  49,  128,  1200,
+      49,    128, 832, 16,   128,  508,  1,    1024, 2048, 1,   1008, 1024,
+      16,    128, 528, 1,    1024, 2048, 1,    1008, 1024, 1,   1008, 1024,
+  };
+  return ShapesFromColsRowsDepth(
+      googlenet_gemm_sizes,
+      sizeof(googlenet_gemm_sizes) / sizeof(googlenet_gemm_sizes[0]));
+}
+
+// The GEMMs of a small model with large batches.
+inline std::vector<BenchmarkShape> SmallModelShapes() {
+  // These are the m, n, k sizes for a small model with large batches.
+  static const int small_model_gemm_sizes[] = {
+      29232, 16, 25, 7308, 6, 400, 203, 3002, 216,
+  };
+  return ShapesFromColsRowsDepth(
+      small_model_gemm_sizes,
+      sizeof(small_model_gemm_sizes) / sizeof(small_model_gemm_sizes[0]));
+}
+
+// Sizes from 1 to 2048, denser in the middle, see benchmark_all_sizes.cc.
+inline std::set<int> BenchmarkSizes() {
+  std::set<int> sizes;
+  for (int i = 1; i <= 2048; i *= 2) {
+    sizes.insert(i);
+  }
+  for (double x = 8; x <= 2048; x *= std::sqrt(2.)) {
+    sizes.insert(static_cast<int>(std::round(x)));
+  }
+  for (double x = 16; x <= 512; x *= std::pow(2., 1. / 4.)) {
+    sizes.insert(static_cast<int>(std::round(x)));
+  }
+  return sizes;
+}
+
+// Cubic shapes of each of BenchmarkSizes.
+inline std::vector<BenchmarkShape> CubicShapes() {
+  std::vector<BenchmarkShape> shapes;
+  for (int size : BenchmarkSizes()) {
+    shapes.push_back({size, size, size});
+  }
+  return shapes;
+}
+
+// Shapes of each kind whose thread scaling matters: small, medium and
+// large square ones, tall and wide ones, a deep one and a GEMV.
+inline std::vector<BenchmarkShape> ThreadScalingShapes() {
+  return {
+      {128, 128, 128},   {512, 512, 512}, {1024, 1024, 1024},
+      {4096, 256, 64},   {64, 256, 4096}, {256, 4096, 256},
+      {1024, 1024, 1},
+  };
+}
+
+// Appends the shapes of the set of the given name: "standard",
+// "googlenet", "small_model", "cubic" or "scaling". Returns false if there
+// is no such set.
+inline bool AppendBenchmarkShapeSet(const char* name,
+                                    std::vector<BenchmarkShape>* shapes) {
+  std::vector<BenchmarkShape> set;
+  if (!strcmp(name, "standard")) {
+    set = StandardBenchmarkShapes();
+  } else if (!strcmp(name, "googlenet")) {
+    set = GoogLeNetShapes();
+  } else if (!strcmp(name, "small_model")) {
+    set = SmallModelShapes();
+  } else if (!strcmp(name, "cubic")) {
+    set = CubicShapes();
+  } else if (!strcmp(name, "scaling")) {
+    set = ThreadScalingShapes();
+  } else {
+    return false;
+  }
+  shapes->insert(shapes->end(), set.begin(), set.end());
+  return true;
+}
+
+// Appends the shapes given on a command line, each as the name of a set or
+// as rowsxdepthxcols. Returns false, after printing the culprit on stderr,
+// if one is neither.
+inline bool AppendBenchmarkShapeArgs(int argc, char* argv[],
+                                     std::vector<BenchmarkShape>* shapes) {
+  for (int i = 0; i < argc; i++) {
+    BenchmarkShape shape;
+    if (AppendBenchmarkShapeSet(argv[i], shapes)) {
+      continue;
+    }
+    if (sscanf(argv[i], "%dx%dx%d", &shape.rows, &shape.depth, &shape.cols) !=
+            3 ||
+        shape.rows <= 0 || shape.depth <= 0 || shape.cols <= 0) {
+      fprintf(stderr, "Malformed shape or unknown set: %s\n", argv[i]);
+      return false;
+    }
+    shapes->push_back(shape);
+  }
+  return true;
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_TEST_BENCHMARK_SHAPES_H_
@@ -0,0 +1,102 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// benchmark_stage_stats.cc: runs GEMMs of the given shapes with stage stats
+// and hardware event counters enabled, and prints, for each shape, the
+// achieved Gop/s and the time, bandwidth, instructions per cycle and
+// cache and TLB misses of each stage. This tells whether a shape is bound
+// by the compute kernel or by memory on a given machine. See
+// internal/stage_stats.h.
+//
+// Usage:
+//   benchmark_stage_stats rowsxdepthxcols...
+//
+// Environment variables:
+//   THREADS: number of threads passed to set_max_num_threads (default 1).
+//
+// Hardware events need perf_event_open to be allowed, e.g. with
+//   sysctl kernel.perf_event_paranoid=2
+// or lower; otherwise only the times and bandwidths are printed.
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "test.h"
+
+namespace gemmlowp {
+
+// Minimum duration of the measurement of each shape.
+const double kMinMeasurementSecs = 0.5;
+
+void BenchmarkShape(GemmContext* context, int rows, int depth, int cols) {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  const auto output_pipeline = MakeStandardOutputPipeline(0, 1, 16);
+  auto run = [&]() {
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                           DefaultL8R8BitDepthParams>(
+        context, lhs.const_map(), rhs.const_map(), &result.map(), -128, -128,
+        output_pipeline);
+  };
+  // Warm-up, not counted.
+  context->set_stage_stats_enabled(false);
+  run();
+  context->ResetStageStats();
+  context->set_stage_stats_enabled(true);
+  int iters = 0;
+  const double start = real_time_in_seconds();
+  double elapsed = 0;
+  while (elapsed < kMinMeasurementSecs) {
+    run();
+    iters++;
+    elapsed = real_time_in_seconds() - start;
+  }
+  printf("\n%dx%dx%d: %.3f Gop/s (%d GEMMs)\n", rows, depth, cols,
+         2e-9 * rows * depth * cols * iters / elapsed, iters);
+  PrintGemmStageStats(context->stage_stats());
+  fflush(stdout);
+}
+
+int BenchmarkMain(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s rowsxdepthxcols...\n", argv[0]);
+    return 1;
+  }
+  const char* threads_env = getenv("THREADS");
+  GemmContext context;
+  context.set_max_num_threads(threads_env ? atoi(threads_env) : 1);
+  context.set_stage_perf_events_enabled(true);
+  if (!PerfCountersAvailable()) {
+    printf("Hardware event counters are not available.\n");
+  }
+  for (int i = 1; i < argc; i++) {
+    int rows, depth, cols;
+    if (sscanf(argv[i], "%dx%dx%d", &rows, &depth, &cols) != 3 || rows <= 0 ||
+        depth <= 0 || cols <= 0) {
+      fprintf(stderr, "Malformed shape: %s\n", argv[i]);
+      return 1;
+    }
+    BenchmarkShape(&context, rows, depth, cols);
+  }
+  return 0;
+}
+
+}  // namespace gemmlowp
+
+int main(int argc, char* argv[]) {
+  return gemmlowp::BenchmarkMain(argc, argv);
+}
@@ -0,0 +1,191 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// benchmark_thread_scaling.cc: measures how multi-threaded GEMMs scale
+// with set_max_num_threads. For each of the given shapes, given as
+// rowsxdepthxcols or as the name of a set of shapes from benchmark_shapes.h,
+// by default scaling, it prints for each max_num_threads the number of
+// threads that HowManyThreads actually used, the median latency, and the
+// speedup and parallel efficiency over 1 thread.
+//
+// It then checks HowManyThreads: if, at the largest max_num_threads, its
+// choice is slower by more than THRESHOLD than the best measured smaller
+// max_num_threads, the shape is reported as SUBOPTIMAL. Thread counts above
+// those that HowManyThreads picks can't be measured, so a heuristic using
+// too few threads goes unnoticed; such shapes are reported as capped.
+//
+// Usage:
+//   benchmark_thread_scaling [set_or_shape...]
+//
+// Environment variables:
+//   THREADS: comma-separated max_num_threads to measure (default 1 up to
+//     the number of hardware threads). 1 is always measured.
+//   THRESHOLD: relative slowdown from the best thread count above which the
+//     heuristic's choice is reported as suboptimal (default 0.05).
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "benchmark_shapes.h"
+#include "test.h"
+
+namespace gemmlowp {
+
+// Minimum duration of each measurement.
+const double kMinMeasurementSecs = 0.2;
+
+struct ThreadsMeasurement {
+  int max_num_threads;
+  // The number of threads that the GEMMs actually used.
+  int threads;
+  double median_secs;
+};
+
+// Measures GEMMs of the given shape on the given context, with its current
+// max_num_threads.
+ThreadsMeasurement Measure(GemmContext* context,
+                           const BenchmarkShape& shape) {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(shape.rows, shape.depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(shape.depth, shape.cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> dst(shape.rows, shape.cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  const auto output_pipeline = MakeStandardOutputPipeline(0, 1, 16);
+  auto run = [&]() {
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                           DefaultL8R8BitDepthParams>(
+        context, lhs.const_map(), rhs.const_map(), &dst.map(), -128, -128,
+        output_pipeline);
+  };
+  ThreadsMeasurement measurement;
+  measurement.max_num_threads = context->max_num_threads();
+  // Warm-up, not counted, also starting the worker threads. The call log
+  // tells how many threads were used; it is disabled while measuring since
+  // it costs a few clock reads per block.
+  context->set_call_log_capacity(1);
+  run();
+  measurement.threads = context->call_log()->Records().back().thread_count;
+  context->set_call_log_capacity(0);
+
+  std::vector<double> latencies;
+  const auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed(0);
+  while (elapsed.count() < kMinMeasurementSecs) {
+    const auto call_start = std::chrono::steady_clock::now();
+    run();
+    const auto call_end = std::chrono::steady_clock::now();
+    latencies.push_back(
+        std::chrono::duration<double>(call_end - call_start).count());
+    elapsed = call_end - start;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  measurement.median_secs = latencies[latencies.size() / 2];
+  return measurement;
+}
+
+// Prints the scaling of the given shape. Returns whether HowManyThreads
+// picked a suboptimal thread count for it.
+bool BenchmarkShapeScaling(const BenchmarkShape& shape,
+                           const std::vector<int>& thread_counts,
+                           double threshold) {
+  GemmContext context;
+  std::vector<ThreadsMeasurement> measurements;
+  for (int max_num_threads : thread_counts) {
+    context.set_max_num_threads(max_num_threads);
+    measurements.push_back(Measure(&context, shape));
+  }
+
+  printf("\n%dx%dx%d:\n", shape.rows, shape.depth, shape.cols);
+  printf("%12s %8s %12s %8s %10s\n", "max_threads", "threads", "median_us",
+         "speedup", "efficiency");
+  const double single_thread_secs = measurements.front().median_secs;
+  for (const ThreadsMeasurement& m : measurements) {
+    const double speedup = single_thread_secs / m.median_secs;
+    printf("%12d %8d %12.2f %8.2f %9.1f%%\n", m.max_num_threads, m.threads,
+           1e6 * m.median_secs, speedup, 100 * speedup / m.threads);
+  }
+
+  const ThreadsMeasurement& heuristic = measurements.back();
+  const ThreadsMeasurement& best = *std::min_element(
+      measurements.begin(), measurements.end(),
+      [](const ThreadsMeasurement& a, const ThreadsMeasurement& b) {
+        return a.median_secs < b.median_secs;
+      });
+  const bool suboptimal =
+      best.threads != heuristic.threads &&
+      heuristic.median_secs > (1 + threshold) * best.median_secs;
+  printf("HowManyThreads at max_threads=%d: %d threads",
+         heuristic.max_num_threads, heuristic.threads);
+  if (heuristic.threads < heuristic.max_num_threads) {
+    printf(" (capped)");
+  }
+  if (suboptimal) {
+    printf("; SUBOPTIMAL, %.2fx slower than %d thread(s)",
+           heuristic.median_secs / best.median_secs, best.threads);
+  }
+  printf("\n");
+  fflush(stdout);
+  return suboptimal;
+}
+
+int BenchmarkMain(int argc, char* argv[]) {
+  std::vector<BenchmarkShape> shapes;
+  if (!AppendBenchmarkShapeArgs(argc - 1, argv + 1, &shapes)) {
+    return 1;
+  }
+  if (shapes.empty()) {
+    shapes = ThreadScalingShapes();
+  }
+
+  std::vector<int> thread_counts;
+  if (const char* threads_env = getenv("THREADS")) {
+    for (const char* p = threads_env; *p;) {
+      char* end;
+      const long threads = strtol(p, &end, 10);
+      if (end == p || threads <= 0) {
+        fprintf(stderr, "Malformed THREADS: %s\n", threads_env);
+        return 1;
+      }
+      thread_counts.push_back(static_cast<int>(threads));
+      p = *end == ',' ? end + 1 : end;
+    }
+  } else {
+    for (int i = 1; i <= GetHardwareConcurrency(0); i++) {
+      thread_counts.push_back(i);
+    }
+  }
+  thread_counts.push_back(1);
+  std::sort(thread_counts.begin(), thread_counts.end());
+  thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()),
+                      thread_counts.end());
+  const char* threshold_env = getenv("THRESHOLD");
+  const double threshold = threshold_env ? atof(threshold_env) : 0.05;
+
+  int suboptimal_count = 0;
+  for (const BenchmarkShape& shape : shapes) {
+    suboptimal_count += BenchmarkShapeScaling(shape, thread_counts, threshold);
+  }
+  printf("\nHowManyThreads was suboptimal for %d of %d shapes.\n",
+         suboptimal_count, static_cast<int>(shapes.size()));
+  return 0;
+}
+
+}  // namespace gemmlowp
+
+int main(int argc, char* argv[]) {
+  return gemmlowp::BenchmarkMain(argc, argv);
+}
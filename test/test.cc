@@ -15,11 +15,13 @@
 #include "test.h"
 
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
 #include <memory>
+#include <new>
 #include <string>
 #include <vector>
 #ifdef __APPLE__
@@ -30,6 +32,57 @@
 #include "../internal/kernel_reference.h"
 #include "test_data.h"
 
+// Counts the calls to the global operator new, see
+// TestScratchArenaNoHeapAllocation. All the replaceable forms are replaced,
+// so that none of them mixes with the library's, and not inlined, so that
+// the compiler does not see malloc and free behind new and delete
+// expressions (-Wmismatched-new-delete).
+static std::atomic<std::size_t> g_operator_new_calls(0);
+
+GEMMLOWP_NOINLINE void* operator new(std::size_t size,
+                                     const std::nothrow_t&) noexcept {
+  g_operator_new_calls++;
+  return std::malloc(size ? size : 1);
+}
+
+GEMMLOWP_NOINLINE void* operator new(std::size_t size) {
+  if (void* p = operator new(size, std::nothrow)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+GEMMLOWP_NOINLINE void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+GEMMLOWP_NOINLINE void* operator new[](std::size_t size,
+                                       const std::nothrow_t&) noexcept {
+  return operator new(size, std::nothrow);
+}
+
+GEMMLOWP_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+
+GEMMLOWP_NOINLINE void operator delete[](void* p) noexcept { std::free(p); }
+
+GEMMLOWP_NOINLINE void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+GEMMLOWP_NOINLINE void operator delete[](void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+GEMMLOWP_NOINLINE void operator delete(void* p,
+                                       const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+GEMMLOWP_NOINLINE void operator delete[](void* p,
+                                         const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
 namespace gemmlowp {
 
 void ReferenceEightBitIntGemm(bool transpose_a, bool transpose_b,
@@ -1105,6 +1158,1029 @@ void TestMultithreadedPerChannelQuantization() {
   Check(good);
 }
 
+// Checks that a 4-bit LHS given as a NibbleMatrixMap gives exactly the same
+// results as the same LHS given as an ordinary uint8 MatrixMap.
+template <MapOrder LhsOrder, typename GemmContextType>
+void TestNibbleLhs(GemmContextType* context, int rows, int depth, int cols) {
+  // Use a stride and a start index that are not multiples of 2, so that
+  // rows/columns of the LHS start at both even and odd nibble indices.
+  const int lhs_inner_size = LhsOrder == MapOrder::RowMajor ? depth : rows;
+  const int lhs_outer_size = LhsOrder == MapOrder::RowMajor ? rows : depth;
+  const int lhs_stride = lhs_inner_size | 1;
+  const int lhs_start_index = 1;
+  std::vector<std::uint8_t> lhs_nibbles(
+      (lhs_start_index + lhs_stride * lhs_outer_size + 1) / 2 + 1, 0);
+  std::vector<std::uint8_t> lhs_bytes(rows * depth);
+  MatrixMap<std::uint8_t, LhsOrder> lhs_bytes_map(lhs_bytes.data(), rows,
+                                                  depth);
+  for (int r = 0; r < rows; r++) {
+    for (int d = 0; d < depth; d++) {
+      const std::uint8_t val = Random() % 16;
+      lhs_bytes_map(r, d) = val;
+      const int i = lhs_start_index +
+                    (LhsOrder == MapOrder::RowMajor ? r * lhs_stride + d
+                                                    : d * lhs_stride + r);
+      lhs_nibbles[i / 2] |= val << (4 * (i % 2));
+    }
+  }
+  const NibbleMatrixMap<LhsOrder> lhs_nibble_map(
+      lhs_nibbles.data(), lhs_start_index, rows, depth, lhs_stride);
+  const MatrixMap<const std::uint8_t, LhsOrder> lhs_byte_map(lhs_bytes.data(),
+                                                             rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<typename DefaultL8R8BitDepthParams::RhsRange>(&rhs);
+
+  std::vector<std::int32_t> lhs_offset_data(rows);
+  for (int r = 0; r < rows; r++) {
+    lhs_offset_data[r] = -(Random() % 16);
+  }
+  const OffsetColMap lhs_offset(lhs_offset_data.data(), rows);
+  const OffsetRowDup rhs_offset(-(Random() % 256), cols);
+
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+  Matrix<std::int32_t, MapOrder::ColMajor> actual(rows, cols);
+  GemmWithOutputPipelinePC<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+      context, lhs_byte_map, rhs.const_map(), &expected.map(), lhs_offset,
+      rhs_offset, std::make_tuple());
+  GemmWithOutputPipelinePC<std::uint8_t, std::int32_t, L4R8BitDepthParams>(
+      context, lhs_nibble_map, rhs.const_map(), &actual.map(), lhs_offset,
+      rhs_offset, std::make_tuple());
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      Check(actual(r, c) == expected(r, c));
+    }
+  }
+}
+
+void TestNibbleLhs() {
+  GemmContext context;
+  for (int max_num_threads : {1, 4}) {
+    context.set_max_num_threads(max_num_threads);
+    for (const auto& shape : std::vector<std::array<int, 3>>{
+             {{1, 1, 1}},
+             {{7, 9, 1}},
+             {{64, 33, 1}},
+             {{9, 7, 5}},
+             {{3, 17, 40}},
+             {{100, 101, 30}},
+             {{250, 129, 31}}}) {
+      TestNibbleLhs<MapOrder::RowMajor>(&context, shape[0], shape[1],
+                                        shape[2]);
+      TestNibbleLhs<MapOrder::ColMajor>(&context, shape[0], shape[1],
+                                        shape[2]);
+    }
+  }
+  printf("TestNibbleLhs: PASS\n");
+}
+
+// Checks BitPackedGemmWithOutputPipeline against dot products computed
+// entry by entry.
+template <BitEncoding Encoding, typename GemmContextType>
+void TestBitPackedGemm(GemmContextType* context, int rows, int depth,
+                       int cols) {
+  typedef BitPackedMatrixMap<Encoding, MapOrder::RowMajor> LhsType;
+  typedef BitPackedMatrixMap<Encoding, MapOrder::ColMajor> RhsType;
+  // Pad lines with an extra word of random garbage, which must be ignored,
+  // as must be the unused bits at the end of each line.
+  const int lhs_stride = LhsType::WordsPerLine(depth) + 1;
+  const int rhs_stride = RhsType::WordsPerLine(depth) + 1;
+  std::vector<std::uint64_t> lhs_data(rows * lhs_stride);
+  std::vector<std::uint64_t> rhs_data(cols * rhs_stride);
+  for (auto& w : lhs_data) {
+    w = (std::uint64_t(RandomEngine()()) << 32) ^ RandomEngine()();
+  }
+  for (auto& w : rhs_data) {
+    w = (std::uint64_t(RandomEngine()()) << 32) ^ RandomEngine()();
+  }
+  const LhsType lhs(lhs_data.data(), rows, depth, lhs_stride);
+  const RhsType rhs(rhs_data.data(), depth, cols, rhs_stride);
+
+  Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+  BitPackedGemmWithOutputPipeline<std::int32_t>(
+      context, lhs, rhs, &result.map(), std::make_tuple());
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      std::int32_t expected = 0;
+      for (int d = 0; d < depth; d++) {
+        expected += lhs(r, d) * rhs(d, c);
+      }
+      Check(result(r, c) == expected);
+    }
+  }
+}
+
+void TestBitPackedGemm() {
+  const std::vector<std::array<int, 3>> shapes = {
+      {{1, 1, 1}},    {{5, 63, 3}},       {{9, 64, 7}},     {{3, 300, 17}},
+      {{33, 700, 9}}, {{200, 1000, 100}}, {{40, 3000, 40}}};
+  GemmContext context;
+  for (int max_num_threads : {1, 4}) {
+    context.set_max_num_threads(max_num_threads);
+    // Exercise also the L1 blocking in the depth dimension.
+    for (int l1_bytes_to_use : {kDefaultL1CacheSize, 1024}) {
+      context.set_l1_bytes_to_use(l1_bytes_to_use);
+      // Also on a context with a scratch arena, which aborts if
+      // BitPackedGemmScratchSize is too small.
+      GemmContext arena_context;
+      arena_context.set_max_num_threads(max_num_threads);
+      arena_context.set_l1_bytes_to_use(l1_bytes_to_use);
+      ScratchSize scratch_size;
+      for (const auto& shape : shapes) {
+        scratch_size = MaxScratchSize(
+            scratch_size,
+            MaxScratchSize(BitPackedGemmScratchSize<BitEncoding::Binary>(
+                               &arena_context, shape[0], shape[1], shape[2]),
+                           BitPackedGemmScratchSize<BitEncoding::Ternary>(
+                               &arena_context, shape[0], shape[1], shape[2])));
+      }
+      void* arena =
+          aligned_alloc(Allocator::kAlignment, scratch_size.total_bytes());
+      arena_context.set_scratch_arena(arena, scratch_size);
+      for (GemmContext* c : {&context, &arena_context}) {
+        for (const auto& shape : shapes) {
+          TestBitPackedGemm<BitEncoding::Binary>(c, shape[0], shape[1],
+                                                 shape[2]);
+          TestBitPackedGemm<BitEncoding::Ternary>(c, shape[0], shape[1],
+                                                  shape[2]);
+        }
+      }
+      arena_context.set_scratch_arena(nullptr, ScratchSize());
+      aligned_free(arena);
+    }
+  }
+  printf("TestBitPackedGemm: PASS\n");
+}
+
+// Checks Int8Int16GemmWithOutputPipelinePC against a naive int64 reference,
+// with int16 entries spanning their whole range.
+template <MapOrder LhsOrder, MapOrder RhsOrder, typename GemmContextType>
+void TestInt8Int16Gemm(GemmContextType* context, int rows, int depth,
+                       int cols) {
+  Matrix<std::int8_t, LhsOrder> lhs(rows, depth);
+  Matrix<std::int16_t, RhsOrder> rhs(depth, cols);
+  for (int r = 0; r < rows; r++) {
+    for (int d = 0; d < depth; d++) {
+      lhs(r, d) = static_cast<std::int8_t>(Random());
+    }
+  }
+  for (int d = 0; d < depth; d++) {
+    for (int c = 0; c < cols; c++) {
+      rhs(d, c) = static_cast<std::int16_t>(Random());
+    }
+  }
+  std::vector<std::int32_t> lhs_offset_data(rows);
+  for (int r = 0; r < rows; r++) {
+    lhs_offset_data[r] = Random() % 17 - 8;
+  }
+  const OffsetColMap lhs_offset(lhs_offset_data.data(), rows);
+  const OffsetRowDup rhs_offset(Random() % 201 - 100, cols);
+
+  Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+  Int8Int16GemmWithOutputPipelinePC<std::int32_t>(
+      context, lhs.const_map(), rhs.const_map(), &result.map(), lhs_offset,
+      rhs_offset, std::make_tuple());
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      std::int64_t expected = 0;
+      for (int d = 0; d < depth; d++) {
+        expected += std::int64_t(lhs(r, d) + lhs_offset(r)) *
+                    (rhs(d, c) + rhs_offset(c));
+      }
+      Check(result(r, c) == expected);
+    }
+  }
+}
+
+void TestInt8Int16Gemm() {
+  GemmContext context;
+  for (int max_num_threads : {1, 4}) {
+    context.set_max_num_threads(max_num_threads);
+    // Depths are kept small enough for the results to fit in int32.
+    for (const auto& shape : std::vector<std::array<int, 3>>{
+             {{1, 1, 1}},
+             {{13, 7, 1}},
+             {{9, 33, 5}},
+             {{3, 17, 40}},
+             {{100, 101, 30}},
+             {{250, 200, 31}}}) {
+      TestInt8Int16Gemm<MapOrder::RowMajor, MapOrder::ColMajor>(
+          &context, shape[0], shape[1], shape[2]);
+      TestInt8Int16Gemm<MapOrder::ColMajor, MapOrder::RowMajor>(
+          &context, shape[0], shape[1], shape[2]);
+    }
+  }
+  printf("TestInt8Int16Gemm: PASS\n");
+}
+
+// Checks HybridFloatGemm against the float product of the dequantized LHS by
+// the float RHS. The only error allowed is that of quantizing the RHS, i.e.
+// half a quantization step per RHS entry.
+template <MapOrder LhsOrder, MapOrder RhsOrder, typename GemmContextType>
+void TestHybridFloatGemm(GemmContextType* context, int rows, int depth,
+                         int cols) {
+  Matrix<std::uint8_t, LhsOrder> lhs(rows, depth);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  std::vector<std::int32_t> lhs_offset_data(rows);
+  std::vector<float> lhs_scale_data(rows);
+  for (int r = 0; r < rows; r++) {
+    lhs_offset_data[r] = -static_cast<std::int32_t>(Random() % 256);
+    lhs_scale_data[r] = (1 + Random() % 100) / 1000.f;
+  }
+  const OffsetColMap lhs_offset(lhs_offset_data.data(), rows);
+  const VectorMap<const float, VectorShape::Col> lhs_scale(
+      lhs_scale_data.data(), rows);
+
+  // Column c has values in [-c, 2c] (up to a factor), so that the first
+  // column is all zeros and the others have various ranges.
+  Matrix<float, RhsOrder> rhs(depth, cols);
+  for (int d = 0; d < depth; d++) {
+    for (int c = 0; c < cols; c++) {
+      rhs(d, c) = c * ((Random() % 301) / 100.f - 1.f);
+    }
+  }
+
+  Matrix<float, MapOrder::ColMajor> result(rows, cols);
+  HybridFloatGemm(context, lhs.const_map(), lhs_offset, lhs_scale,
+                  rhs.const_map(), &result.map());
+
+  for (int c = 0; c < cols; c++) {
+    float min = 0.f;
+    float max = 0.f;
+    for (int d = 0; d < depth; d++) {
+      min = std::min(min, rhs(d, c));
+      max = std::max(max, rhs(d, c));
+    }
+    const float rhs_step = (max - min) / 255.f;
+    for (int r = 0; r < rows; r++) {
+      double expected = 0;
+      double lhs_abs_sum = 0;
+      for (int d = 0; d < depth; d++) {
+        const double l = lhs_scale(r) * (lhs(r, d) + lhs_offset(r));
+        expected += l * rhs(d, c);
+        lhs_abs_sum += std::abs(l);
+      }
+      const double tolerance =
+          lhs_abs_sum * rhs_step * 0.51 + 1e-5 * std::abs(expected) + 1e-5;
+      Check(std::abs(result(r, c) - expected) <= tolerance);
+    }
+  }
+}
+
+void TestHybridFloatGemm() {
+  const std::vector<std::array<int, 3>> shapes = {
+      {{1, 1, 1}},  {{13, 7, 1}},     {{9, 33, 5}},
+      {{3, 17, 40}}, {{100, 101, 30}}, {{250, 300, 70}},
+      // Deep enough for depth blocking, which the quantizing RHS does not
+      // get once transposed into the LHS.
+      {{16, 70000, 64}}};
+  GemmContext context;
+  for (int max_num_threads : {1, 4}) {
+    context.set_max_num_threads(max_num_threads);
+    // Also on a context with a scratch arena, which aborts if
+    // HybridFloatGemmScratchSize is too small.
+    GemmContext arena_context;
+    arena_context.set_max_num_threads(max_num_threads);
+    ScratchSize scratch_size;
+    for (const auto& shape : shapes) {
+      scratch_size = MaxScratchSize(
+          scratch_size, HybridFloatGemmScratchSize(&arena_context, shape[0],
+                                                   shape[1], shape[2]));
+    }
+    void* arena =
+        aligned_alloc(Allocator::kAlignment, scratch_size.total_bytes());
+    arena_context.set_scratch_arena(arena, scratch_size);
+    for (GemmContext* c : {&context, &arena_context}) {
+      for (const auto& shape : shapes) {
+        TestHybridFloatGemm<MapOrder::RowMajor, MapOrder::ColMajor>(
+            c, shape[0], shape[1], shape[2]);
+        TestHybridFloatGemm<MapOrder::ColMajor, MapOrder::RowMajor>(
+            c, shape[0], shape[1], shape[2]);
+      }
+    }
+    arena_context.set_scratch_arena(nullptr, ScratchSize());
+    aligned_free(arena);
+  }
+  printf("TestHybridFloatGemm: PASS\n");
+}
+
+// Checks that GEMMs on a context with a scratch arena sized by
+// GemmScratchSize give the same results as with internal allocation, and
+// that they do use the arena.
+void TestScratchArena() {
+  const std::vector<std::array<int, 3>> shapes = {
+      {{1, 1, 1}}, {{100, 30, 7}}, {{7, 30, 100}}, {{300, 400, 200}}};
+  for (int max_num_threads : {1, 4}) {
+    GemmContext context;
+    context.set_max_num_threads(max_num_threads);
+    ScratchSize scratch_size;
+    for (const auto& shape : shapes) {
+      scratch_size = MaxScratchSize(
+          scratch_size, GemmScratchSize<DefaultL8R8BitDepthParams>(
+                            &context, shape[0], shape[1], shape[2]));
+    }
+    const std::size_t arena_bytes = scratch_size.total_bytes();
+    Check(arena_bytes > 0);
+    std::uint8_t* arena = static_cast<std::uint8_t*>(
+        aligned_alloc(Allocator::kAlignment, arena_bytes));
+    memset(arena, 0xab, arena_bytes);
+    context.set_scratch_arena(arena, scratch_size);
+
+    GemmContext reference_context;
+    reference_context.set_max_num_threads(max_num_threads);
+    for (const auto& shape : shapes) {
+      const int rows = shape[0];
+      const int depth = shape[1];
+      const int cols = shape[2];
+      Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+      Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+      MakeRandom<OperandRange<0, 255>>(&lhs);
+      MakeRandom<OperandRange<0, 255>>(&rhs);
+      Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+      Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+      GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                             DefaultL8R8BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &result.map(), -100,
+          -50, std::make_tuple());
+      GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                             DefaultL8R8BitDepthParams>(
+          &reference_context, lhs.const_map(), rhs.const_map(),
+          &expected.map(), -100, -50, std::make_tuple());
+      for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+          Check(result(r, c) == expected(r, c));
+        }
+      }
+    }
+
+    std::size_t untouched_bytes = 0;
+    for (std::size_t i = 0; i < arena_bytes; i++) {
+      untouched_bytes += arena[i] == 0xab;
+    }
+    Check(untouched_bytes < arena_bytes);
+    context.set_scratch_arena(nullptr, ScratchSize());
+    aligned_free(arena);
+  }
+  printf("TestScratchArena: PASS\n");
+}
+
+// Checks that, once warm, multi-threaded GEMMs on a context with a scratch
+// arena make no heap allocation.
+void TestScratchArenaNoHeapAllocation() {
+  const int rows = 300;
+  const int depth = 400;
+  const int cols = 200;
+  GemmContext context;
+  context.set_max_num_threads(4);
+  // Also bit-packed GEMMs, whose tasks live in the same storage.
+  const ScratchSize scratch_size = MaxScratchSize(
+      GemmScratchSize<DefaultL8R8BitDepthParams>(&context, rows, depth, cols),
+      BitPackedGemmScratchSize<BitEncoding::Binary>(&context, rows, depth,
+                                                    cols));
+  void* arena =
+      aligned_alloc(Allocator::kAlignment, scratch_size.total_bytes());
+  context.set_scratch_arena(arena, scratch_size);
+
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  typedef BitPackedMatrixMap<BitEncoding::Binary, MapOrder::RowMajor>
+      BitPackedLhs;
+  typedef BitPackedMatrixMap<BitEncoding::Binary, MapOrder::ColMajor>
+      BitPackedRhs;
+  std::vector<std::uint64_t> bit_packed_lhs_data(
+      rows * BitPackedLhs::WordsPerLine(depth));
+  std::vector<std::uint64_t> bit_packed_rhs_data(
+      cols * BitPackedRhs::WordsPerLine(depth));
+  const BitPackedLhs bit_packed_lhs(bit_packed_lhs_data.data(), rows, depth,
+                                    BitPackedLhs::WordsPerLine(depth));
+  const BitPackedRhs bit_packed_rhs(bit_packed_rhs_data.data(), depth, cols,
+                                    BitPackedRhs::WordsPerLine(depth));
+  Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+  auto run_gemm = [&]() {
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+    BitPackedGemmWithOutputPipeline<std::int32_t>(
+        &context, bit_packed_lhs, bit_packed_rhs, &result.map(),
+        std::make_tuple());
+  };
+  // The warm-up creates the worker threads, and its call log checks that
+  // the GEMM is multi-threaded.
+  context.set_call_log_capacity(1);
+  run_gemm();
+  Check(context.call_log()->Records().back().thread_count > 1);
+  context.set_call_log_capacity(0);
+  run_gemm();
+
+  const std::size_t operator_new_calls_before = g_operator_new_calls;
+  for (int i = 0; i < 10; i++) {
+    run_gemm();
+  }
+  Check(g_operator_new_calls == operator_new_calls_before);
+
+  context.set_scratch_arena(nullptr, ScratchSize());
+  aligned_free(arena);
+  printf("TestScratchArenaNoHeapAllocation: PASS\n");
+}
+
+void TestScratchTrimming() {
+  GemmContext context;
+  context.set_max_num_threads(4);
+  auto run_gemm = [&context](int size) {
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(size, size);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(size, size);
+    MakeRandom<OperandRange<0, 255>>(&lhs);
+    MakeRandom<OperandRange<0, 255>>(&rhs);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(size, size);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+  };
+
+  run_gemm(300);
+  // Counts the worker threads' storage, also on a const context.
+  const GemmContext& const_context = context;
+  const std::size_t retained_bytes = const_context.retained_scratch_bytes();
+  Check(retained_bytes > context.allocator()->storage_size());
+  context.TrimScratch(retained_bytes / 2);
+  Check(context.retained_scratch_bytes() <= retained_bytes / 2);
+  context.TrimScratch(0);
+  Check(context.retained_scratch_bytes() == 0);
+
+  // A large GEMM followed by small ones: with decay, the storage shrinks
+  // back after a few calls.
+  context.set_scratch_decay_calls(2);
+  run_gemm(300);
+  const std::size_t peak_retained_bytes = context.retained_scratch_bytes();
+  for (int i = 0; i < 3; i++) {
+    run_gemm(40);
+  }
+  Check(context.retained_scratch_bytes() < peak_retained_bytes);
+
+  context.set_max_retained_scratch_bytes(0);
+  run_gemm(300);
+  Check(context.retained_scratch_bytes() == 0);
+  printf("TestScratchTrimming: PASS\n");
+}
+
+void TestGemmWarmUp() {
+  const std::vector<GemmShape> shapes = {{100, 30, 7}, {300, 400, 200}};
+  for (bool run_gemms : {false, true}) {
+    GemmContext context;
+    context.set_max_num_threads(4);
+    GemmWarmUp<DefaultL8R8BitDepthParams>(&context, shapes, run_gemms);
+    const std::size_t warm_bytes = context.retained_scratch_bytes();
+    Check(warm_bytes >= GemmScratchSize<DefaultL8R8BitDepthParams>(
+                            &context, 300, 400, 200)
+                            .total_bytes());
+
+    // The GEMMs then find their scratch storage already allocated.
+    for (const GemmShape& shape : shapes) {
+      Matrix<std::uint8_t, MapOrder::RowMajor> lhs(shape.rows, shape.depth);
+      Matrix<std::uint8_t, MapOrder::ColMajor> rhs(shape.depth, shape.cols);
+      MakeRandom<OperandRange<0, 255>>(&lhs);
+      MakeRandom<OperandRange<0, 255>>(&rhs);
+      Matrix<std::int32_t, MapOrder::ColMajor> result(shape.rows, shape.cols);
+      GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                             DefaultL8R8BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &result.map(), -100,
+          -50, std::make_tuple());
+    }
+    Check(context.retained_scratch_bytes() == warm_bytes);
+  }
+  printf("TestGemmWarmUp: PASS\n");
+}
+
+void TestCacheSizeDetection() {
+  Check(CountCpusInList("0") == 1);
+  Check(CountCpusInList("0-3,8-11") == 8);
+  Check(CountCpusInList("2,4,6") == 3);
+
+  GemmContext context;
+  if (!context.UseDetectedCacheSizes()) {
+    printf("TestCacheSizeDetection: cache sizes not detected, skipped\n");
+    return;
+  }
+  Check(context.l1_bytes_to_use() >= 1024);
+  Check(context.l2_bytes_to_use() >= context.l1_bytes_to_use());
+
+  // Blocking for the detected sizes must not change the results.
+  GemmContext reference_context;
+  const int rows = 300, depth = 500, cols = 200;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+      std::make_tuple());
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &reference_context, lhs.const_map(), rhs.const_map(), &expected.map(),
+      -100, -50, std::make_tuple());
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      Check(result(r, c) == expected(r, c));
+    }
+  }
+  printf("TestCacheSizeDetection: PASS\n");
+}
+
+void TestL3Blocking() {
+  const int rows = 700, depth = 500, cols = 600;
+  const int l2_bytes = 64 * 1024;
+  const int l3_bytes = 512 * 1024;
+  typedef DefaultKernel<DefaultL8R8BitDepthParams>::Format KernelFormat;
+  BlockParams block_params;
+  block_params.Init<KernelFormat>(rows, cols, depth, 1, kDefaultL1CacheSize,
+                                  l2_bytes, kDefaultL2RhsFactor, l3_bytes);
+  // L3 panels of several L2 blocks, not covering all columns.
+  Check(block_params.l3_cols > block_params.l2_cols);
+  Check(block_params.l3_cols % block_params.l2_cols == 0);
+  Check(block_params.l3_cols < cols);
+
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+  GemmContext reference_context;
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &reference_context, lhs.const_map(), rhs.const_map(), &expected.map(),
+      -100, -50, std::make_tuple());
+
+  for (int max_num_threads : {1, 4}) {
+    GemmContext context;
+    context.set_max_num_threads(max_num_threads);
+    context.set_l2_bytes_to_use(l2_bytes);
+    context.set_l3_bytes_to_use(l3_bytes);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+    for (int r = 0; r < rows; r++) {
+      for (int c = 0; c < cols; c++) {
+        Check(result(r, c) == expected(r, c));
+      }
+    }
+  }
+  printf("TestL3Blocking: PASS\n");
+}
+
+void TestL2DepthBlocking() {
+  // An odd depth, so that the last depth block is partial.
+  const int rows = 300, depth = 3001, cols = 200;
+  const int l2_bytes = 64 * 1024;
+  typedef DefaultKernel<DefaultL8R8BitDepthParams>::Format KernelFormat;
+  BlockParams block_params;
+  block_params.Init<KernelFormat>(rows, cols, depth, 1, kDefaultL1CacheSize,
+                                  l2_bytes, kDefaultL2RhsFactor, 0, true);
+  // Several depth blocks, aligned on L1 depth blocks.
+  Check(block_params.l2_depth < depth);
+  Check(block_params.packed_rhs_depth >= depth);
+  Check(block_params.l2_depth % block_params.l1_depth == 0);
+  // Depth blocking is opt-in.
+  BlockParams unblocked_params;
+  unblocked_params.Init<KernelFormat>(rows, cols, depth, 1,
+                                      kDefaultL1CacheSize, l2_bytes,
+                                      kDefaultL2RhsFactor);
+  Check(unblocked_params.l2_depth == unblocked_params.packed_rhs_depth);
+
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+  GemmContext reference_context;
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &reference_context, lhs.const_map(), rhs.const_map(), &expected.map(),
+      -100, -50, std::make_tuple());
+
+  for (int max_num_threads : {1, 4}) {
+    GemmContext context;
+    context.set_max_num_threads(max_num_threads);
+    context.set_l2_bytes_to_use(l2_bytes);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+    for (int r = 0; r < rows; r++) {
+      for (int c = 0; c < cols; c++) {
+        Check(result(r, c) == expected(r, c));
+      }
+    }
+  }
+  printf("TestL2DepthBlocking: PASS\n");
+}
+
+void TestTuningTable() {
+  TuningTable table;
+  Check(!table.Lookup(100, 100, 100));
+  TunedBlockParams small_params;
+  small_params.l1_bytes_to_use = 16 * 1024;
+  small_params.l2_bytes_to_use = 256 * 1024;
+  small_params.l2_rhs_factor = 0.75f;
+  small_params.max_num_threads = 1;
+  TunedBlockParams large_params = small_params;
+  large_params.l2_bytes_to_use = 64 * 1024;
+  large_params.max_num_threads = 4;
+  table.Add(64, 64, 16, small_params);
+  table.Add(1000, 500, 700, large_params);
+
+  // Exact matches, including of the transposed shape, and nearest shapes.
+  Check(table.Lookup(64, 64, 16)->l2_bytes_to_use == 256 * 1024);
+  Check(table.Lookup(16, 64, 64)->l2_bytes_to_use == 256 * 1024);
+  Check(table.Lookup(70, 50, 20)->l2_bytes_to_use == 256 * 1024);
+  Check(table.Lookup(700, 600, 900)->l2_bytes_to_use == 64 * 1024);
+
+  const char* path = "gemmlowp_test_tuning_table.txt";
+  Check(table.SaveToFile(path));
+  TuningTable loaded;
+  Check(loaded.LoadFromFile(path));
+  remove(path);
+  Check(loaded.entries().size() == 2);
+  const TunedBlockParams* loaded_params = loaded.Lookup(1000, 500, 700);
+  Check(loaded_params->l1_bytes_to_use == large_params.l1_bytes_to_use);
+  Check(loaded_params->l2_bytes_to_use == large_params.l2_bytes_to_use);
+  Check(loaded_params->l2_rhs_factor == large_params.l2_rhs_factor);
+  Check(loaded_params->max_num_threads == large_params.max_num_threads);
+
+  // Lines with non-positive cache sizes or l2_rhs_factor are rejected, and
+  // the entries before them kept.
+  for (const char* bad_line :
+       {"64 64 16 0 262144 0.75 0 1", "64 64 16 16384 -1 0.75 0 1",
+        "64 64 16 16384 262144 0 0 1", "64 64 16 16384 262144 nan 0 1"}) {
+    FILE* file = fopen(path, "w");
+    Check(file);
+    fprintf(file, "1000 500 700 16384 65536 0.75 0 4\n%s\n", bad_line);
+    fclose(file);
+    TuningTable rejected;
+    Check(!rejected.LoadFromFile(path));
+    remove(path);
+    Check(rejected.entries().size() == 1);
+  }
+
+  // GEMMs using the table, here with small L2 blocks, give the same results.
+  const int rows = 1000, depth = 500, cols = 700;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+  GemmContext context;
+  context.set_max_num_threads(0);
+  context.set_tuning_table(&loaded);
+  GemmContext reference_context;
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+      std::make_tuple());
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &reference_context, lhs.const_map(), rhs.const_map(), &expected.map(),
+      -100, -50, std::make_tuple());
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      Check(result(r, c) == expected(r, c));
+    }
+  }
+  printf("TestTuningTable: PASS\n");
+}
+
+template <typename Params>
+void CheckFixedShapeBlockParams(int l2_bytes) {
+  typedef DefaultKernel<DefaultL8R8BitDepthParams>::Format KernelFormat;
+  BlockParams expected;
+  expected.Init<KernelFormat>(Params::kRows, Params::kCols, Params::kDepth, 1,
+                              kDefaultL1CacheSize, l2_bytes,
+                              kDefaultL2RhsFactor);
+  const BlockParams actual = Params::Get();
+  Check(actual.l1_rows == expected.l1_rows);
+  Check(actual.l1_cols == expected.l1_cols);
+  Check(actual.l1_depth == expected.l1_depth);
+  Check(actual.l2_rows == expected.l2_rows);
+  Check(actual.l2_cols == expected.l2_cols);
+  Check(actual.l2_depth == expected.l2_depth);
+  Check(actual.packed_rhs_depth == expected.packed_rhs_depth);
+  Check(actual.l3_cols == expected.l3_cols);
+}
+
+// Compares GemmFixedShape with GemmWithOutputPipeline.
+template <int Rows, int Depth, int Cols>
+void TestFixedShapeGemmShape() {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(Rows, Depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(Depth, Cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(Rows, Cols);
+  Matrix<std::int32_t, MapOrder::ColMajor> result(Rows, Cols);
+  GemmContext context;
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &expected.map(), -100, -50,
+      std::make_tuple());
+  GemmFixedShape<Rows, Depth, Cols, std::uint8_t, std::int32_t,
+                 DefaultL8R8BitDepthParams>(&context, lhs.const_map(),
+                                            rhs.const_map(), &result.map(),
+                                            -100, -50, std::make_tuple());
+  for (int r = 0; r < Rows; r++) {
+    for (int c = 0; c < Cols; c++) {
+      Check(result(r, c) == expected(r, c));
+    }
+  }
+
+  // Also in an arena sized by FixedShapeGemmScratchSize, which aborts if
+  // that is too small, on a context whose own cache settings are smaller
+  // than the default ones that these GEMMs block for.
+  const ScratchSize scratch_size =
+      FixedShapeGemmScratchSize<Rows, Depth, Cols,
+                                DefaultL8R8BitDepthParams>();
+  void* arena =
+      aligned_alloc(Allocator::kAlignment, scratch_size.total_bytes());
+  GemmContext arena_context;
+  arena_context.set_l1_bytes_to_use(4 * 1024);
+  arena_context.set_l2_bytes_to_use(16 * 1024);
+  arena_context.set_scratch_arena(arena, scratch_size);
+  GemmFixedShape<Rows, Depth, Cols, std::uint8_t, std::int32_t,
+                 DefaultL8R8BitDepthParams>(&arena_context, lhs.const_map(),
+                                            rhs.const_map(), &result.map(),
+                                            -100, -50, std::make_tuple());
+  arena_context.set_scratch_arena(nullptr, ScratchSize());
+  aligned_free(arena);
+  for (int r = 0; r < Rows; r++) {
+    for (int c = 0; c < Cols; c++) {
+      Check(result(r, c) == expected(r, c));
+    }
+  }
+}
+
+void TestFixedShapeGemm() {
+  typedef DefaultKernel<DefaultL8R8BitDepthParams>::Format KernelFormat;
+  CheckFixedShapeBlockParams<
+      FixedShapeBlockParams<KernelFormat, 1, 1, 1>>(kDefaultL2CacheSize);
+  CheckFixedShapeBlockParams<
+      FixedShapeBlockParams<KernelFormat, 100, 300, 21>>(kDefaultL2CacheSize);
+  CheckFixedShapeBlockParams<FixedShapeBlockParams<
+      KernelFormat, 1000, 1900, 900>>(kDefaultL2CacheSize);
+  const int kSmallL2Bytes = 64 * 1024;
+  typedef FixedShapeBlockParams<KernelFormat, 300, 500, 190,
+                                kDefaultL1CacheSize, kSmallL2Bytes>
+      SmallL2Params;
+  CheckFixedShapeBlockParams<SmallL2Params>(kSmallL2Bytes);
+
+  TestFixedShapeGemmShape<1, 1, 1>();
+  TestFixedShapeGemmShape<13, 37, 7>();
+  TestFixedShapeGemmShape<64, 64, 64>();
+  TestFixedShapeGemmShape<100, 300, 21>();
+  // Transposed, as rows < cols.
+  TestFixedShapeGemmShape<5, 100, 50>();
+
+  // Several L2 blocks, the last one partial.
+  Check(190 > SmallL2Params::l2_cols && 190 % SmallL2Params::l2_cols != 0);
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(300, 500);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(500, 190);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(300, 190);
+  Matrix<std::int32_t, MapOrder::ColMajor> result(300, 190);
+  GemmContext context;
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &expected.map(), -100, -50,
+      std::make_tuple());
+  typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+  typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+  const OffsetColDup lhs_offset(-100, 300);
+  const OffsetRowDup rhs_offset(-50, 190);
+  const auto lhs_map = lhs.const_map();
+  const auto rhs_map = rhs.const_map();
+  auto result_map = result.map();
+  const auto output_pipeline = std::make_tuple();
+  DefaultKernel<DefaultL8R8BitDepthParams> kernel;
+  FixedShapeGemmImpl<KernelFormat, SmallL2Params, decltype(lhs_map),
+                     decltype(rhs_map), decltype(result_map), OffsetColDup,
+                     OffsetRowDup, decltype(output_pipeline)>
+      impl(&context, kernel, lhs_map, rhs_map, &result_map, lhs_offset,
+           rhs_offset, output_pipeline);
+  impl.Run();
+  for (int r = 0; r < 300; r++) {
+    for (int c = 0; c < 190; c++) {
+      Check(result(r, c) == expected(r, c));
+    }
+  }
+  printf("TestFixedShapeGemm: PASS\n");
+}
+
+void TestStageStats() {
+  const int rows = 1000, depth = 500, cols = 700;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+  auto run = [&](GemmContext* context) {
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+  };
+  auto check_all_zero = [](const GemmStageStats& stats) {
+    for (const GemmStageTotals& totals : stats.stages) {
+      Check(!totals.nanoseconds && !totals.bytes && !totals.calls);
+    }
+  };
+
+  // Disabled by default.
+  GemmContext context;
+  run(&context);
+  check_all_zero(context.stage_stats());
+
+  // Single-threaded: the result is unpacked once and, without depth
+  // blocking, the LHS is packed once.
+  context.set_stage_stats_enabled(true);
+  run(&context);
+  GemmStageStats stats = context.stage_stats();
+  Check(stats[GemmStage::PackLhs].bytes == std::uint64_t(rows) * depth);
+  Check(stats[GemmStage::PackRhs].bytes >= std::uint64_t(depth) * cols);
+  Check(stats[GemmStage::Compute].calls > 0);
+  Check(stats[GemmStage::Compute].nanoseconds > 0);
+  Check(stats[GemmStage::UnpackResult].bytes ==
+        std::uint64_t(rows) * cols * sizeof(std::int32_t));
+  Check(!stats[GemmStage::WorkerWait].calls);
+  Check(!stats[GemmStage::MainWait].calls);
+
+  context.ResetStageStats();
+  check_all_zero(context.stage_stats());
+
+  // Multi-threaded: each of the 3 workers waits once per L3 block of the
+  // RHS, as does the calling thread, and each task packs its rows of the
+  // LHS once per L3 block.
+  context.set_max_num_threads(4);
+  run(&context);
+  stats = context.stage_stats();
+  const std::uint64_t l3_blocks = stats[GemmStage::MainWait].calls;
+  Check(l3_blocks > 0);
+  Check(stats[GemmStage::WorkerWait].calls == 3 * l3_blocks);
+  Check(stats[GemmStage::PackRhs].bytes == std::uint64_t(depth) * cols);
+  Check(stats[GemmStage::PackLhs].bytes ==
+        std::uint64_t(rows) * depth * l3_blocks);
+  Check(stats[GemmStage::UnpackResult].bytes ==
+        std::uint64_t(rows) * cols * sizeof(std::int32_t));
+
+  // Disabling keeps the counters.
+  context.set_stage_stats_enabled(false);
+  run(&context);
+  Check(context.stage_stats()[GemmStage::MainWait].calls == l3_blocks);
+
+  // Hardware events are only counted where perf_event_open allows it.
+  context.ResetStageStats();
+  context.set_stage_stats_enabled(true);
+  context.set_stage_perf_events_enabled(true);
+  context.set_max_num_threads(1);
+  run(&context);
+  stats = context.stage_stats();
+  Check(stats[GemmStage::Compute].ops ==
+        2 * std::uint64_t(rows) * depth * cols);
+  const GemmStageTotals& compute = stats[GemmStage::Compute];
+  if (PerfCountersAvailable()) {
+    Check(compute.perf_event(PerfEvent::Cycles) > 0);
+    Check(compute.perf_event(PerfEvent::Instructions) > 0);
+  } else {
+    for (std::uint64_t count : compute.perf_events) {
+      Check(!count);
+    }
+  }
+
+  // Bytes are bytes, not entries: the int16 RHS entries of int8 x int16
+  // GEMMs take 2 bytes each once packed.
+  {
+    const int rows = 100, depth = 50, cols = 30;
+    Matrix<std::int8_t, MapOrder::RowMajor> lhs(rows, depth);
+    Matrix<std::int16_t, MapOrder::ColMajor> rhs(depth, cols);
+    MakeZero(&lhs);
+    MakeZero(&rhs);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+    context.ResetStageStats();
+    Int8Int16GemmWithOutputPipelinePC<std::int32_t>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(),
+        OffsetColDup(0, rows), OffsetRowDup(0, cols), std::make_tuple());
+    stats = context.stage_stats();
+    Check(stats[GemmStage::PackLhs].bytes == std::uint64_t(rows) * depth);
+    Check(stats[GemmStage::PackRhs].bytes ==
+          std::uint64_t(depth) * cols * sizeof(std::int16_t));
+    Check(stats[GemmStage::Compute].bytes ==
+          std::uint64_t(rows + cols * sizeof(std::int16_t)) * depth);
+  }
+  printf("TestStageStats: PASS\n");
+}
+
+void TestCallLog() {
+  GemmContext context;
+  context.set_max_num_threads(4);
+  context.set_call_log_capacity(2);
+  auto run = [&](int rows, int depth, int cols) {
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+    MakeRandom<OperandRange<0, 255>>(&lhs);
+    MakeRandom<OperandRange<0, 255>>(&rhs);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+  };
+  run(10, 20, 30);
+  run(30, 20, 10);
+  run(1000, 500, 700);
+
+  // The log keeps the last 2 calls, oldest first, with rows >= cols.
+  std::vector<GemmCallRecord> records = context.call_log()->Records();
+  Check(records.size() == 2);
+  Check(records[0].rows == 30 && records[0].depth == 20 &&
+        records[0].cols == 10);
+  Check(records[0].thread_count == 1);
+  Check(records[1].rows == 1000 && records[1].depth == 500 &&
+        records[1].cols == 700);
+  Check(records[1].thread_count == 4);
+  for (const GemmCallRecord& record : records) {
+    Check(record.kernel_name && *record.kernel_name);
+    Check(record.block_params.l2_rows > 0);
+    Check(record.nanoseconds > 0);
+    Check(record.stages[GemmStage::Compute].calls > 0);
+    Check(record.stages[GemmStage::UnpackResult].bytes ==
+          std::uint64_t(record.rows) * record.cols * sizeof(std::int32_t));
+  }
+  Check(records[1].stages[GemmStage::MainWait].calls > 0);
+  Check(!records[0].stages[GemmStage::MainWait].calls);
+  // The idle time of the workers before the call is not charged to it.
+  Check(!records[1].stages[GemmStage::WorkerWait].calls);
+  Check(!records[1].stages[GemmStage::WorkerWait].nanoseconds);
+
+  context.call_log()->Clear();
+  Check(context.call_log()->Records().empty());
+  context.set_call_log_capacity(0);
+  run(30, 20, 10);
+  Check(context.call_log()->Records().empty());
+  printf("TestCallLog: PASS\n");
+}
+
+void TestLoadImbalance() {
+  GemmContext context;
+  context.set_max_num_threads(4);
+  context.set_load_imbalance_stats_enabled(true);
+  auto run = [&](int rows, int depth, int cols) {
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+    MakeRandom<OperandRange<0, 255>>(&lhs);
+    MakeRandom<OperandRange<0, 255>>(&rhs);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                           DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -100, -50,
+        std::make_tuple());
+  };
+  // Single-threaded GEMMs have nothing to balance.
+  run(10, 20, 30);
+  Check(context.load_imbalance_stats().empty());
+
+  run(700, 500, 1000);
+  run(1000, 500, 700);
+  std::vector<LoadImbalanceEntry> entries = context.load_imbalance_stats();
+  Check(entries.size() == 1);
+  const LoadImbalanceEntry& entry = entries[0];
+  Check(entry.rows == 1000 && entry.depth == 500 && entry.cols == 700);
+  Check(entry.task_count == 4);
+  Check(entry.fan_outs >= 2 && entry.fan_outs % 2 == 0);
+  for (int i = 0; i < entry.task_count; i++) {
+    Check(entry.task_nanoseconds[i] > 0);
+    Check(entry.task_start_nanoseconds[i] <= entry.fan_out_nanoseconds);
+  }
+  Check(entry.max_task_nanoseconds <= entry.fan_out_nanoseconds);
+  Check(entry.last_start_nanoseconds <= entry.fan_out_nanoseconds);
+  Check(entry.main_wait_nanoseconds <= entry.fan_out_nanoseconds);
+  Check(entry.imbalance_ratio() >= 0.999 &&
+        entry.imbalance_ratio() <= entry.task_count);
+
+  context.ResetLoadImbalanceStats();
+  Check(context.load_imbalance_stats().empty());
+  context.set_load_imbalance_stats_enabled(false);
+  run(1000, 500, 700);
+  Check(context.load_imbalance_stats().empty());
+  printf("TestLoadImbalance: PASS\n");
+}
+
 // Runs a small set of hand-calculated data through the implementation.
 void TestWithSmallData() {
   const int m = 4;
@@ -1676,6 +2752,9 @@ void test() {
   TestExhaustively<DefaultL8R8BitDepthParams>();
   TestExhaustively<L8R8WithLhsNonzeroBitDepthParams>();
   TestExhaustively<DefaultL7R5BitDepthParams>();  // legacy, same as L8R8
+  TestExhaustively<L7R7BitDepthParams>();
+  TestExhaustively<L6R6BitDepthParams>();
+  TestExhaustively<L4R8BitDepthParams>();
   TestExhaustivelyEightBitIntGemm<eight_bit_int_gemm::BitDepthSetting::A8B8>();
   TestExhaustivelyEightBitIntGemm<eight_bit_int_gemm::BitDepthSetting::A5B7>();
   TestKernels();
@@ -1694,6 +2773,32 @@ void test() {
   TestWithSmallDataPerChannelQuantization();
   TestWithLargeDataPerChannelQuantization();
   TestMultithreadedPerChannelQuantization();
+
+  // Test 4-bit LHS inputs.
+  TestNibbleLhs();
+
+  // Test binary and ternary GEMM.
+  TestBitPackedGemm();
+
+  // Test int8 x int16 GEMM.
+  TestInt8Int16Gemm();
+
+  // Test float GEMM with on-the-fly quantization of the RHS.
+  TestHybridFloatGemm();
+
+  // Test GEMMs using an externally owned scratch arena.
+  TestScratchArena();
+  TestScratchArenaNoHeapAllocation();
+  TestScratchTrimming();
+  TestGemmWarmUp();
+  TestCacheSizeDetection();
+  TestL3Blocking();
+  TestL2DepthBlocking();
+  TestTuningTable();
+  TestFixedShapeGemm();
+  TestStageStats();
+  TestCallLog();
+  TestLoadImbalance();
 #ifdef GEMMLOWP_TEST_PROFILE
   FinishProfiling();
 #endif
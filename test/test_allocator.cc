@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <vector>
+
 #include "test.h"
 #include "../internal/allocator.h"
 
@@ -39,14 +41,144 @@ void test_allocator(Allocator* a, int max_array_size) {
   a->Decommit();
 }
 
+// Commits nested scopes of random numbers of blocks, recursively, checking
+// that the blocks of outer scopes keep their contents.
+void test_nested_scopes(Allocator* a, int depth) {
+  const int num_blocks = 1 + Random() % 8;
+  std::vector<Allocator::Handle> handles;
+  std::vector<std::size_t> sizes;
+  for (int i = 0; i < num_blocks; i++) {
+    sizes.push_back(Random() % 1000);
+    handles.push_back(a->Reserve<std::uint8_t>(sizes.back()));
+  }
+  a->Commit();
+  Check(a->scope_depth() == static_cast<std::size_t>(depth) + 1);
+  for (int i = 0; i < num_blocks; i++) {
+    std::uint8_t* block = a->GetPointer<std::uint8_t>(handles[i]);
+    Check(!(reinterpret_cast<std::uintptr_t>(block) % Allocator::kAlignment));
+    memset(block, depth * 16 + i, sizes[i]);
+  }
+  if (depth < 4) {
+    test_nested_scopes(a, depth + 1);
+  }
+  for (int i = 0; i < num_blocks; i++) {
+    const std::uint8_t* block = a->GetPointer<std::uint8_t>(handles[i]);
+    for (std::size_t j = 0; j < sizes[i]; j++) {
+      Check(block[j] == depth * 16 + i);
+    }
+  }
+  a->Decommit();
+}
+
 void test_allocator() {
   Allocator allocator;
 
+  // Nested scopes, and more blocks than the allocator used to be limited to.
+  for (int i = 0; i < 10; i++) {
+    test_nested_scopes(&allocator, 0);
+  }
+  Check(!allocator.committed());
+  std::vector<Allocator::Handle> many_handles;
+  for (int i = 0; i < 100; i++) {
+    many_handles.push_back(allocator.Reserve<std::int32_t>(i));
+  }
+  allocator.Commit();
+  for (int i = 1; i < 100; i++) {
+    Check(allocator.GetPointer<std::int32_t>(many_handles[i]) >=
+          allocator.GetPointer<std::int32_t>(many_handles[i - 1]) + i - 1);
+  }
+  allocator.Decommit();
+
+  // Once the storage has grown to the high water mark, the same sequence of
+  // nested commits reuses it: the innermost blocks land at the same address.
+  std::uint8_t* inner_blocks[3];
+  for (int i = 0; i < 3; i++) {
+    allocator.Reserve<std::uint8_t>(100000);
+    allocator.Commit();
+    auto inner = allocator.Reserve<std::uint8_t>(200000);
+    allocator.Commit();
+    Check(allocator.high_water_mark() >= 300000);
+    inner_blocks[i] = allocator.GetPointer<std::uint8_t>(inner);
+    allocator.Decommit();
+    allocator.Decommit();
+  }
+  Check(inner_blocks[1] == inner_blocks[2]);
+
   // Test allocating increasingly large sizes on the same allocator,
   // starting with size 0.
   for (int i = 1; i < 1000; i += 10) {
     test_allocator(&allocator, i);
   }
+
+  // Same with huge-page backed storage, going up to sizes spanning several
+  // huge pages. Switching back and forth must release the storage with
+  // the matching deallocation function.
+  allocator.set_use_huge_pages(true);
+  for (int i = 1; i < 4000000; i = i * 3 + 1) {
+    test_allocator(&allocator, i);
+  }
+  auto handle = allocator.Reserve<std::uint8_t>(1);
+  allocator.Commit();
+  Check(!(reinterpret_cast<std::uintptr_t>(
+              allocator.GetPointer<std::uint8_t>(handle)) %
+          kHugePageSize));
+  allocator.Decommit();
+  allocator.set_use_huge_pages(false);
+  test_allocator(&allocator, 1000);
+
+  // With external storage, the blocks are carved out of the given buffer.
+  const std::size_t external_size = 8 * 1000 + 2 * Allocator::kAlignment;
+  void* external = aligned_alloc(Allocator::kAlignment, external_size);
+  allocator.set_external_storage(external, external_size);
+  for (int i = 1; i < 1000; i += 10) {
+    test_allocator(&allocator, i);
+  }
+  auto int32_handle = allocator.Reserve<std::int32_t>(10);
+  allocator.Commit();
+  Check(allocator.GetPointer<std::int32_t>(int32_handle) == external);
+  allocator.Decommit();
+  allocator.set_external_storage(nullptr, 0);
+  test_allocator(&allocator, 1000);
+  aligned_free(external);
+
+  // Trimming, retention cap and decay.
+  Allocator trimmed;
+  trimmed.Reserve<std::uint8_t>(1 << 20);
+  trimmed.Commit();
+  trimmed.Decommit();
+  Check(trimmed.storage_size() == 1 << 20);
+  trimmed.Trim(1 << 20);
+  Check(trimmed.storage_size() == 1 << 20);
+  trimmed.Trim(1000);
+  Check(trimmed.storage_size() == 0);
+  trimmed.Reserve<std::uint8_t>(100);
+  trimmed.Commit();
+  trimmed.Decommit();
+  Check(trimmed.storage_size() < 1 << 20);
+
+  trimmed.set_max_retained_bytes(1 << 16);
+  trimmed.Reserve<std::uint8_t>(1 << 20);
+  trimmed.Commit();
+  trimmed.Decommit();
+  Check(trimmed.storage_size() == 0);
+  trimmed.set_max_retained_bytes(std::numeric_limits<std::size_t>::max());
+
+  trimmed.set_decay_commits(3);
+  trimmed.Reserve<std::uint8_t>(1 << 20);
+  trimmed.Commit();
+  trimmed.Decommit();
+  for (int i = 0; i < 3; i++) {
+    Check(trimmed.storage_size() == 1 << 20);
+    trimmed.Reserve<std::uint8_t>(1000 << i);
+    trimmed.Commit();
+    trimmed.Decommit();
+  }
+  Check(trimmed.storage_size() == 0);
+  trimmed.Reserve<std::uint8_t>(100);
+  trimmed.Commit();
+  trimmed.Decommit();
+  // Sized for the peak of the last 3 cycles, 4000 bytes.
+  Check(trimmed.storage_size() == 4096);
 }
 
 }  // namespace gemmlowp
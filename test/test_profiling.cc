@@ -0,0 +1,359 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the lock-free structures that the profiler reads from other
+// threads. Built with GEMMLOWP_TEST_PROFILE, which defines
+// GEMMLOWP_PROFILING.
+
+#include <algorithm>
+#include <atomic>  // NOLINT
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../profiling/pthread_everywhere.h"
+#include "test.h"
+
+#ifndef GEMMLOWP_PROFILING
+#error "test_profiling.cc must be built with GEMMLOWP_TEST_PROFILE"
+#endif
+
+namespace gemmlowp {
+
+// Two sets of labels. The writer pushes a prefix of one of them, then pops
+// it all, so any consistent snapshot is a prefix of one of the sets, never
+// a mix of both.
+const char* const kStackLabels[2][4] = {{"a0", "a1", "a2", "a3"},
+                                        {"b0", "b1", "b2", "b3"}};
+
+struct StackWriterArgs {
+  AtomicProfilingStack* stack;
+  std::atomic<bool>* stop;
+  std::atomic<unsigned>* rounds;
+};
+
+void* StackWriterThreadFunc(void* ptr) {
+  StackWriterArgs* args = static_cast<StackWriterArgs*>(ptr);
+  for (unsigned i = 0; !args->stop->load(); i++) {
+    const char* const* labels = kStackLabels[i % 2];
+    const int size = 1 + i % 4;
+    for (int j = 0; j < size; j++) {
+      args->stack->Push(labels[j]);
+    }
+    for (int j = 0; j < size; j++) {
+      args->stack->Pop();
+    }
+    args->rounds->store(i + 1);
+  }
+  return nullptr;
+}
+
+// Checks that Read, concurrent with a writer, only returns stacks that the
+// writer actually produced.
+void TestAtomicProfilingStackConcurrentRead() {
+  AtomicProfilingStack stack;
+  std::atomic<bool> stop(false);
+  std::atomic<unsigned> rounds(0);
+  StackWriterArgs args = {&stack, &stop, &rounds};
+  pthread_t writer;
+  pthread_create(&writer, nullptr, StackWriterThreadFunc, &args);
+
+  int successful_reads = 0;
+  // Keeps reading until the writer has been scheduled long enough, even
+  // on a single core.
+  for (int i = 0; i < 100000 || rounds.load() < 1000000; i++) {
+    ProfilingStack snapshot;
+    if (!stack.Read(&snapshot)) {
+      Check(snapshot.size == 0);
+      continue;
+    }
+    successful_reads++;
+    Check(snapshot.size <= 4);
+    if (snapshot.size == 0) {
+      continue;
+    }
+    const int set = snapshot.labels[0] == kStackLabels[0][0] ? 0 : 1;
+    for (std::size_t j = 0; j < snapshot.size; j++) {
+      Check(snapshot.labels[j] == kStackLabels[set][j]);
+    }
+  }
+  stop.store(true);
+  pthread_join(writer, nullptr);
+  Check(successful_reads > 0);
+}
+
+// A stack whose writer can be stopped in the middle of a change, as if it
+// were preempted there.
+class StuckProfilingStack : public AtomicProfilingStack {
+ public:
+  void BeginChange() { BeginWrite(); }
+  void EndChange() { EndWrite(); }
+};
+
+// Checks that Read gives up, rather than spinning, while a change is
+// unfinished, and succeeds again once it is finished.
+void TestAtomicProfilingStackReadGivesUp() {
+  StuckProfilingStack stack;
+  stack.Push(kStackLabels[0][0]);
+  ProfilingStack snapshot;
+  Check(stack.Read(&snapshot));
+  Check(snapshot.size == 1 && snapshot.labels[0] == kStackLabels[0][0]);
+
+  // Each call retries kMaxReadAttempts times before returning.
+  stack.BeginChange();
+  Check(!stack.Read(&snapshot));
+  Check(snapshot.size == 0);
+  stack.EndChange();
+  Check(stack.Read(&snapshot));
+  Check(snapshot.size == 1 && snapshot.labels[0] == kStackLabels[0][0]);
+  stack.Pop();
+}
+
+// Labels of trace events, identifying the i-th event recorded as
+// kTraceLabels[i % 7], and its begin as i % 2 == 0. kCapacity is not a
+// multiple of 7, so an event read in place of the one kCapacity events
+// older breaks the sequence.
+const char* const kTraceLabels[7] = {"t0", "t1", "t2", "t3",
+                                     "t4", "t5", "t6"};
+
+void RecordTraceEvent(TraceBuffer* trace, std::uint64_t i) {
+  trace->Record(kTraceLabels[i % 7], i % 2 == 0);
+}
+
+// Checks that events are consecutive ones of RecordTraceEvent, the first
+// one being the first_index-th one.
+void CheckTraceEvents(const std::vector<TraceEvent>& events,
+                      std::uint64_t first_index) {
+  for (std::size_t j = 0; j < events.size(); j++) {
+    const std::uint64_t i = first_index + j;
+    Check(events[j].label == kTraceLabels[i % 7]);
+    Check(events[j].begin == (i % 2 == 0));
+    if (j > 0) {
+      Check(events[j].nanoseconds >= events[j - 1].nanoseconds);
+    }
+  }
+}
+
+// Checks that Read returns only the last kCapacity events once the ring
+// buffer has wrapped around.
+void TestTraceBufferWraparound() {
+  TraceBuffer trace;
+  std::vector<TraceEvent> events;
+  trace.Read(&events);
+  Check(events.empty());
+
+  const std::uint64_t kOverwritten = 100;
+  for (std::uint64_t i = 0; i < TraceBuffer::kCapacity; i++) {
+    RecordTraceEvent(&trace, i);
+  }
+  trace.Read(&events);
+  Check(events.size() == TraceBuffer::kCapacity);
+  CheckTraceEvents(events, 0);
+
+  for (std::uint64_t i = TraceBuffer::kCapacity;
+       i < TraceBuffer::kCapacity + kOverwritten; i++) {
+    RecordTraceEvent(&trace, i);
+  }
+  events.clear();
+  trace.Read(&events);
+  Check(events.size() == TraceBuffer::kCapacity);
+  CheckTraceEvents(events, kOverwritten);
+}
+
+struct TraceWriterArgs {
+  TraceBuffer* trace;
+  std::atomic<bool>* stop;
+  std::atomic<std::uint64_t>* recorded;
+};
+
+void* TraceWriterThreadFunc(void* ptr) {
+  TraceWriterArgs* args = static_cast<TraceWriterArgs*>(ptr);
+  for (std::uint64_t i = 0; !args->stop->load(); i++) {
+    RecordTraceEvent(args->trace, i);
+    args->recorded->store(i + 1);
+  }
+  return nullptr;
+}
+
+// Checks that Read, concurrent with a writer wrapping around the ring
+// buffer, skips the slots being overwritten: the events that it returns
+// are always consecutive ones.
+void TestTraceBufferConcurrentRead() {
+  TraceBuffer trace;
+  std::atomic<bool> stop(false);
+  std::atomic<std::uint64_t> recorded(0);
+  TraceWriterArgs args = {&trace, &stop, &recorded};
+  pthread_t writer;
+  pthread_create(&writer, nullptr, TraceWriterThreadFunc, &args);
+
+  std::vector<TraceEvent> events;
+  for (int i = 0; i < 1000 || recorded.load() < 100 * TraceBuffer::kCapacity;
+       i++) {
+    events.clear();
+    trace.Read(&events);
+    Check(events.size() <= TraceBuffer::kCapacity);
+    if (events.empty()) {
+      continue;
+    }
+    // Find the index of the first event from its label and begin.
+    std::uint64_t first_index = 0;
+    while (kTraceLabels[first_index % 7] != events[0].label ||
+           (first_index % 2 == 0) != events[0].begin) {
+      first_index++;
+    }
+    CheckTraceEvents(events, first_index);
+  }
+  stop.store(true);
+  pthread_join(writer, nullptr);
+}
+
+const char kQuotedLabel[] = "inner \"quoted\\\"";
+
+// A thread's events are lost when it exits, so the traced thread only
+// exits once the trace is written.
+struct TracedThreadArgs {
+  std::atomic<bool>* traced;
+  std::atomic<bool>* may_exit;
+};
+
+void* TracedThreadFunc(void* ptr) {
+  TracedThreadArgs* args = static_cast<TracedThreadArgs*>(ptr);
+  {
+    ScopedProfilingLabel label("worker");
+    ScopedProfilingLabel nested_label("worker nested");
+  }
+  args->traced->store(true);
+  while (!args->may_exit->load()) {
+  }
+  return nullptr;
+}
+
+// Parses the string starting at the quote at str, returning the position
+// after the closing quote, or null if it is malformed.
+const char* ParseJsonString(const char* str, std::string* dst) {
+  if (*str != '"') {
+    return nullptr;
+  }
+  dst->clear();
+  for (const char* c = str + 1; *c; c++) {
+    if (*c == '"') {
+      return c + 1;
+    }
+    if (*c == '\\') {
+      c++;
+      if (*c != '"' && *c != '\\') {
+        return nullptr;
+      }
+    }
+    dst->push_back(*c);
+  }
+  return nullptr;
+}
+
+// Checks that WriteChromeTrace writes well-formed JSON in which, on each
+// thread, the begin and end events are balanced and properly nested.
+void TestWriteChromeTrace() {
+  StartTracing();
+  {
+    ScopedProfilingLabel outer_label("outer");
+    {
+      ScopedProfilingLabel label("before update");
+      label.Update(kQuotedLabel);
+    }
+    std::atomic<bool> traced(false);
+    std::atomic<bool> may_exit(false);
+    TracedThreadArgs args = {&traced, &may_exit};
+    pthread_t thread;
+    pthread_create(&thread, nullptr, TracedThreadFunc, &args);
+    while (!traced.load()) {
+    }
+    const char kPath[] = "test_profiling_trace.json";
+    StopTracing();
+    Check(WriteChromeTrace(kPath));
+    may_exit.store(true);
+    pthread_join(thread, nullptr);
+
+    FILE* file = fopen(kPath, "r");
+    Check(file);
+    std::vector<std::string> lines;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+      lines.push_back(line);
+    }
+    fclose(file);
+    remove(kPath);
+
+    Check(lines.size() >= 2);
+    Check(lines.front() == "{\"traceEvents\":[\n");
+    Check(lines.back() == "],\"displayTimeUnit\":\"ns\"}\n");
+    // The open scopes of each thread.
+    std::map<int, std::vector<std::string>> stacks;
+    std::map<int, double> last_ts;
+    std::vector<std::string> names;
+    for (std::size_t i = 1; i + 1 < lines.size(); i++) {
+      // Every event but the last ends with a comma.
+      const std::string suffix = i + 2 < lines.size() ? "},\n" : "}\n";
+      const std::string& l = lines[i];
+      Check(l.size() > suffix.size() &&
+            l.compare(l.size() - suffix.size(), suffix.size(), suffix) == 0);
+      Check(l.compare(0, 8, "{\"name\":") == 0);
+      std::string name;
+      const char* rest = ParseJsonString(l.c_str() + 8, &name);
+      Check(rest);
+      char ph;
+      double ts;
+      int tid;
+      int consumed = 0;
+      Check(sscanf(rest,
+                   ",\"ph\":\"%c\",\"ts\":%lf,\"pid\":0,\"tid\":%d}%n", &ph,
+                   &ts, &tid, &consumed) == 3);
+      Check(rest + consumed == l.c_str() + l.size() - suffix.size() + 1);
+      Check(ts >= 0 && (!last_ts.count(tid) || ts >= last_ts[tid]));
+      last_ts[tid] = ts;
+      std::vector<std::string>& stack = stacks[tid];
+      if (ph == 'B') {
+        stack.push_back(name);
+        names.push_back(name);
+      } else {
+        Check(ph == 'E');
+        Check(!stack.empty() && stack.back() == name);
+        stack.pop_back();
+      }
+    }
+    // The outer scope is still open.
+    int open_scopes = 0;
+    for (const auto& stack : stacks) {
+      open_scopes += stack.second.size();
+    }
+    Check(open_scopes == 1 && stacks.size() == 2);
+    const std::vector<std::string> expected_names = {
+        "outer", "before update", kQuotedLabel, "worker", "worker nested"};
+    for (const std::string& expected_name : expected_names) {
+      Check(std::count(names.begin(), names.end(), expected_name) == 1);
+    }
+  }
+}
+
+void test_profiling() {
+  TestAtomicProfilingStackConcurrentRead();
+  TestAtomicProfilingStackReadGivesUp();
+  TestTraceBufferWraparound();
+  TestTraceBufferConcurrentRead();
+  TestWriteChromeTrace();
+}
+
+}  // namespace gemmlowp
+
+int main() { gemmlowp::test_profiling(); }
@@ -0,0 +1,157 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// tune_block_params.cc: searches, for each given GEMM shape, the cache sizes
+// to block for, L2 RHS factor and thread count giving the fastest GEMMs,
+// and writes them to a tuning table file that GemmContext::set_tuning_table
+// can use at run time. See internal/tuning_table.h.
+//
+// Usage:
+//   tune_block_params table_file rowsxdepthxcols...
+// e.g.
+//   THREADS=1,2,4 tune_block_params /tmp/table.txt 1024x1024x1024 256x64x256
+//
+// Environment variables:
+//   THREADS: comma-separated thread counts to try (default 1).
+//
+// Entries already in table_file are kept, unless one of the given shapes
+// replaces them.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "test.h"
+
+namespace gemmlowp {
+
+// Minimum duration of each measurement.
+const double kMinMeasurementSecs = 0.05;
+
+// Returns the Gop/s of GEMMs of the given shape on the given context.
+double MeasureGops(GemmContext* context, int rows, int depth, int cols) {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  const auto output_pipeline = MakeStandardOutputPipeline(0, 1, 16);
+  auto run = [&]() {
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t,
+                           DefaultL8R8BitDepthParams>(
+        context, lhs.const_map(), rhs.const_map(), &result.map(), -128, -128,
+        output_pipeline);
+  };
+  // Warm-up, also allocating the scratch storage.
+  run();
+  int iters = 1;
+  while (true) {
+    const double start = real_time_in_seconds();
+    for (int i = 0; i < iters; i++) {
+      run();
+    }
+    const double elapsed = real_time_in_seconds() - start;
+    if (elapsed >= kMinMeasurementSecs) {
+      return 2e-9 * rows * depth * cols * iters / elapsed;
+    }
+    iters *= 2;
+  }
+}
+
+TunedBlockParams Tune(int rows, int depth, int cols,
+                      const std::vector<int>& thread_counts) {
+  static const int kL1Bytes[] = {16 * 1024, 32 * 1024, 48 * 1024, 64 * 1024};
+  static const int kL2Bytes[] = {256 * 1024,      512 * 1024,
+                                 1024 * 1024,     2 * 1024 * 1024,
+                                 4 * 1024 * 1024, 8 * 1024 * 1024};
+  static const float kL2RhsFactors[] = {0.5f, 0.75f, 1.0f};
+
+  TunedBlockParams best;
+  double best_gops = 0;
+  for (int threads : thread_counts) {
+    for (int l1_bytes : kL1Bytes) {
+      for (int l2_bytes : kL2Bytes) {
+        for (float l2_rhs_factor : kL2RhsFactors) {
+          GemmContext context;
+          context.set_max_num_threads(threads);
+          context.set_l1_bytes_to_use(l1_bytes);
+          context.set_l2_bytes_to_use(l2_bytes);
+          context.set_l2_rhs_factor(l2_rhs_factor);
+          const double gops = MeasureGops(&context, rows, depth, cols);
+          if (gops > best_gops) {
+            best_gops = gops;
+            best.l1_bytes_to_use = l1_bytes;
+            best.l2_bytes_to_use = l2_bytes;
+            best.l2_rhs_factor = l2_rhs_factor;
+            best.max_num_threads = threads;
+          }
+        }
+      }
+    }
+  }
+
+  GemmContext default_context;
+  default_context.set_max_num_threads(best.max_num_threads);
+  const double default_gops =
+      MeasureGops(&default_context, rows, depth, cols);
+  printf(
+      "%dx%dx%d: %.3f Gop/s with l1_bytes=%d l2_bytes=%d l2_rhs_factor=%g "
+      "threads=%d (default cache settings: %.3f Gop/s)\n",
+      rows, depth, cols, best_gops, best.l1_bytes_to_use, best.l2_bytes_to_use,
+      best.l2_rhs_factor, best.max_num_threads, default_gops);
+  fflush(stdout);
+  return best;
+}
+
+int TuneMain(int argc, char* argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s table_file rowsxdepthxcols...\n", argv[0]);
+    return 1;
+  }
+  std::vector<int> thread_counts;
+  const char* threads_env = getenv("THREADS");
+  for (const char* p = threads_env ? threads_env : "1"; *p;) {
+    char* end;
+    const long threads = strtol(p, &end, 10);
+    if (end == p || threads <= 0) {
+      fprintf(stderr, "Malformed THREADS: %s\n", threads_env);
+      return 1;
+    }
+    thread_counts.push_back(static_cast<int>(threads));
+    p = *end == ',' ? end + 1 : end;
+  }
+
+  const char* table_file = argv[1];
+  TuningTable table;
+  table.LoadFromFile(table_file);
+  for (int i = 2; i < argc; i++) {
+    int rows, depth, cols;
+    if (sscanf(argv[i], "%dx%dx%d", &rows, &depth, &cols) != 3 || rows <= 0 ||
+        depth <= 0 || cols <= 0) {
+      fprintf(stderr, "Malformed shape: %s\n", argv[i]);
+      return 1;
+    }
+    table.Add(rows, depth, cols, Tune(rows, depth, cols, thread_counts));
+  }
+  if (!table.SaveToFile(table_file)) {
+    fprintf(stderr, "Could not write %s\n", table_file);
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace gemmlowp
+
+int main(int argc, char* argv[]) { return gemmlowp::TuneMain(argc, argv); }